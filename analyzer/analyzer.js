@@ -48,7 +48,7 @@ function EBMLReader(buffer) {
 EBMLReader.prototype = {
     get isLastSibling() {
         if (!this._stack.length)
-            return false;   // FIXME: broken on the top level - use file size
+            return this._pos + this.size >= this._array.length;
 
         var parent = this._stack[this._stack.length - 1];
         return this._pos + this.size >= parent.pos + parent.size;
@@ -150,8 +150,8 @@ EBMLReader.prototype = {
 function Model(buffer) {
     this._buffer = buffer;
     this._reader = new EBMLReader(buffer);
-    this._maps = this._loadMemoryMap();
-    this._symbols = this._loadSymbols();
+    this._processes = this._loadMemoryMaps();
+    this._loadSymbols();
 
     var samples = this._loadSamples();
     this.threads = samples.threads;
@@ -171,26 +171,48 @@ Model.prototype = {
     EBML_MODULE_NAME_TAG: 0x8a,
     EBML_SYMBOL_TAG: 0x8b,
     EBML_THREAD_PID_TAG: 0x8c,
-
-    _loadMemoryMap: function() {
+    EBML_SAMPLE_TIMING_TAG: 0x91,
+    EBML_SAMPLE_WEIGHT_TAG: 0x92,
+    EBML_SAME_STACK_TAG: 0x93,
+    EBML_PROCESS_PID_TAG: 0x95,
+    EBML_RAW_REGISTERS_TAG: 0x96,
+
+    // Loads the memory map of every process, keyed by PID. Older profiles
+    // have a single map with no PID in it; that one goes under 0.
+    _loadMemoryMaps: function() {
         this._reader.reset();
-        while (this._reader.tag !== this.EBML_MEMORY_MAP_TAG)
-            this._reader.moveToNextSibling();
-        this._reader.moveToFirstChild();
+        var processes = {};
+        this._defaultPID = null;
+        while (true) {
+            if (this._reader.tag === this.EBML_MEMORY_MAP_TAG) {
+                var maps = {}, pid = 0;
+                this._reader.forEachChild(function() {
+                    if (this._reader.tag == this.EBML_PROCESS_PID_TAG) {
+                        pid = this._reader.readUInt32(0);
+                        return;
+                    }
+                    if (this._reader.tag != this.EBML_MEMORY_REGION_TAG)
+                        return;
+
+                    var name = this._reader.readCString(12);
+                    maps[name] = {
+                        start: this._reader.readUInt32(0),
+                        end: this._reader.readUInt32(4),
+                        offset: this._reader.readUInt32(8)
+                    };
+                }, this);
 
-        var maps = {};
-        while (!this._reader.isLastSibling) {
-            var name = this._reader.readCString(12);
-            maps[name] = {
-                start: this._reader.readUInt32(0),
-                end: this._reader.readUInt32(4),
-                offset: this._reader.readUInt32(8)
-            };
+                processes[pid] = { maps: maps, symbols: [] };
+                if (this._defaultPID === null)
+                    this._defaultPID = pid;
+            }
 
+            if (this._reader.isLastSibling)
+                break;
             this._reader.moveToNextSibling();
         }
 
-        return maps;
+        return processes;
     },
 
     _loadSamples: function() {
@@ -198,18 +220,30 @@ Model.prototype = {
         while (this._reader.tag !== this.EBML_SAMPLES_TAG)
             this._reader.moveToNextSibling();
 
-        var threads = {}, totalSamples = 0;
+        var threads = {}, totalSamples = 0, lastStacks = {};
         this._reader.forEachChild(function() {
             if (this._reader.tag != this.EBML_SAMPLE_TAG)
                 throw new Error("_loadSamples: non-sample in sample list");
 
+            // Samples taken at different rates are weighted by the time they
+            // stand for. Older profiles have no weights; count those as 1.
+            var weight = 1;
             this._reader.forEachChild(function() {
+                // Timing information isn't used yet.
+                if (this._reader.tag == this.EBML_SAMPLE_TIMING_TAG)
+                    return;
+                if (this._reader.tag == this.EBML_SAMPLE_WEIGHT_TAG) {
+                    weight = this._reader.readUInt32(0);
+                    return;
+                }
+
                 if (this._reader.tag != this.EBML_THREAD_SAMPLE_TAG) {
                     throw new Error("_loadSamples: non-thread sample in " +
                         "sample list");
                 }
 
-                var threadPID, threadRunning, stack;
+                var threadPID, threadRunning, stack, sameStack = false;
+                var threadWeight = weight, processPID = this._defaultPID;
                 this._reader.forEachChild(function() {
                     switch (this._reader.tag) {
                     case this.EBML_THREAD_PID_TAG:
@@ -220,14 +254,40 @@ Model.prototype = {
                         break;
                     case this.EBML_STACK_TAG:
                         stack = [];
-                        for (var i = 0; i < this._reader.size; i += 4) {
-                            var addr = this._reader.readUInt32(i);
-                            stack.push(this._symbolicateAddress(addr));
-                        }
+                        for (var i = 0; i < this._reader.size; i += 4)
+                            stack.push(this._reader.readUInt32(i));
+                        break;
+                    case this.EBML_PROCESS_PID_TAG:
+                        processPID = this._reader.readUInt32(0);
+                        break;
+                    case this.EBML_RAW_REGISTERS_TAG:
+                        // Not run through piranha-unwind yet; all we have
+                        // is the PC.
+                        if (!stack)
+                            stack = [this._reader.readUInt32(0) - 4];
+                        break;
+                    case this.EBML_SAMPLE_WEIGHT_TAG:
+                        // Threads sampled less often weigh more.
+                        threadWeight = this._reader.readUInt32(0);
+                        break;
+                    case this.EBML_SAME_STACK_TAG:
+                        // The thread hasn't run since its last sample.
+                        sameStack = true;
                         break;
                     }
                 }, this);
 
+                if (stack) {
+                    stack = stack.map(function(addr) {
+                        return this._symbolicateAddress(processPID, addr);
+                    }, this);
+                }
+                if (sameStack)
+                    stack = lastStacks[threadPID];
+                if (!stack)
+                    return;
+                lastStacks[threadPID] = stack;
+
                 if (!(threadPID in threads)) {
                     threads[threadPID] = {
                         heavy: { c: {} },
@@ -242,7 +302,7 @@ Model.prototype = {
                     if (!(symbol in node.c))
                         node.c[symbol] = { n: 0, c: {} };
                     node = node.c[symbol];
-                    node.n++;
+                    node.n += threadWeight;
                 }
 
                 // And to the appropriate top-down call stack.
@@ -252,11 +312,11 @@ Model.prototype = {
                     if (!(symbol in node.c))
                         node.c[symbol] = { n: 0, c: {} };
                     node = node.c[symbol];
-                    node.n++;
+                    node.n += threadWeight;
                 }
             }, this);
 
-            totalSamples++;
+            totalSamples += weight;
         }, this);
 
         return { threads: threads, totalSamples: totalSamples };
@@ -269,7 +329,6 @@ Model.prototype = {
         }
 
         // Find all the modules.
-        var symbols = [];
         this._reader.forEachChild(function() {
             if (this._reader.tag != this.EBML_MODULE_TAG)
                 throw new Error("_loadSymbols: non-module in module list");
@@ -293,45 +352,62 @@ Model.prototype = {
             if (moduleName == null)
                 throw new Error("Unnamed module found!");
 
-            var module = this._maps[moduleName];
-            if (!module) {
+            // A library can be loaded at a different address in each
+            // process.
+            var found = false;
+            for (var pid in this._processes) {
+                var process = this._processes[pid];
+                var module = process.maps[moduleName];
+                if (!module)
+                    continue;
+
+                found = true;
+                moduleSymbols.forEach(function(symbol) {
+                    process.symbols.push({
+                        module: moduleName,
+                        name: symbol.name,
+                        addr: module.start - module.offset + symbol.addr
+                    });
+                }, this);
+            }
+
+            if (!found) {
                 throw new Error("No module info found for '" + moduleName +
                     "'");
             }
-
-            moduleSymbols.forEach(function(symbol) {
-                symbols.push({
-                    module: moduleName,
-                    name: symbol.name,
-                    addr: module.start - module.offset + symbol.addr
-                });
-            }, this);
         }, this);
 
-        symbols.sort(function(a, b) { return a.addr - b.addr; });
-        return symbols;
+        for (var pid in this._processes) {
+            this._processes[pid].symbols.sort(function(a, b) {
+                return a.addr - b.addr;
+            });
+        }
     },
 
-    _symbolicateAddress: function(addr) {
+    _symbolicateAddress: function(pid, addr) {
+        var process = this._processes[pid] ||
+            this._processes[this._defaultPID];
+        var symbols = process.symbols;
+
         // Binary search to find the right symbol.
-        var lo = 0, hi = this._symbols.length;
+        var lo = 0, hi = symbols.length;
         while (lo < hi) {
             var mid = ((lo + hi) / 2) | 0;
-            var loAddr = this._symbols[mid].addr;
+            var loAddr = symbols[mid].addr;
             if (addr < loAddr) {
                 hi = mid;
                 continue;
             }
 
-            var hiAddr = (mid == this._symbols.length - 1) ?
-                this._maps[this._symbols[mid].module].end :
-                this._symbols[mid+1].addr;
+            var hiAddr = (mid == symbols.length - 1) ?
+                process.maps[symbols[mid].module].end :
+                symbols[mid+1].addr;
             if (addr >= hiAddr) {
                 lo = mid + 1;
                 continue;
             }
 
-            var symbol = this._symbols[mid];
+            var symbol = symbols[mid];
             if (addr >= symbol.addr + MAX_FUNCTION_SIZE)
                 break;
             // TODO: include module name as well
@@ -0,0 +1,316 @@
+/*
+ * piranha/agent.c
+ *
+ * In-process sampling agent. Start the target with
+ * LD_PRELOAD=libpiranha-agent.so (or use piranha -A) and profile it with
+ * piranha -b agent. Each thread gets a timer on its own CPU time that sends
+ * it SIGPROF; the handler copies the registers and the top of the stack
+ * into the thread's ring (see agent.h) for piranha to unwind, so the target
+ * never has to be stopped.
+ *
+ * Copyright (c) 2011 Mozilla Foundation
+ */
+
+#include <asm/sigcontext.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "agent.h"
+
+#ifndef SIGEV_THREAD_ID
+#define SIGEV_THREAD_ID         4
+#endif
+
+#define MAPS_LINE_SIZE          512
+
+// The kernel's struct sigevent. Bionic has no way to ask for SIGEV_THREAD_ID
+// through its own, so we make the timer syscalls ourselves.
+struct kernel_sigevent {
+    union sigval value;
+    int signo;
+    int notify;
+    int tid;
+    int pad[12];
+};
+
+// The ARM kernel's struct ucontext, as far as the registers.
+struct kernel_ucontext {
+    unsigned long flags;
+    struct kernel_ucontext *link;
+    stack_t stack;
+    struct sigcontext mcontext;
+};
+
+static struct agent_ring *ring;
+static char ring_path[PATH_MAX];
+static pthread_key_t thread_key;
+static int (*real_pthread_create)(pthread_t *, const pthread_attr_t *,
+                                  void *(*)(void *), void *);
+
+// What the signal handler needs to know about the thread in each slot.
+static pid_t slot_tids[AGENT_MAX_THREADS];
+static uint32_t slot_stack_starts[AGENT_MAX_THREADS];
+static uint32_t slot_stack_ends[AGENT_MAX_THREADS];
+static int slot_timers[AGENT_MAX_THREADS];
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Runs on the sampled thread, at any point in its execution, so it only
+// touches the thread's own slot and doesn't call anything that isn't
+// async-signal-safe.
+static void handle_sigprof(int signo, siginfo_t *info, void *context)
+{
+    int index = info->si_value.sival_int;
+    if (!ring || info->si_code != SI_TIMER || index < 0 ||
+            index >= AGENT_MAX_THREADS)
+        return;
+
+    struct agent_slot *slot = &ring->slots[index];
+    if (slot->state != AGENT_SLOT_ACTIVE)
+        return;
+
+    uint32_t head = slot->head;
+    if (head - slot->tail >= AGENT_RING_RECORDS) {
+        slot->lost++;
+        return;
+    }
+
+    int saved_errno = errno;
+    struct agent_record *record =
+        &slot->records[head % AGENT_RING_RECORDS];
+    struct sigcontext *regs = &((struct kernel_ucontext *)context)->mcontext;
+    record->time_ns = now_ns();
+    record->tid = slot_tids[index];
+    record->pc = regs->arm_pc;
+    record->lr = regs->arm_lr;
+    record->sp = regs->arm_sp;
+
+    // Only copy what is known to be stack, so that a stray stack pointer
+    // can't fault.
+    uint32_t words = 0;
+    if (record->sp >= slot_stack_starts[index] &&
+            record->sp < slot_stack_ends[index])
+        words = (slot_stack_ends[index] - record->sp) / 4;
+    if (words > AGENT_STACK_WORDS)
+        words = AGENT_STACK_WORDS;
+    memcpy(record->stack, (const void *)record->sp, words * 4);
+    record->stack_words = words;
+
+    // Publish the record only once it's complete.
+    __sync_synchronize();
+    slot->head = head + 1;
+    errno = saved_errno;
+}
+
+// Finds the mapping that contains the given stack address.
+static bool find_stack(uint32_t addr, uint32_t *start, uint32_t *end)
+{
+    FILE *f = fopen("/proc/self/maps", "r");
+    if (!f)
+        return false;
+
+    bool found = false;
+    char line[MAPS_LINE_SIZE];
+    while (!found && fgets(line, sizeof(line), f)) {
+        unsigned int map_start, map_end;
+        if (sscanf(line, "%x-%x", &map_start, &map_end) == 2 &&
+                addr >= map_start && addr < map_end) {
+            *start = map_start;
+            *end = map_end;
+            found = true;
+        }
+    }
+
+    fclose(f);
+    return found;
+}
+
+// Gives the calling thread a slot in the ring and a timer on its CPU time
+// that sends it SIGPROF.
+static void start_thread()
+{
+    int index;
+    for (index = 0; index < AGENT_MAX_THREADS; index++) {
+        if (__sync_bool_compare_and_swap(&ring->slots[index].state,
+                                         AGENT_SLOT_FREE, AGENT_SLOT_ACTIVE))
+            break;
+    }
+    if (index == AGENT_MAX_THREADS) {
+        __sync_fetch_and_add(&ring->unsampled_threads, 1);
+        return;
+    }
+
+    uint32_t local;
+    slot_tids[index] = syscall(__NR_gettid);
+    if (!find_stack((uint32_t)&local, &slot_stack_starts[index],
+                    &slot_stack_ends[index]))
+        slot_stack_starts[index] = slot_stack_ends[index] = 0;
+
+    struct kernel_sigevent sev;
+    memset(&sev, '\0', sizeof(sev));
+    sev.value.sival_int = index;
+    sev.signo = SIGPROF;
+    sev.notify = SIGEV_THREAD_ID;
+    sev.tid = slot_tids[index];
+
+    struct itimerspec itspec;
+    itspec.it_interval.tv_sec = ring->period_ns / 1000000000;
+    itspec.it_interval.tv_nsec = ring->period_ns % 1000000000;
+    itspec.it_value = itspec.it_interval;
+
+    if (syscall(__NR_timer_create, CLOCK_THREAD_CPUTIME_ID, &sev,
+                &slot_timers[index]) ||
+            syscall(__NR_timer_settime, slot_timers[index], 0, &itspec,
+                    NULL)) {
+        perror("piranha agent: Failed to start the sampling timer");
+        ring->slots[index].state = AGENT_SLOT_FREE;
+        return;
+    }
+
+    pthread_setspecific(thread_key, (void *)(intptr_t)(index + 1));
+}
+
+// Called as a thread exits. Its slot stays put until piranha has read the
+// last of its samples.
+static void stop_thread(void *value)
+{
+    int index = (intptr_t)value - 1;
+    if (!ring)
+        return;
+    syscall(__NR_timer_delete, slot_timers[index]);
+    __sync_synchronize();
+    ring->slots[index].state = AGENT_SLOT_DRAINING;
+}
+
+struct thread_start {
+    void *(*routine)(void *);
+    void *arg;
+};
+
+static void *run_thread(void *arg)
+{
+    struct thread_start start = *(struct thread_start *)arg;
+    free(arg);
+    if (ring)
+        start_thread();
+    return start.routine(start.arg);
+}
+
+// Every thread starts out in run_thread(), which sets up its sampling.
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*routine)(void *), void *arg)
+{
+    if (!real_pthread_create)
+        real_pthread_create = dlsym(RTLD_NEXT, "pthread_create");
+
+    struct thread_start *start;
+    if (!ring || !(start = malloc(sizeof(*start))))
+        return real_pthread_create(thread, attr, routine, arg);
+
+    start->routine = routine;
+    start->arg = arg;
+    int err = real_pthread_create(thread, attr, run_thread, start);
+    if (err)
+        free(start);
+    return err;
+}
+
+// Creates and maps the ring file for this process. The magic number goes
+// in last, so that piranha never sees a ring that isn't ready.
+static bool open_ring()
+{
+    const char *dir = getenv(AGENT_DIR_ENV);
+    if (!dir)
+        dir = AGENT_DEFAULT_DIR;
+    snprintf(ring_path, sizeof(ring_path), AGENT_RING_PATH_FORMAT, dir,
+             (int)getpid());
+
+    // A ring left behind by an earlier process with our PID is of no use.
+    // The ring is ours alone; piranha has to run as our user or as root.
+    unlink(ring_path);
+    int fd = open(ring_path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        perror("piranha agent: Failed to create the ring");
+        return false;
+    }
+
+    void *mem = MAP_FAILED;
+    if (!ftruncate(fd, sizeof(struct agent_ring)))
+        mem = mmap(NULL, sizeof(struct agent_ring), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror("piranha agent: Failed to map the ring");
+        unlink(ring_path);
+        return false;
+    }
+
+    struct agent_ring *new_ring = mem;
+    const char *hz_str = getenv(AGENT_HZ_ENV);
+    uint32_t hz = hz_str ? strtoul(hz_str, NULL, 0) : 0;
+    new_ring->version = AGENT_VERSION;
+    new_ring->pid = getpid();
+    new_ring->period_ns = 1000000000 / (hz ? hz : AGENT_DEFAULT_HZ);
+    __sync_synchronize();
+    new_ring->magic = AGENT_MAGIC;
+
+    ring = new_ring;
+    return true;
+}
+
+// The ring belongs to the parent, and timers aren't inherited anyway, so a
+// forked child just isn't sampled.
+static void forget_ring()
+{
+    ring = NULL;
+}
+
+__attribute__((constructor))
+static void start_agent()
+{
+    if (!open_ring())
+        return;
+
+    struct sigaction sa;
+    memset(&sa, '\0', sizeof(sa));
+    sa.sa_sigaction = handle_sigprof;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) ||
+            pthread_key_create(&thread_key, stop_thread)) {
+        perror("piranha agent: Failed to set up sampling");
+        munmap(ring, sizeof(struct agent_ring));
+        unlink(ring_path);
+        ring = NULL;
+        return;
+    }
+
+    pthread_atfork(NULL, NULL, forget_ring);
+    start_thread();
+}
+
+__attribute__((destructor))
+static void stop_agent()
+{
+    if (ring)
+        unlink(ring_path);
+}
@@ -0,0 +1,74 @@
+/*
+ * piranha/agent.h
+ *
+ * The layout of the shared-memory ring between the in-process sampling
+ * agent (agent.c, loaded into the target with LD_PRELOAD) and piranha's
+ * agent backend (-b agent).
+ *
+ * The agent creates the ring file for its process and maps it shared;
+ * piranha maps the same file and drains it. Each sampled thread gets a slot
+ * of its own, so every ring has a single producer (the thread's SIGPROF
+ * handler) and a single consumer (piranha), and neither side takes a lock:
+ * the agent only ever writes head and piranha only ever writes tail.
+ *
+ * Copyright (c) 2011 Mozilla Foundation
+ */
+
+#ifndef AGENT_H
+#define AGENT_H
+
+#include <stdint.h>
+
+#define AGENT_MAGIC             0x70697261  // "pira"
+#define AGENT_VERSION           1
+
+// Where the ring files live, unless PIRANHA_AGENT_DIR says otherwise. Both
+// sides have to be able to get at it. A ring is only readable by the target's
+// user, and piranha ignores rings that anyone else owns or can write to.
+#define AGENT_DIR_ENV           "PIRANHA_AGENT_DIR"
+#define AGENT_DEFAULT_DIR       "/data/local/tmp"
+#define AGENT_RING_PATH_FORMAT  "%s/piranha-agent-%d.ring"
+
+// The sampling rate, in samples per second of a thread's CPU time.
+#define AGENT_HZ_ENV            "PIRANHA_AGENT_HZ"
+#define AGENT_DEFAULT_HZ        1000
+
+#define AGENT_MAX_THREADS       64
+#define AGENT_RING_RECORDS      8           // per thread; a power of two
+#define AGENT_STACK_WORDS       1024        // copied from the top of stack
+
+#define AGENT_SLOT_FREE         0
+#define AGENT_SLOT_ACTIVE       1
+#define AGENT_SLOT_DRAINING     2           // thread exited; free when empty
+
+// One sample: the registers that seed the unwind and a copy of the top of
+// the stack, as with perf's PERF_SAMPLE_STACK_USER.
+struct agent_record {
+    uint64_t time_ns;           // CLOCK_MONOTONIC
+    uint32_t tid;
+    uint32_t pc;
+    uint32_t lr;
+    uint32_t sp;
+    uint32_t stack_words;       // how many of stack[] are valid
+    uint32_t stack[AGENT_STACK_WORDS];
+};
+
+struct agent_slot {
+    volatile uint32_t state;
+    volatile uint32_t head;     // records written; agent only
+    volatile uint32_t tail;     // records read; piranha only
+    volatile uint32_t lost;     // samples dropped because the ring was full
+    uint32_t lost_seen;         // piranha only
+    struct agent_record records[AGENT_RING_RECORDS];
+};
+
+struct agent_ring {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t pid;
+    uint32_t period_ns;
+    volatile uint32_t unsampled_threads;    // threads that got no slot
+    struct agent_slot slots[AGENT_MAX_THREADS];
+};
+
+#endif
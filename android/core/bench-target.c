@@ -0,0 +1,94 @@
+/*
+ * piranha/bench-target.c
+ *
+ * A dummy process for the sampler benchmark (make bench). It starts the
+ * given number of threads, 16 unless told otherwise: one burns CPU, a
+ * quarter wake up every millisecond and the rest block in read(), each a
+ * few frames deep so that there is something to unwind. It runs until the
+ * process that started it (piranha -- piranha-bench-target) exits.
+ *
+ * Copyright (c) 2011 Mozilla Foundation
+ */
+
+#include <sys/prctl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_THREADS         16
+#define STACK_DEPTH             8
+#define NAP_WORK                20000
+
+int block_pipe[2];
+volatile unsigned long sink;
+
+void *spin(void *arg)
+{
+    while (1)
+        sink++;
+    return NULL;
+}
+
+void *nap(void *arg)
+{
+    struct timespec nap_time = { 0, 1000000 };
+    while (1) {
+        for (int i = 0; i < NAP_WORK; i++)
+            sink++;
+        nanosleep(&nap_time, NULL);
+    }
+    return NULL;
+}
+
+void *block(void *arg)
+{
+    char ch;
+    read(block_pipe[0], &ch, sizeof(ch));
+    return NULL;
+}
+
+// Calls the thread's real body from under a few frames of its own.
+void *descend(void *body, int depth)
+{
+    if (!depth)
+        return ((void *(*)(void *))body)(NULL);
+    void *result = descend(body, depth - 1);
+    sink++;
+    return result;
+}
+
+void *run_thread(void *body)
+{
+    return descend(body, STACK_DEPTH);
+}
+
+int main(int argc, char **argv)
+{
+    int thread_count = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+    if (thread_count < 1) {
+        fprintf(stderr, "usage: piranha-bench-target [THREADS]\n");
+        return 1;
+    }
+
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (pipe(block_pipe)) {
+        perror("pipe() failed");
+        return 1;
+    }
+
+    for (int i = 0; i < thread_count; i++) {
+        void *body = !i ? spin : i % 4 == 1 ? nap : block;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, run_thread, body)) {
+            fprintf(stderr, "Failed to start thread %d\n", i);
+            return 1;
+        }
+    }
+
+    while (1)
+        pause();
+    return 0;
+}
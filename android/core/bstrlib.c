@@ -26,7 +26,8 @@
 
 /* Optionally include a mechanism for debugging memory */
 
-#if defined(MEMORY_DEBUG) || defined(BSTRLIB_MEMORY_DEBUG)
+#if defined(MEMORY_DEBUG) || defined(BSTRLIB_MEMORY_DEBUG) || \
+    defined(PIRANHA_COUNT_ALLOCS)
 #include "memdbg.h"
 #endif
 
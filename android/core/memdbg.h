@@ -0,0 +1,26 @@
+/*
+ * piranha/memdbg.h
+ *
+ * Allocation counting hooks. bstrlib.c and unwind.c include this when
+ * piranha is built with PIRANHA_COUNT_ALLOCS, so that every bstring and
+ * unwind table allocation goes through the counted_*() functions in
+ * piranha.c.
+ *
+ * Copyright (c) 2011 Mozilla Foundation
+ */
+
+#ifndef MEMDBG_H
+#define MEMDBG_H
+
+#include <stddef.h>
+
+extern unsigned long allocation_count;
+
+void *counted_malloc(size_t size);
+void *counted_calloc(size_t count, size_t size);
+void *counted_realloc(void *ptr, size_t size);
+
+#define bstr__alloc(x)          counted_malloc (x)
+#define bstr__realloc(p,x)      counted_realloc ((p), (x))
+
+#endif
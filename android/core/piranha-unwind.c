@@ -0,0 +1,851 @@
+/*
+ * piranha/piranha-unwind.c
+ *
+ * Unwinds the raw stacks in a profile taken with piranha -U, on the host.
+ * Each RAW_REGISTERS and RAW_STACK pair becomes the STACK that piranha would
+ * have written, using the same unwinder (unwind.c) but reading code from
+ * copies of the device's binaries instead of from the live process.
+ * piranha writes a process's memory map again whenever it changes, between
+ * SAMPLES elements, and each sample is unwound against the last map of its
+ * process before it. The SAMPLES elements become one, where the first one
+ * was. Everything else in the profile is copied as is.
+ *
+ * Copyright (c) 2011 Mozilla Foundation
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bstrlib.h"
+#include "unwind.h"
+
+// These match piranha.c.
+#define EBML_MEMORY_MAP_TAG     0x81          // root level
+#define EBML_MEMORY_REGION_TAG  0x82          // contained by MEMORY_MAP
+#define EBML_SAMPLES_TAG        0x83          // root level
+#define EBML_SAMPLE_TAG         0x84          // contained by SAMPLES
+#define EBML_THREAD_SAMPLE_TAG  0x85          // contained by SAMPLE
+#define EBML_STACK_TAG          0x87          // contained by THREAD_SAMPLE
+#define EBML_PROCESS_PID_TAG    0x95          // contained by MEMORY_MAP,
+                                              // THREAD_SAMPLE and THREAD
+#define EBML_RAW_REGISTERS_TAG  0x96          // contained by THREAD_SAMPLE
+#define EBML_RAW_STACK_TAG      0x97          // contained by THREAD_SAMPLE
+#define EBML_THREAD_ENTRY_TAG   0x98          // root level
+
+#define EBML_MAX_SIZE           0x0fffffff    // with piranha's 4-byte sizes
+
+#define MAX_WORKERS             64
+#define CHUNKS_PER_WORKER       8
+
+struct element {
+    uint32_t id;
+    const uint8_t *start;   // of the ID
+    uint32_t id_length;
+    const uint8_t *data;
+    uint32_t size;
+};
+
+// A copy of a binary from the device, mapped into memory.
+struct module {
+    bstring name;           // the path on the device
+    const uint8_t *data;    // NULL if there's no copy
+    size_t size;
+};
+
+// The memory map of a process that is in effect.
+struct process_maps {
+    uint32_t pid;
+    bstring maps;           // of struct map, in address order
+    bstring modules;        // the struct module * for each map
+    const uint8_t *source;  // the MEMORY_MAP element it was read from
+};
+
+struct unwind_info {
+    const char *binary_dir;     // -b
+    const char *sysroot;        // -r
+    const char *frame_pointer_modules;      // -p
+    bstring modules;            // of struct module *
+    bstring processes;          // of struct process_maps *
+    struct process_maps *default_process;   // for samples without a PID
+    uint32_t thread_entry_offset;
+};
+
+// A run of consecutive samples, unwound by one worker into a buffer of its
+// own.
+struct chunk {
+    uint32_t first;
+    uint32_t end;
+    bstring out;
+    bool ok;
+};
+
+struct pool {
+    struct unwind_info *info;
+    const struct element *samples;
+    struct chunk *chunks;
+    uint32_t chunk_count;
+    volatile uint32_t claimed;
+};
+
+struct stats {
+    uint32_t samples;
+    uint32_t stacks;
+    uint64_t frames;
+    uint32_t missing_modules;
+    struct unwind_stats unwind;
+};
+
+struct stats stats;
+
+//
+// EBML reading
+//
+
+// Reads a variable-length integer. IDs keep their length marker; sizes
+// don't.
+bool read_vint(const uint8_t **p, const uint8_t *end, bool keep_marker,
+               uint32_t *out, uint32_t *length_out)
+{
+    if (*p >= end)
+        return false;
+
+    uint8_t first = **p;
+    uint32_t length = 1;
+    while (length <= 4 && !(first & (0x80 >> (length - 1))))
+        length++;
+    if (length > 4 || end - *p < length)
+        return false;
+
+    uint32_t val = keep_marker ? first : first & (0xff >> length);
+    for (uint32_t i = 1; i < length; i++)
+        val = (val << 8) | (*p)[i];
+
+    *p += length;
+    *out = val;
+    if (length_out)
+        *length_out = length;
+    return true;
+}
+
+// Reads the element at *p, if there is a whole one before end, and moves *p
+// past it.
+bool next_element(const uint8_t **p, const uint8_t *end, struct element *el)
+{
+    const uint8_t *q = *p;
+    el->start = q;
+    if (!read_vint(&q, end, true, &el->id, &el->id_length) ||
+            !read_vint(&q, end, false, &el->size, NULL) ||
+            end - q < el->size)
+        return false;
+
+    el->data = q;
+    *p = q + el->size;
+    return true;
+}
+
+uint32_t read_uint32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+//
+// EBML writing, into memory
+//
+
+// Starts an element, with a placeholder size; returns where the size goes.
+int start_element(bstring out, const struct element *el)
+{
+    static const uint8_t zero[4];
+    if (bcatblk(out, el->start, el->id_length) != BSTR_OK)
+        return -1;
+    int offset = out->slen;
+    if (bcatblk(out, zero, sizeof(zero)) != BSTR_OK)
+        return -1;
+    return offset;
+}
+
+bool end_element(bstring out, int offset)
+{
+    uint32_t size = out->slen - offset - 4;
+    if (size > EBML_MAX_SIZE) {
+        fprintf(stderr, "piranha-unwind: element too large\n");
+        return false;
+    }
+
+    uint8_t *p = out->data + offset;
+    p[0] = 0x10 | ((size >> 24) & 0xf);
+    p[1] = (size >> 16) & 0xff;
+    p[2] = (size >> 8) & 0xff;
+    p[3] = size & 0xff;
+    return true;
+}
+
+bool copy_element(bstring out, const struct element *el)
+{
+    return bcatblk(out, el->start, el->data + el->size - el->start) ==
+        BSTR_OK;
+}
+
+//
+// Binaries
+//
+
+// Maps the file at path, if there is one.
+bool map_file(const char *path, struct module *module)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    bool ok = false;
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size)
+        goto out;
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("Couldn't map a binary");
+        goto out;
+    }
+
+    module->data = data;
+    module->size = st.st_size;
+    ok = true;
+
+out:
+    close(fd);
+    return ok;
+}
+
+// Looks for a copy of the binary that was at name on the device: by its
+// file name under -b, under -r (either at its full path or, as in
+// piranha-symbolicate's cache of system libraries, without the leading
+// "/system"), and finally at the same path here.
+void find_module(struct unwind_info *info, struct module *module)
+{
+    const char *name = (const char *)module->name->data;
+    const char *base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+    const char *rest = strchr(name + 1, '/');
+
+    bstring paths[3];
+    int path_count = 0;
+    if (info->binary_dir)
+        paths[path_count++] = bformat("%s/%s", info->binary_dir, base);
+    if (info->sysroot) {
+        paths[path_count++] = bformat("%s%s", info->sysroot, name);
+        if (rest)
+            paths[path_count++] = bformat("%s%s", info->sysroot, rest);
+    }
+
+    bool found = false;
+    for (int i = 0; i < path_count; i++) {
+        if (!found && paths[i])
+            found = map_file((char *)paths[i]->data, module);
+        bdestroy(paths[i]);
+    }
+    if (!found)
+        found = map_file(name, module);
+
+    if (!found) {
+        fprintf(stderr, "piranha-unwind: no copy of %s; stacks through it "
+                "will be cut short\n", name);
+        stats.missing_modules++;
+    }
+}
+
+// Returns the module for the named mapping, finding it the first time
+// around. Anonymous and special ("[stack]" and so on) mappings have none.
+struct module *get_module(struct unwind_info *info, const_bstring name)
+{
+    if (!name->slen || name->data[0] != '/')
+        return NULL;
+
+    struct module **modules = (struct module **)info->modules->data;
+    int count = info->modules->slen / sizeof(struct module *);
+    for (int i = 0; i < count; i++) {
+        if (biseq(modules[i]->name, name) == 1)
+            return modules[i];
+    }
+
+    struct module *module = calloc(1, sizeof(*module));
+    if (!module)
+        return NULL;
+    if (!(module->name = bstrcpy(name)) ||
+            bcatblk(info->modules, &module, sizeof(module)) != BSTR_OK) {
+        bdestroy(module->name);
+        free(module);
+        return NULL;
+    }
+
+    find_module(info, module);
+    return module;
+}
+
+// The unwinder's read_memory callback; data is the struct process_maps.
+// Only what is in the binaries can be read, which is all the unwinder reads
+// outside of the stack.
+bool read_module_text(void *data, uint32_t addr, void *buf, uint32_t size)
+{
+    struct process_maps *proc = data;
+    struct map *map = get_map_for_addr(proc->maps, addr);
+    if (!map)
+        return false;
+
+    struct module *module = ((struct module **)proc->modules->data)[
+        map - (struct map *)proc->maps->data];
+    if (!module || !module->data)
+        return false;
+
+    uint64_t offset = (uint64_t)(addr - map->start) + map->offset;
+    if (offset + size > module->size)
+        return false;
+
+    // The device and the host are both little-endian.
+    memcpy(buf, module->data + offset, size);
+    return true;
+}
+
+//
+// Memory maps
+//
+
+void free_process_maps(struct process_maps *proc)
+{
+    if (!proc)
+        return;
+    if (proc->maps)
+        release_unwind_tables(proc->maps);
+    int count = proc->maps ? proc->maps->slen / sizeof(struct map) : 0;
+    for (int i = 0; i < count; i++)
+        bdestroy(((struct map *)proc->maps->data)[i].name);
+    bdestroy(proc->maps);
+    bdestroy(proc->modules);
+    free(proc);
+}
+
+struct process_maps *find_process(struct unwind_info *info, uint32_t pid)
+{
+    struct process_maps **procs =
+        (struct process_maps **)info->processes->data;
+    int count = info->processes->slen / sizeof(struct process_maps *);
+    for (int i = 0; i < count; i++) {
+        if (procs[i]->pid == pid)
+            return procs[i];
+    }
+    return NULL;
+}
+
+void init_unwind_source(struct unwind_info *info, struct process_maps *proc,
+                        struct unwind_source *src)
+{
+    src->maps = proc->maps;
+    src->thread_entry_offset = info->thread_entry_offset;
+    src->read_memory = read_module_text;
+    src->data = proc;
+    // The paths are the device's. Reading through the copies is as quick as
+    // reading a cached call site map would be.
+    src->local_files = false;
+    src->call_site_cache_dir = NULL;
+    src->stats = &stats.unwind;
+}
+
+// Finds the binary behind every mapping, and its unwind tables. Those of
+// modules that are still where they were in old_maps, which may be NULL,
+// are kept.
+bool open_modules(struct unwind_info *info, struct process_maps *proc,
+                  bstring old_maps)
+{
+    struct map *maps = (struct map *)proc->maps->data;
+    int map_count = proc->maps->slen / sizeof(struct map);
+    for (int i = 0; i < map_count; i++) {
+        struct module *module = get_module(info, maps[i].name);
+        if (bcatblk(proc->modules, &module, sizeof(module)) != BSTR_OK)
+            return false;
+    }
+
+    struct unwind_source src;
+    init_unwind_source(info, proc, &src);
+    load_unwind_tables(&src, old_maps);
+    mark_frame_pointer_modules(proc->maps, info->frame_pointer_modules);
+    return true;
+}
+
+// Reads a MEMORY_MAP. With replace, it takes the place of the process's
+// current map; otherwise it's only used if the process has none yet, so
+// that the samples before a process's first map have one too.
+bool read_memory_map(struct unwind_info *info, const struct element *el,
+                     bool replace)
+{
+    struct process_maps *proc = calloc(1, sizeof(*proc));
+    if (!proc || !(proc->maps = bfromcstr("")) ||
+            !(proc->modules = bfromcstr(""))) {
+        free_process_maps(proc);
+        return false;
+    }
+
+    bool ok = true;
+    const uint8_t *p = el->data, *end = el->data + el->size;
+    struct element child;
+    while (ok && next_element(&p, end, &child)) {
+        if (child.id == EBML_PROCESS_PID_TAG && child.size >= 4) {
+            proc->pid = read_uint32(child.data);
+            continue;
+        }
+        if (child.id != EBML_MEMORY_REGION_TAG || child.size < 13)
+            continue;
+
+        struct map map;
+        map.start = read_uint32(child.data);
+        map.end = read_uint32(child.data + 4);
+        map.offset = read_uint32(child.data + 8);
+        map.name = blk2bstr(child.data + 12, strnlen(
+            (const char *)child.data + 12, child.size - 12));
+        map.tables = NULL;
+        map.frame_pointers = false;
+        // Profiles don't record permissions. Every mapping of a file will
+        // do for checking return addresses.
+        map.executable = true;
+        if (!map.name ||
+                bcatblk(proc->maps, &map, sizeof(map)) != BSTR_OK) {
+            bdestroy(map.name);
+            ok = false;
+        }
+    }
+    proc->source = el->start;
+    struct process_maps *old = find_process(info, proc->pid);
+    if (ok && old && (!replace || old->source == el->start)) {
+        // It's already in effect, or it's a later map that isn't yet.
+        free_process_maps(proc);
+        return true;
+    }
+    if (!ok || !open_modules(info, proc, old ? old->maps : NULL)) {
+        free_process_maps(proc);
+        return false;
+    }
+
+    if (old) {
+        struct process_maps **procs =
+            (struct process_maps **)info->processes->data;
+        int count = info->processes->slen / sizeof(struct process_maps *);
+        for (int i = 0; i < count; i++) {
+            if (procs[i] == old)
+                procs[i] = proc;
+        }
+        if (info->default_process == old)
+            info->default_process = proc;
+        free_process_maps(old);
+    } else if (bcatblk(info->processes, &proc, sizeof(proc)) != BSTR_OK) {
+        free_process_maps(proc);
+        return false;
+    }
+
+    // Samples without a process PID come from old, single-process
+    // profiles, which have a single map.
+    if (!info->default_process)
+        info->default_process = proc;
+    return true;
+}
+
+//
+// Unwinding
+//
+
+// Copies a THREAD_SAMPLE, replacing its raw registers and stack with the
+// unwound STACK. stack_buf is the worker's, and grows as needed.
+bool unwind_thread_sample(struct unwind_info *info, const struct element *el,
+                          bstring out, uint32_t **stack_buf,
+                          uint32_t *stack_buf_size)
+{
+    int offset = start_element(out, el);
+    if (offset < 0)
+        return false;
+
+    struct element registers, stack, child;
+    bool have_registers = false, have_stack = false, have_pid = false;
+    uint32_t pid = 0;
+    const uint8_t *p = el->data, *end = el->data + el->size;
+    while (next_element(&p, end, &child)) {
+        switch (child.id) {
+        case EBML_RAW_REGISTERS_TAG:
+            registers = child;
+            have_registers = child.size >= 12;
+            continue;
+        case EBML_RAW_STACK_TAG:
+            stack = child;
+            have_stack = true;
+            continue;
+        case EBML_PROCESS_PID_TAG:
+            if (child.size >= 4) {
+                pid = read_uint32(child.data);
+                have_pid = true;
+            }
+            break;
+        }
+        if (!copy_element(out, &child))
+            return false;
+    }
+
+    if (!have_registers)
+        return end_element(out, offset);
+
+    struct process_maps *proc = have_pid ? find_process(info, pid) :
+        info->default_process;
+    struct process_maps empty;
+    struct tagbstring no_maps = bsStatic("");
+    if (!proc) {
+        // No map was ever written for it; all we know is the PC.
+        empty.maps = empty.modules = &no_maps;
+        proc = &empty;
+    }
+
+    // The stack may not be aligned in the input.
+    struct stack_snapshot snapshot;
+    snapshot.sp = read_uint32(registers.data + 8);
+    snapshot.size = have_stack ? stack.size & ~0x3 : 0;
+    if (snapshot.size > *stack_buf_size) {
+        uint32_t *buf = realloc(*stack_buf, snapshot.size);
+        if (!buf)
+            return false;
+        *stack_buf = buf;
+        *stack_buf_size = snapshot.size;
+    }
+    snapshot.words = *stack_buf;
+    if (snapshot.size)
+        memcpy(snapshot.words, stack.data, snapshot.size);
+
+    // The PC, LR and SP, then r0-r12 if piranha had them all. A zero LR
+    // wasn't known.
+    struct unwind_regs regs;
+    regs.r[UNWIND_REG_PC] = read_uint32(registers.data);
+    regs.r[UNWIND_REG_LR] = read_uint32(registers.data + 4);
+    regs.r[UNWIND_REG_SP] = snapshot.sp;
+    regs.valid = (1 << UNWIND_REG_PC) | (1 << UNWIND_REG_SP);
+    if (regs.r[UNWIND_REG_LR])
+        regs.valid |= 1 << UNWIND_REG_LR;
+    if (registers.size >= 12 + UNWIND_REG_SP * 4) {
+        for (int i = 0; i < UNWIND_REG_SP; i++)
+            regs.r[i] = read_uint32(registers.data + 12 + i * 4);
+        regs.valid = UNWIND_ALL_REGS;
+    }
+
+    struct unwind_source src;
+    init_unwind_source(info, proc, &src);
+
+    uint32_t frames[UNWIND_MAX_FRAMES];
+    uint32_t count = unwind_frames(&src, &regs, &snapshot, frames,
+                                   UNWIND_MAX_FRAMES);
+    __sync_fetch_and_add(&stats.stacks, 1);
+    __sync_fetch_and_add(&stats.frames, count);
+
+    static const uint8_t stack_tag = EBML_STACK_TAG;
+    struct element stack_el;
+    stack_el.start = &stack_tag;
+    stack_el.id_length = 1;
+    int stack_offset = start_element(out, &stack_el);
+    if (stack_offset < 0)
+        return false;
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t word[4] = {
+            frames[i] >> 24, frames[i] >> 16, frames[i] >> 8, frames[i]
+        };
+        if (bcatblk(out, word, sizeof(word)) != BSTR_OK)
+            return false;
+    }
+
+    return end_element(out, stack_offset) && end_element(out, offset);
+}
+
+bool unwind_sample(struct unwind_info *info, const struct element *el,
+                   bstring out, uint32_t **stack_buf,
+                   uint32_t *stack_buf_size)
+{
+    int offset = start_element(out, el);
+    if (offset < 0)
+        return false;
+
+    const uint8_t *p = el->data, *end = el->data + el->size;
+    struct element child;
+    while (next_element(&p, end, &child)) {
+        bool ok = child.id == EBML_THREAD_SAMPLE_TAG ?
+            unwind_thread_sample(info, &child, out, stack_buf,
+                                 stack_buf_size) :
+            copy_element(out, &child);
+        if (!ok)
+            return false;
+    }
+
+    __sync_fetch_and_add(&stats.samples, 1);
+    return end_element(out, offset);
+}
+
+void *run_worker(void *arg)
+{
+    struct pool *pool = arg;
+    uint32_t *stack_buf = NULL, stack_buf_size = 0;
+    while (true) {
+        uint32_t index = __sync_fetch_and_add(&pool->claimed, 1);
+        if (index >= pool->chunk_count)
+            break;
+
+        struct chunk *chunk = &pool->chunks[index];
+        chunk->ok = !!(chunk->out = bfromcstr(""));
+        for (uint32_t i = chunk->first; chunk->ok && i < chunk->end; i++) {
+            chunk->ok = unwind_sample(pool->info, &pool->samples[i],
+                                      chunk->out, &stack_buf,
+                                      &stack_buf_size);
+        }
+    }
+    free(stack_buf);
+    return NULL;
+}
+
+// Unwinds every sample in a SAMPLES element and adds them to out. The
+// samples are split into runs that the workers unwind in parallel, and added
+// in their original order.
+bool unwind_samples(struct unwind_info *info, const struct element *el,
+                    int worker_count, bstring out)
+{
+    bstring samples = bfromcstr("");
+    if (!samples)
+        return false;
+
+    bool ok = true;
+    const uint8_t *p = el->data, *end = el->data + el->size;
+    struct element child;
+    while (ok && next_element(&p, end, &child)) {
+        if (child.id == EBML_SAMPLE_TAG)
+            ok = bcatblk(samples, &child, sizeof(child)) == BSTR_OK;
+    }
+
+    struct pool pool;
+    memset(&pool, '\0', sizeof(pool));
+    pool.info = info;
+    pool.samples = (const struct element *)samples->data;
+
+    uint32_t sample_count = samples->slen / sizeof(struct element);
+    pool.chunk_count = worker_count * CHUNKS_PER_WORKER;
+    if (pool.chunk_count > sample_count)
+        pool.chunk_count = sample_count;
+    if (pool.chunk_count && (!ok || !(pool.chunks =
+            calloc(pool.chunk_count, sizeof(struct chunk))))) {
+        // There are no chunks for the loops below to look at.
+        pool.chunk_count = 0;
+        ok = false;
+    }
+    for (uint32_t i = 0; ok && i < pool.chunk_count; i++) {
+        pool.chunks[i].first = (uint64_t)sample_count * i /
+            pool.chunk_count;
+        pool.chunks[i].end = (uint64_t)sample_count * (i + 1) /
+            pool.chunk_count;
+    }
+
+    pthread_t workers[MAX_WORKERS];
+    int started = 0;
+    for (; ok && pool.chunk_count && started < worker_count; started++) {
+        if (pthread_create(&workers[started], NULL, run_worker, &pool)) {
+            fprintf(stderr, "piranha-unwind: couldn't start a worker\n");
+            break;
+        }
+    }
+    if (ok && pool.chunk_count && !started)
+        run_worker(&pool);
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    for (uint32_t i = 0; ok && i < pool.chunk_count; i++) {
+        ok = pool.chunks[i].ok &&
+            bconcat(out, pool.chunks[i].out) == BSTR_OK;
+        if (ok && out->slen > EBML_MAX_SIZE) {
+            fprintf(stderr, "piranha-unwind: too many samples for one "
+                    "file\n");
+            ok = false;
+        }
+    }
+
+    for (uint32_t i = 0; i < pool.chunk_count; i++)
+        bdestroy(pool.chunks[i].out);
+    free(pool.chunks);
+    bdestroy(samples);
+    return ok;
+}
+
+// Writes the unwound samples as one SAMPLES element, which el was the first
+// of.
+bool write_samples(const struct element *el, const_bstring samples, FILE *f)
+{
+    uint32_t size = samples->slen;
+    uint8_t size_buf[4] = {
+        0x10 | ((size >> 24) & 0xf), size >> 16, size >> 8, size
+    };
+    if (fwrite(el->start, el->id_length, 1, f) != 1 ||
+            fwrite(size_buf, sizeof(size_buf), 1, f) != 1 ||
+            (size && fwrite(samples->data, size, 1, f) != 1)) {
+        perror("Couldn't write the output");
+        return false;
+    }
+    return true;
+}
+
+void usage()
+{
+    fprintf(stderr, "usage: piranha-unwind [-j N] [-b DIR] [-p MODULES] "
+            "[-r SYSROOT] INPUT OUTPUT\n");
+    fprintf(stderr, "  -b  look for the device's binaries in DIR, by file "
+            "name\n");
+    fprintf(stderr, "  -j  unwind on N threads (default: one per CPU)\n");
+    fprintf(stderr, "  -p  follow frame pointers through MODULES, file names "
+            "separated by commas,\n      or all\n");
+    fprintf(stderr, "  -r  look for the device's binaries under SYSROOT, by "
+            "path\n");
+    fprintf(stderr, "INPUT is a profile taken with piranha -U.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct unwind_info info;
+    memset(&info, '\0', sizeof(info));
+    int worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:j:p:r:")) != -1) {
+        switch (opt) {
+        case 'b':
+            info.binary_dir = optarg;
+            break;
+        case 'j':
+            worker_count = strtol(optarg, NULL, 0);
+            if (worker_count < 1)
+                usage();
+            break;
+        case 'p':
+            info.frame_pointer_modules = optarg;
+            break;
+        case 'r':
+            info.sysroot = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != 2)
+        usage();
+    if (worker_count > MAX_WORKERS)
+        worker_count = MAX_WORKERS;
+    if (worker_count < 1)
+        worker_count = 1;
+
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd < 0) {
+        perror("Couldn't open the input file");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st)) {
+        perror("Couldn't stat the input file");
+        close(fd);
+        return 1;
+    }
+    void *input = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                                    fd, 0) : MAP_FAILED;
+    close(fd);
+    if (input == MAP_FAILED) {
+        perror("Couldn't map the input file");
+        return 1;
+    }
+
+    bool ok = true;
+    FILE *f = NULL;
+    bstring samples = NULL;
+    if (!(info.modules = bfromcstr("")) ||
+            !(info.processes = bfromcstr("")) ||
+            !(samples = bfromcstr(""))) {
+        ok = false;
+        goto out;
+    }
+
+    // Start each process off with its first map. Older profiles, and
+    // processes that appeared while profiling with older versions of
+    // piranha, have it after the samples.
+    const uint8_t *start = input, *end = start + st.st_size, *p = start;
+    struct element el;
+    while (ok && next_element(&p, end, &el)) {
+        if (el.id == EBML_MEMORY_MAP_TAG)
+            ok = read_memory_map(&info, &el, false);
+        else if (el.id == EBML_THREAD_ENTRY_TAG && el.size >= 4)
+            info.thread_entry_offset = read_uint32(el.data);
+    }
+    if (ok && p != end) {
+        fprintf(stderr, "piranha-unwind: %s is truncated or corrupt\n",
+                argv[optind]);
+        ok = false;
+    }
+
+    // Then go through the maps and samples in order, so that each sample is
+    // unwound against the map that was current when it was taken.
+    p = start;
+    while (ok && next_element(&p, end, &el)) {
+        if (el.id == EBML_MEMORY_MAP_TAG)
+            ok = read_memory_map(&info, &el, true);
+        else if (el.id == EBML_SAMPLES_TAG)
+            ok = unwind_samples(&info, &el, worker_count, samples);
+    }
+    if (!ok)
+        goto out;
+
+    if (!(f = fopen(argv[optind + 1], "wb"))) {
+        perror("Couldn't open the output file");
+        ok = false;
+        goto out;
+    }
+
+    bool samples_written = false;
+    p = start;
+    while (ok && next_element(&p, end, &el)) {
+        if (el.id == EBML_SAMPLES_TAG) {
+            if (!samples_written)
+                ok = write_samples(&el, samples, f);
+            samples_written = true;
+        } else if (fwrite(el.start, el.data + el.size - el.start, 1, f) !=
+                1) {
+            perror("Couldn't write the output");
+            ok = false;
+        }
+    }
+
+    fprintf(stderr, "piranha-unwind: %u samples, %u stacks unwound "
+            "(%.1f frames avg) on %d threads, %u binaries missing\n",
+            stats.samples, stats.stacks,
+            stats.stacks ? (double)stats.frames / stats.stacks : 0.0,
+            worker_count, stats.missing_modules);
+    fprintf(stderr, "piranha-unwind: %u frames from frame pointers, %u from "
+            "CFI, %u from EHABI,\n    %u from scanning\n",
+            stats.unwind.fp_frames, stats.unwind.cfi_frames,
+            stats.unwind.exidx_frames, stats.unwind.scanned_frames);
+    uint32_t lookups = stats.unwind.lr_cache_hits +
+        stats.unwind.lr_cache_misses;
+    fprintf(stderr, "piranha-unwind: %.1f%% of return address checks "
+            "cached\n",
+            lookups ? 100.0 * stats.unwind.lr_cache_hits / lookups : 0.0);
+    fprintf(stderr, "piranha-unwind: %u call site maps built\n",
+            stats.unwind.call_site_maps_built);
+
+out:
+    if (f && fclose(f) && ok) {
+        perror("Couldn't write the output");
+        ok = false;
+    }
+    bdestroy(samples);
+    munmap(input, st.st_size);
+    return ok ? 0 : 1;
+}
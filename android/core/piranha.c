@@ -7,31 +7,40 @@
  * Patrick Walton <pcwalton@mimiga.net>
  */
 
+#include <linux/bpf.h>
+#include <linux/io_uring.h>
+#include <linux/perf_event.h>
 #include <linux/ptrace.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/ptrace.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <arpa/inet.h>
 #include <assert.h>
-#include <dirent.h>
 #include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
+#include "agent.h"
 #include "bstrlib.h"
-
-// The length of Bionic's __thread_entry routine. This is obviously a gross
-// hack, of which I am ashamed.
-#define THREAD_ENTRY_LENGTH     0x3c
+#include "unwind.h"
+#include "memdbg.h"
 
 #define EBML_HEADER_TAG         0x1a45dfa3
 #define EBML_MEMORY_MAP_TAG     0x81          // root level
@@ -46,40 +55,520 @@
 #define EBML_MODULE_NAME_TAG    0x8a          // contained by MODULE
 #define EBML_SYMBOL_TAG         0x8b          // contained by MODULE
 #define EBML_THREAD_PID_TAG     0x8c          // contained by THREAD_SAMPLE
+                                              // and THREAD
+#define EBML_THREADS_TAG        0x8d          // root level
+#define EBML_THREAD_TAG         0x8e          // contained by THREADS
+#define EBML_THREAD_CREATED_TAG 0x8f          // contained by THREAD
+#define EBML_THREAD_EXITED_TAG  0x90          // contained by THREAD
+#define EBML_SAMPLE_TIMING_TAG  0x91          // contained by SAMPLE
+#define EBML_SAMPLE_WEIGHT_TAG  0x92          // contained by SAMPLE
+#define EBML_SAME_STACK_TAG     0x93          // contained by THREAD_SAMPLE
+#define EBML_THREAD_SYSCALL_TAG 0x94          // contained by THREAD_SAMPLE
+#define EBML_PROCESS_PID_TAG    0x95          // contained by MEMORY_MAP,
+                                              // THREAD_SAMPLE and THREAD
+#define EBML_RAW_REGISTERS_TAG  0x96          // contained by THREAD_SAMPLE
+#define EBML_RAW_STACK_TAG      0x97          // contained by THREAD_SAMPLE
+#define EBML_THREAD_ENTRY_TAG   0x98          // root level
 
 #define PENDING_SIGNAL_NONE     0
 #define PENDING_SIGNAL_TICK     1
 #define PENDING_SIGNAL_STOP     2
 
+// Newer ptrace requests that old NDK headers don't know about (Linux 3.4+).
+#ifndef PTRACE_SEIZE
+#define PTRACE_SEIZE            0x4206
+#endif
+#ifndef PTRACE_INTERRUPT
+#define PTRACE_INTERRUPT        0x4207
+#endif
+#ifndef PTRACE_EVENT_STOP
+#define PTRACE_EVENT_STOP       128
+#endif
+
+#define PTRACE_SEIZE_OPTIONS    (PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXIT)
+#define RESCAN_INTERVAL_TICKS   100
+
+#define STAT_BUF_SIZE           512         // /proc/TID/stat is ~250 bytes
+#define SCHEDSTAT_BUF_SIZE      64
+#define THREAD_READ_BATCH_SIZE  256         // /proc reads per io_uring_enter()
+#define SYSCALL_BUF_SIZE        128         // /proc/TID/syscall
+#define COMM_SIZE               16          // TASK_COMM_LEN
+#define MAX_THREAD_SPECS        16          // per -t, -x or -f
+#define DIRENT_BUF_SIZE         4096
+#define MAX_TASKS               4096
+#define INITIAL_PROCESS_CAPACITY 16
+#define MAX_PROCESSES           4096        // in the whole system, for -T
+#define PROCESS_RESCAN_INTERVAL_TICKS 100
+#define MAPS_REREAD_INTERVAL_TICKS 10
+#define INITIAL_THREAD_CAPACITY 256
+#define ALLOCATION_WARMUP_TICKS 100         // ticks that may allocate, for -Z
+
+// Likewise for process_vm_readv() (Linux 3.2+) and perf_event_open() (Linux
+// 2.6.31+), which Bionic has no wrappers for.
+#ifndef __NR_process_vm_readv
+#define __NR_process_vm_readv   376
+#endif
+#ifndef __NR_perf_event_open
+#define __NR_perf_event_open    364
+#endif
+#ifndef __NR_timerfd_create
+#define __NR_timerfd_create     350
+#endif
+#ifndef __NR_timerfd_settime
+#define __NR_timerfd_settime    353
+#endif
+#ifndef __NR_signalfd4
+#define __NR_signalfd4          355
+#endif
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open         434
+#endif
+#ifndef __NR_bpf
+#define __NR_bpf                386
+#endif
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup     425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter     426
+#endif
+#ifndef PERF_EVENT_IOC_SET_BPF
+#define PERF_EVENT_IOC_SET_BPF  _IOW('$', 8, __u32)
+#endif
+
+// Register numbers in the ARM perf_regs ABI.
+#define PERF_REG_ARM_SP         13
+#define PERF_REG_ARM_LR         14
+#define PERF_REG_ARM_PC         15
+#define PERF_UNWIND_REGS        ((1 << PERF_REG_ARM_SP) | \
+                                 (1 << PERF_REG_ARM_LR) | \
+                                 (1 << PERF_REG_ARM_PC))
+
+#define TICK_INTERVAL_NS        10000000    // 10ms, unless -i is given
+#define MIN_TICK_INTERVAL_NS    100000      // 100us, the shortest for -i
+#define MIN_ADAPTED_INTERVAL_NS 1000000     // the shortest that -B picks
+#define MAX_TICK_INTERVAL_NS    500000000   // the longest for -i and -B
+#define MAX_EVENT_SOURCES       64
+#define SIGNALFD_SIGINFO_SIZE   128
+
+#define RECORDER_DEFAULT_MB     16          // ring size for -R, unless given
+#define RECORDER_TICK_BUF_SIZE  (64 * 1024) // grows if a tick needs more
+#define CONTROL_COMMAND_SIZE    64
+
+#define BACKEND_PTRACE          0
+#define BACKEND_PERF            1
+#define BACKEND_AGENT           2
+#define BACKEND_BPF             3
+
+#define AGENT_RETRY_INTERVAL_TICKS 10
+
+#define BPF_DRAIN_INTERVAL_TICKS 100        // 1s at the default interval
+#define BPF_MAX_STACKS          16384       // stack map entries
+#define BPF_MAX_COUNTS          16384       // distinct (thread, stacks) keys
+#define BPF_STACK_DEPTH         127         // PERF_MAX_STACK_DEPTH
+#define BPF_MAX_INSNS           64
+#define BPF_LOG_SIZE            (64 * 1024) // for the verifier's complaints
+
+// Just enough of an assembler for the BPF sampler's program.
+#define BPF_RAW_INSN(code, dst, src, off, imm) \
+    ((struct bpf_insn){ (code), (dst), (src), (off), (imm) })
+#define BPF_MOV_REG(dst, src) \
+    BPF_RAW_INSN(BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0)
+#define BPF_MOV_IMM(dst, imm) \
+    BPF_RAW_INSN(BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm)
+#define BPF_ADD_IMM(dst, imm) \
+    BPF_RAW_INSN(BPF_ALU64 | BPF_ADD | BPF_K, dst, 0, 0, imm)
+#define BPF_RSH_IMM(dst, imm) \
+    BPF_RAW_INSN(BPF_ALU64 | BPF_RSH | BPF_K, dst, 0, 0, imm)
+#define BPF_STORE_REG(size, dst, off, src) \
+    BPF_RAW_INSN(BPF_STX | BPF_MEM | (size), dst, src, off, 0)
+#define BPF_STORE_IMM(size, dst, off, imm) \
+    BPF_RAW_INSN(BPF_ST | BPF_MEM | (size), dst, 0, off, imm)
+#define BPF_JUMP_IMM(op, dst, imm) \
+    BPF_RAW_INSN(BPF_JMP | (op) | BPF_K, dst, 0, 0, imm)  // patch off later
+#define BPF_CALL_FUNC(func) \
+    BPF_RAW_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, func)
+#define BPF_RETURN() \
+    BPF_RAW_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+#define PERF_RING_PAGES         64          // must be a power of two
+#define PERF_RESCAN_INTERVAL_TICKS 10
+#define DEFAULT_PERF_FREQUENCY  1000        // Hz
+#define DEFAULT_PERF_STACK_COPY (16 * 1024)
+#define PERF_MAX_STACK_COPY     0xfff8      // records are limited to 64K
+
+#define MAX_UNWIND_WORKERS      64
+#define UNWIND_JOBS_PER_WORKER  4
+#define UNWIND_JOBS_INLINE      16          // without -j
+#define UNWIND_JOB_BUF_SIZE     4096        // grows for very deep stacks
+
+#define PAGE_SIZE_BYTES         4096
+#define DEFAULT_STACK_COPY_CAP  (128 * 1024)
+#define DEFAULT_RAW_STACK_COPY  (8 * 1024)  // per sample, with -U
+
+// Where the unwinder keeps the call site maps of modules between runs (-D).
+#define DEFAULT_CALL_SITE_CACHE_DIR AGENT_DEFAULT_DIR "/piranha-call-sites"
+
 #define length_of(x)    (sizeof(x) / sizeof((x)[0]))
 
-struct map {
+// Any mapping at all, named or not. Used to find the end of thread stacks,
+// which are anonymous.
+struct region {
     uint32_t start;
     uint32_t end;
-    uint32_t offset;
-    bstring name;
 };
 
-struct basic_info {
+// When a sample was taken and how far behind schedule the sampler was.
+struct sample_timing {
+    uint64_t time_ns;       // CLOCK_MONOTONIC
+    uint64_t lateness_ns;   // time since the tick was due
+    uint32_t missed_ticks;  // ticks dropped since the previous sample
+};
+
+// The key of the BPF sampler's count map.
+struct bpf_count_key {
+    uint32_t pid;
+    uint32_t tid;
+    int32_t user_stack;     // IDs in the stack map, or negative for none
+    int32_t kernel_stack;
+};
+
+// The BPF sampler's program and maps, which all target processes share.
+struct bpf_sampler {
+    int prog_fd;
+    int pids_fd;            // the target processes, for the program to check
+    int stacks_fd;          // stack ID -> return addresses
+    int counts_fd;          // struct bpf_count_key -> samples
+    bstring event_fds;      // a cpu-clock event on every CPU
+    uint64_t period_ns;
+    bool kernel_stacks;     // -K
+};
+
+// A perf_event_open() file descriptor for one thread and its mapped ring
+// buffer.
+struct perf_ring {
     pid_t pid;
-    uint32_t thread_entry_offset;
+    bool seen;      // used to find threads that went away during a rescan
+    int fd;         // -1 for a thread that isn't being sampled
+    uint64_t period_ns;
+    struct perf_event_mmap_page *header;
+    uint8_t *data;
+    uint32_t data_size;
+};
+
+// What getdents64() returns. Bionic doesn't declare this.
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct thread {
+    pid_t pid;
+    bool seen;      // used to find threads that went away during a rescan
+    bool selected;  // if false, the thread isn't sampled and has no files open
+    bool fast;      // sampled on every tick rather than every slow_ticks
+    int stat_fd;    // /proc/TID/stat, kept open for the thread's lifetime
+    int schedstat_fd;   // /proc/TID/schedstat, or -1 if there isn't one
+    int syscall_fd;     // /proc/TID/syscall, or -1 if there isn't one
+    // If true, the thread's last full sample stands for it until its CPU
+    // time moves on from run_ns.
+    bool reusable;
+    uint64_t run_ns;
+    char state;     // for the tick being sampled, or 0 if unknown
+    bool idle;      // hasn't run since its last full sample
+    bool stop;      // has to be stopped to be sampled this tick
+    // Where this tick's reads of stat and schedstat went in the batch, or -1.
+    int stat_read;
+    int schedstat_read;
+};
+
+// Reads of threads' /proc files that are made together, in one
+// io_uring_enter() where the kernel has io_uring (Linux 5.1+) and one
+// pread() each where it doesn't.
+struct thread_reads {
+    int ring_fd;            // -1 to use pread()
+    void *sq_ring;
+    void *cq_ring;
+    struct io_uring_sqe *sqes;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    struct io_sqring_offsets sq_off;
+    struct io_cqring_offsets cq_off;
+    uint32_t size;          // reads per batch; no more than the ring holds
+    uint32_t count;         // reads in the current batch
+    int *fds;
+    struct iovec *iovecs;   // where each read goes
+    int *results;           // what each read returned
+    char *bufs;             // size buffers of STAT_BUF_SIZE
+};
+
+// A list of TIDs and thread name patterns from the command line.
+struct thread_filter {
+    const char *specs[MAX_THREAD_SPECS];
+    int count;
+};
+
+// Times are CLOCK_MONOTONIC nanoseconds; zero means unknown.
+struct thread_lifetime {
+    pid_t pid;
+    uint64_t created_ns;
+    uint64_t exited_ns;
+};
+
+// A target process. Everything that is specific to one process lives here;
+// the rest of the profiler's state is in struct basic_info.
+struct process {
+    pid_t pid;
+    bool live;          // false once the process has exited
+    bool maps_written;  // whether its MEMORY_MAP is in the output yet
+    bool maps_stale;    // a PC turned up outside every known region
+    uint32_t maps_read_tick;
+    int pid_fd;         // pidfd watched by the event loop, or -1
     bstring maps;
+    bstring regions;    // array of struct region, sorted by address
     int mem;
-    uint32_t mem_offset;
+    int task_dir;       // /proc/PID/task
+    bstring threads;    // array of struct thread, sorted by pid
+    bstring thread_log; // array of struct thread_lifetime
+    bstring perf_rings; // array of struct perf_ring
+    uint64_t perf_lost_pending; // lost samples not yet reported in a SAMPLE
+    struct agent_ring *agent;   // mapped ring of the in-process agent
+    uint32_t agent_unsampled;   // its unsampled_threads at the last drain
+};
+
+// The flight recorder's ring of recent ticks. Each tick is a struct
+// recording_header followed by the SAMPLE elements written during it; the
+// ring wraps around in the middle of these as needed.
+struct recorder {
+    uint8_t *data;          // NULL unless -R was given
+    uint32_t capacity;
+    uint32_t head;          // offset of the oldest tick
+    uint32_t used;
+    uint32_t count;         // ticks in the ring
+    uint64_t window_ns;     // how far back to keep, or 0 for as far as fits
+    uint32_t dumps;
+};
+
+struct recording_header {
+    uint64_t time_ns;
+    uint32_t size;
 };
 
 struct ebml_writer {
     FILE *f;
+    bstring buf;        // if set, output goes here instead (flight recorder)
     uint32_t tag_offsets[4];
     int tag_stack_size;
 };
 
+// A thread's registers and stack copy, handed from the sampler to whoever
+// unwinds it, and the THREAD_SAMPLE element being built for it. The sampler
+// writes the start of the element and the unwinder finishes it.
+struct unwind_job {
+    struct process *process;
+    struct unwind_regs regs;
+    struct stack_snapshot stack;
+    uint32_t *stack_buf;        // stack_copy_cap bytes
+    struct ebml_writer writer;  // in memory
+    volatile bool done;
+    bool ok;
+};
+
+// With -j, stacks are unwound by a pool of worker threads while the sampler
+// goes on to stop the next thread. Otherwise the sampler runs the jobs
+// itself as it writes them out: before it stops another thread if every job
+// is taken, and at the end of the tick. Either way, a thread is running again
+// by the time its stack is unwound, unless the whole process is stopped at
+// once and has more threads to sample than there are jobs. The sampler is
+// the only producer: it fills in the jobs in order and publishes them by
+// bumping submitted, and each worker takes the next one with an atomic
+// increment of claimed. Finished jobs are written out in the order they were
+// submitted. The semaphores only put threads to sleep when there's nothing
+// for them to do.
+struct unwind_pool {
+    struct unwind_job *jobs;
+    uint32_t job_count;
+    uint32_t submitted;         // sampler only
+    uint32_t written;           // sampler only
+    volatile uint32_t claimed;
+    int worker_count;
+    pthread_t *workers;
+    sem_t ready;                // posted once per submitted job
+    sem_t finished;             // posted once per finished job
+    volatile bool stopping;
+    struct basic_info *binfo;
+};
+
+struct basic_info {
+    int backend;
+    uint32_t thread_entry_offset;
+    pid_t *task_ids;    // MAX_TASKS entries, filled in by list_tasks()
+
+    // The target processes, in the order we found them, and the one that is
+    // being sampled right now. With -T, children of the targets are added as
+    // they appear.
+    bstring processes;  // array of struct process
+    struct process *process;
+    bool follow_children;
+    int proc_dir;       // /proc, for finding children
+    pid_t *proc_ids;    // MAX_PROCESSES pids and then their parents
+
+    // Buffers for stack snapshots, allocated once at startup. The stacks
+    // themselves are copied into the unwind jobs.
+    uint32_t stack_copy_cap;
+    struct iovec *stack_iovecs;
+    struct unwind_pool unwinders;
+
+    // With -U, stacks are written raw instead of being unwound.
+    bool raw_stacks;
+
+    // The modules to follow frame pointers through (-p), or NULL.
+    const char *frame_pointer_modules;
+
+    // Where call site maps are kept between runs (-D), or NULL.
+    const char *call_site_cache_dir;
+
+    // If true, every thread is seized once at startup and merely interrupted
+    // on each tick, instead of being attached to and detached from.
+    bool persistent;
+
+    // Set once PTRACE_SEIZE has turned out not to exist (before Linux 3.4),
+    // after which sample() has to stop the whole process to get at a thread.
+    bool group_attach;
+
+    // Which threads to sample (-t and -x), and which of those to sample on
+    // every tick (-f) when the rest are only sampled every slow_ticks (-r).
+    struct thread_filter include;
+    struct thread_filter exclude;
+    struct thread_filter fast;
+    uint32_t slow_ticks;
+    struct thread_reads thread_reads;
+    bool use_io_uring;
+
+    // The tick schedule: tick N is due at schedule_start_ns + N * interval.
+    uint64_t interval_ns;
+    uint64_t schedule_start_ns;
+    uint64_t scheduled_ticks;
+    uint32_t tick_limit;            // stop after this many ticks (-n), or 0
+    struct sample_timing timing;    // for the tick being sampled
+    int timer_fd;                   // timerfd, or -1 to use posix_timer
+    timer_t posix_timer;
+
+    // With -B, the interval is adjusted so that the target spends at most
+    // this fraction of wall time stopped.
+    double stop_budget;
+    uint64_t last_stop_ns;          // stop time of the latest tick
+    uint64_t avg_stop_ns;           // moving average of the above
+
+    uint32_t perf_frequency;
+    uint8_t *perf_record_buf;   // for records that wrap around the ring
+    struct bpf_sampler bpf;
+
+    // The command we ran (-- COMMAND), or -1. It is our child, so a wait for
+    // its main thread can reap it; if one does, its status is kept here.
+    pid_t launched_pid;
+    bool launched_reaped;
+    int launched_status;
+
+    // With -R, samples are kept in memory until a dump is asked for, and
+    // then written to numbered files named after out_path.
+    struct recorder recorder;
+    const char *out_path;
+    int control_fd;             // -C socket, or -1
+};
+
+// Profiler overhead statistics, printed at exit with -s.
+struct stats {
+    uint32_t ticks;
+    uint64_t tick_ns;           // wall time the sampler spent in ticks
+    uint64_t stop_ns;           // total time target threads spent stopped
+    uint64_t max_stop_ns;       // worst single tick
+    uint32_t attach_calls;      // PTRACE_{ATTACH,SEIZE,DETACH} + their waits
+    uint32_t interrupt_calls;   // PTRACE_{INTERRUPT,CONT} + their waits
+    uint32_t thread_events;     // clone, exit and signal stops handled
+    uint32_t rescans;           // scans of /proc/PID/task
+    uint32_t thread_samples;
+    uint32_t idle_samples;      // thread samples that reused the last stack
+    uint32_t blocked_samples;   // thread samples taken without stopping
+    uint32_t processes_followed; // children picked up by -T
+    uint32_t maps_reads;        // re-reads of /proc/PID/maps
+    uint32_t recorder_dropped;  // ticks that fell out of the recorder
+    uint32_t state_reads;
+    uint32_t state_read_calls;  // syscalls the state reads took
+    uint64_t state_read_ns;
+    uint32_t missed_ticks;
+    uint64_t max_lateness_ns;
+    uint32_t interval_changes;
+    uint64_t allocations;       // allocations made while sampling
+    uint32_t allocating_ticks;  // ticks that allocated at all
+    uint32_t late_allocating_ticks; // those after ALLOCATION_WARMUP_TICKS
+    uint32_t stack_reads;       // stack snapshot syscalls
+    uint64_t stack_bytes;       // bytes copied into stack snapshots
+    uint32_t text_reads;        // reads of code and unwind tables
+    struct unwind_stats unwind;
+    uint32_t unwind_waits;      // times the sampler waited for an unwinder
+    uint32_t raw_stacks;        // stacks left for piranha-unwind (-U)
+    uint32_t perf_samples;
+    uint64_t perf_lost;         // samples dropped because a ring was full
+    uint32_t agent_samples;
+    uint32_t agent_lost;        // likewise, in the agent's rings
+    uint32_t agent_unsampled;   // threads the agent had no slot for
+    uint64_t bpf_samples;
+    uint32_t bpf_keys;          // count map entries read
+    uint32_t bpf_lost_stacks;   // stacks gone from the map before we read them
+};
+
 volatile int pending_signal = PENDING_SIGNAL_NONE;
+struct stats stats;
+unsigned long allocation_count = 0;
+
+// bstrlib and the unwinder allocate through these (see memdbg.h), as do we,
+// so that we can tell whether the sampling loop is allocation-free.
+void *counted_malloc(size_t size)
+{
+    __sync_fetch_and_add(&allocation_count, 1);
+    return malloc(size);
+}
+
+void *counted_calloc(size_t count, size_t size)
+{
+    __sync_fetch_and_add(&allocation_count, 1);
+    return calloc(count, size);
+}
+
+void *counted_realloc(void *ptr, size_t size)
+{
+    __sync_fetch_and_add(&allocation_count, 1);
+    return realloc(ptr, size);
+}
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
 //
 // EBML writing
 //
 
+bool ebml_write(struct ebml_writer *writer, const void *data, uint32_t size)
+{
+    if (writer->buf)
+        return bcatblk(writer->buf, data, size) == BSTR_OK;
+    return !!fwrite(data, size, 1, writer->f);
+}
+
+uint32_t ebml_tell(struct ebml_writer *writer)
+{
+    return writer->buf ? writer->buf->slen : ftell(writer->f);
+}
+
 bool ebml_start_tag(struct ebml_writer *writer, uint32_t tag_id)
 {
     assert(writer->tag_stack_size < length_of(writer->tag_offsets));
@@ -88,22 +577,22 @@ bool ebml_start_tag(struct ebml_writer *writer, uint32_t tag_id)
 
     bool ok;
     if (tag_id & 0xff000000)
-        ok = !!fwrite(&buf, 4, 1, writer->f);
+        ok = ebml_write(writer, &buf, 4);
     else if (tag_id & 0x00ff0000)
-        ok = !!fwrite((char *)&buf + 1, 3, 1, writer->f);
+        ok = ebml_write(writer, (char *)&buf + 1, 3);
     else if (tag_id & 0x0000ff00)
-        ok = !!fwrite((char *)&buf + 2, 2, 1, writer->f);
+        ok = ebml_write(writer, (char *)&buf + 2, 2);
     else
-        ok = !!fwrite((char *)&buf + 3, 1, 1, writer->f);
+        ok = ebml_write(writer, (char *)&buf + 3, 1);
 
     if (!ok)
         return false;
 
-    writer->tag_offsets[writer->tag_stack_size++] = ftell(writer->f);
+    writer->tag_offsets[writer->tag_stack_size++] = ebml_tell(writer);
 
     // Write a placeholder size
     uint32_t zero = 0;
-    if (!fwrite(&zero, 4, 1, writer->f))
+    if (!ebml_write(writer, &zero, 4))
         return false;
 
     return true;
@@ -113,11 +602,21 @@ void ebml_end_tag(struct ebml_writer *writer)
 {
     assert(writer->tag_stack_size);
 
-    uint32_t orig_offset = ftell(writer->f);
+    uint32_t orig_offset = ebml_tell(writer);
     uint32_t offset = writer->tag_offsets[writer->tag_stack_size - 1];
-    uint32_t size = ftell(writer->f) - offset - 4;
+    uint32_t size = orig_offset - offset - 4;
     assert(size < 0x10000000);
 
+    if (writer->buf) {
+        uint8_t *out = writer->buf->data + offset;
+        out[0] = 0x10 | ((size >> 24) & 0xf);
+        out[1] = (size >> 16) & 0xff;
+        out[2] = (size >> 8) & 0xff;
+        out[3] = size & 0xff;
+        writer->tag_stack_size--;
+        return;
+    }
+
     fseek(writer->f, offset, SEEK_SET);
     fputc(0x10 | ((size >> 24) & 0xf), writer->f);
     fputc((size >> 16) & 0xff, writer->f);
@@ -150,7 +649,7 @@ bool ebml_write_header(struct ebml_writer *writer, const_bstring format_name)
         goto out;
     }
 
-    if (!fwrite(name_buf->data, name_buf->slen + 1, 1, writer->f)) {
+    if (!ebml_write(writer, name_buf->data, name_buf->slen + 1)) {
         perror("fwrite");
         ok = false;
         goto out;
@@ -163,249 +662,446 @@ out:
     return ok;
 }
 
+bool ebml_write_uint32(struct ebml_writer *writer, uint32_t val)
+{
+    val = htonl(val);
+    return ebml_write(writer, &val, sizeof(val));
+}
+
+bool ebml_write_uint64(struct ebml_writer *writer, uint64_t val)
+{
+    return ebml_write_uint32(writer, val >> 32) &&
+        ebml_write_uint32(writer, val & 0xffffffff);
+}
+
+bool ebml_write_sample_timing(struct ebml_writer *writer,
+                              const struct sample_timing *timing)
+{
+    if (!ebml_start_tag(writer, EBML_SAMPLE_TIMING_TAG))
+        return false;
+
+    uint32_t lateness_ns = timing->lateness_ns > 0xffffffff ? 0xffffffff :
+        timing->lateness_ns;
+    if (!ebml_write_uint64(writer, timing->time_ns) ||
+            !ebml_write_uint32(writer, lateness_ns) ||
+            !ebml_write_uint32(writer, timing->missed_ticks))
+        return false;
+
+    ebml_end_tag(writer);
+    return true;
+}
+
+// The weight of a sample is the wall time it stands for, in microseconds.
+bool ebml_write_sample_weight(struct ebml_writer *writer, uint64_t weight_ns)
+{
+    if (!ebml_start_tag(writer, EBML_SAMPLE_WEIGHT_TAG))
+        return false;
+    if (!ebml_write_uint32(writer, weight_ns / 1000))
+        return false;
+    ebml_end_tag(writer);
+    return true;
+}
+
 void ebml_finish(struct ebml_writer *writer)
 {
     while (writer->tag_stack_size)
         ebml_end_tag(writer);
-    fclose(writer->f);
+    if (writer->f)
+        fclose(writer->f);
+    bdestroy(writer->buf);
 }
 
-// See comments in profile(). This lame thing is the result of Android's lack
-// of any signal handling mechanisms invented in the last 20 years.
-int signal_sockets[2];
-
-void signal_handler(int which)
+// Reads the target's memory through /proc/PID/mem. Unlike PTRACE_PEEKDATA,
+// this doesn't require the thread to be in a ptrace stop. The unwinder's
+// read_memory callback; data is the struct process.
+bool peek_text(void *data, uint32_t addr, void *buf, uint32_t size)
 {
-    static bool sigint_handled = false;
-    if (which == SIGINT) {
-        if (sigint_handled) {
-            fprintf(stderr, "Caught two SIGINTs; aborting\n");
-            abort();
-        }
-        sigint_handled = true;
-    }
+    struct process *proc = data;
+    __sync_fetch_and_add(&stats.text_reads, 1);     // from any unwinder
+    return pread64(proc->mem, buf, size, addr) == size;
+}
 
-    if (pending_signal == PENDING_SIGNAL_NONE) {
-        uint8_t b = 0;
-        write(signal_sockets[1], &b, sizeof(b));
-    }
+void init_unwind_source(struct basic_info *binfo, struct process *proc,
+                        struct unwind_source *src)
+{
+    src->maps = proc->maps;
+    src->thread_entry_offset = binfo->thread_entry_offset;
+    src->read_memory = peek_text;
+    src->data = proc;
+    src->local_files = true;
+    src->call_site_cache_dir = binfo->call_site_cache_dir;
+    src->stats = &stats.unwind;
+}
 
-    if (which == SIGINT)
-        pending_signal = PENDING_SIGNAL_STOP;
-    else if (pending_signal < PENDING_SIGNAL_STOP)
-        pending_signal = PENDING_SIGNAL_TICK;
+// Finds the unwind tables of the modules in the process's maps and marks
+// the ones with frame pointers (-p), unless nothing here is going to
+// unwind. Tables of modules that were in old_maps are reused.
+void prepare_maps_for_unwinding(struct basic_info *binfo,
+                                struct process *proc, bstring old_maps)
+{
+    if (binfo->raw_stacks || binfo->backend == BACKEND_BPF)
+        return;
+    struct unwind_source src;
+    init_unwind_source(binfo, proc, &src);
+    load_unwind_tables(&src, old_maps);
+    mark_frame_pointer_modules(proc->maps, binfo->frame_pointer_modules);
 }
 
-int compare_addr_and_map(const void *addr_p, const void *map_p)
+int compare_addr_and_region(const void *addr_p, const void *region_p)
 {
     const uint32_t *addr = addr_p;
-    const struct map *map = map_p;
-    if (*addr < map->start)
+    const struct region *region = region_p;
+    if (*addr < region->start)
         return -1;
-    if (*addr >= map->end)
+    if (*addr >= region->end)
         return 1;
     return 0;
 }
 
-struct map *get_map_for_addr(bstring maps, uint32_t addr)
+struct region *get_region_for_addr(bstring regions, uint32_t addr)
 {
-    return (struct map *)bsearch(&addr, maps->data, maps->slen /
-        sizeof(struct map), sizeof(struct map), compare_addr_and_map);
+    return (struct region *)bsearch(&addr, regions->data, regions->slen /
+        sizeof(struct region), sizeof(struct region),
+        compare_addr_and_region);
 }
 
-bool guess_lr_legitimacy(pid_t pid, uint32_t maybe_lr, uint32_t *real_lr)
+// Copies the live part of a thread's stack, from the stack pointer up to the
+// end of the stack mapping, into buf. The remote side is split
+// into one iovec per page so that an unreadable page only truncates the copy
+// rather than failing it outright.
+bool snapshot_stack(struct basic_info *binfo, uint32_t sp, uint32_t *buf,
+                    struct stack_snapshot *stack)
 {
-    // A non-word-aligned pointer can't possibly be the value of the saved link
-    // register in ARM mode.
-    if ((maybe_lr & 0x3) == 0x2)
+    stack->sp = sp;
+    stack->size = 0;
+    stack->words = buf;
+
+    struct region *region = get_region_for_addr(binfo->process->regions, sp);
+    uint32_t size = region ? region->end - sp : binfo->stack_copy_cap;
+    if (size > binfo->stack_copy_cap)
+        size = binfo->stack_copy_cap;
+
+    struct iovec local;
+    local.iov_base = buf;
+    local.iov_len = size;
+
+    int iovec_count = 0;
+    uint32_t addr = sp;
+    while (addr < sp + size) {
+        uint32_t page_end = (addr + PAGE_SIZE_BYTES) &
+            ~(PAGE_SIZE_BYTES - 1);
+        if (page_end > sp + size)
+            page_end = sp + size;
+        binfo->stack_iovecs[iovec_count].iov_base = (void *)addr;
+        binfo->stack_iovecs[iovec_count].iov_len = page_end - addr;
+        iovec_count++;
+        addr = page_end;
+    }
+
+    stats.stack_reads++;
+    ssize_t n = syscall(__NR_process_vm_readv, binfo->process->pid, &local, 1,
+                        binfo->stack_iovecs, iovec_count, 0);
+    if (n < 0 && errno == ENOSYS) {
+        // Old kernel; fall back to a single read of /proc/PID/mem.
+        stats.stack_reads++;
+        n = pread64(binfo->process->mem, buf, size, sp);
+    }
+    if (n < 0)
         return false;
 
-    bool thumb = maybe_lr & 0x1;
-    if (thumb)
-        maybe_lr--;
+    stack->size = n & ~0x3;
+    stats.stack_bytes += stack->size;
+    return true;
+}
 
-    // Read the memory that that stack value is pointing at.
-    uint32_t maybe_bl_ptr = maybe_lr - 4;
-    uint32_t maybe_bl;
-    if (!thumb) {
-        errno = 0;
-        uint32_t maybe_bl = ptrace(PTRACE_PEEKDATA, pid, (void *)maybe_bl_ptr,
-                                   NULL);
-        if (errno)
+// Writes the registers and the stack snapshot as they are, for
+// piranha-unwind to unwind on the host later. The registers are the PC, LR
+// and SP, followed by r0-r12 if they are all known. An unknown LR is zero.
+bool write_raw_stack(struct ebml_writer *writer,
+                     const struct unwind_regs *regs,
+                     const struct stack_snapshot *stack)
+{
+    uint32_t lr = regs->valid & (1 << UNWIND_REG_LR) ?
+        regs->r[UNWIND_REG_LR] : 0;
+    if (!ebml_start_tag(writer, EBML_RAW_REGISTERS_TAG) ||
+            !ebml_write_uint32(writer, regs->r[UNWIND_REG_PC]) ||
+            !ebml_write_uint32(writer, lr) ||
+            !ebml_write_uint32(writer, stack->sp))
+        return false;
+    for (int i = 0; regs->valid == UNWIND_ALL_REGS && i < UNWIND_REG_SP;
+            i++) {
+        if (!ebml_write_uint32(writer, regs->r[i]))
             return false;
+    }
+    ebml_end_tag(writer);
 
-#ifdef DEBUG_STACK_WALKING
-        printf(" /* maybe_bl %08x */", maybe_bl);
-#endif
+    // The stack stays in the target's byte order.
+    if (!ebml_start_tag(writer, EBML_RAW_STACK_TAG) ||
+            (stack->size && !ebml_write(writer, stack->words, stack->size)))
+        return false;
+    ebml_end_tag(writer);
 
-        // Does it immediately follow a "bl" or "blx" instruction?
-        if ((maybe_bl & 0x0f000000) == 0x0b000000 ||
-                (maybe_bl & 0x0ffffff0) == 0x012fff30) {
-            // Found!
-            *real_lr = maybe_lr;
-            return true;
-        }
+    __sync_fetch_and_add(&stats.raw_stacks, 1);     // from any unwinder
+    return true;
+}
 
-        return false;
-    }
+// Writes the stack of a thread, given whichever of its registers are known.
+// The PC always has to be.
+bool unwind_stack(struct basic_info *binfo, struct ebml_writer *writer,
+                  const struct unwind_regs *regs,
+                  const struct stack_snapshot *stack)
+{
+    // A PC outside every mapping means that something (most likely a
+    // library) was mapped since we last read the maps.
+    if (!get_region_for_addr(binfo->process->regions,
+                             regs->r[UNWIND_REG_PC]))
+        binfo->process->maps_stale = true;
 
-    // We're in Thumb mode. Word alignment makes this annoying.
-    uint16_t maybe_bl_upper, maybe_bl_lower;
-    if ((maybe_bl_ptr & 0x3) == 0) {
-        errno = 0;
-        maybe_bl = ptrace(PTRACE_PEEKDATA, pid, (void *)maybe_bl_ptr,
-            NULL);
-        if (errno)
-            return false;
+    if (binfo->raw_stacks)
+        return write_raw_stack(writer, regs, stack);
 
-        maybe_bl_upper = maybe_bl & 0xffff;
-        maybe_bl_lower = maybe_bl >> 16;
-    } else {
-        assert((maybe_bl_ptr & 0x3) == 0x2);
+    struct unwind_source src;
+    init_unwind_source(binfo, binfo->process, &src);
 
-        errno = 0;
-        maybe_bl = ptrace(PTRACE_PEEKDATA, pid,
-                          (void *)(maybe_bl_ptr - 2), NULL);
-        if (errno)
-            return false;
-        maybe_bl_upper = maybe_bl >> 16;
+    uint32_t frames[UNWIND_MAX_FRAMES];
+    uint32_t count = unwind_frames(&src, regs, stack, frames,
+                                   length_of(frames));
 
-        errno = 0;
-        maybe_bl = ptrace(PTRACE_PEEKDATA, pid,
-                          (void *)(maybe_bl_ptr + 2), NULL);
-        if (errno)
+    if (!ebml_start_tag(writer, EBML_STACK_TAG))
+        return false;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!ebml_write_uint32(writer, frames[i]))
             return false;
-        maybe_bl_lower = maybe_bl & 0xffff;
     }
-    if (errno)
-        return false;
+    ebml_end_tag(writer);
+    return true;
+}
 
-    // Does it immediately follow a "bl" or "blx" instruction?
-    if ((maybe_bl_lower & 0xff07) == 0x4700 ||      // b(l)x Rm
-            (maybe_bl_lower & 0xf801) == 0xe800 ||      // blx label
-            ((maybe_bl_upper & 0xf800) == 0xf000 &&
-             (maybe_bl_lower & 0xd000) == 0xd000)) {    // bl
-        // Found!
-        *real_lr = maybe_lr;
-        return true;
+// Copies the registers and stack of a thread that is in a ptrace stop into
+// a job, for unwinding once the thread is running again.
+bool capture_thread(struct basic_info *binfo, struct unwind_job *job,
+                    pid_t pid)
+{
+    struct pt_regs regs;
+    memset(&regs, '\0', sizeof(regs));
+
+    int err = ptrace(PTRACE_GETREGS, pid, NULL, &regs);
+    if (err) {
+        perror("Couldn't read registers");
+        return false;
     }
 
-    return false;
+    // Copy the stack in one go; the unwinder only touches the local copy.
+    for (int i = 0; i < UNWIND_REG_SP; i++)
+        job->regs.r[i] = regs.uregs[i];
+    job->regs.r[UNWIND_REG_SP] = regs.ARM_sp;
+    job->regs.r[UNWIND_REG_LR] = regs.ARM_lr;
+    job->regs.r[UNWIND_REG_PC] = regs.ARM_pc;
+    job->regs.valid = UNWIND_ALL_REGS;
+    snapshot_stack(binfo, regs.ARM_sp, job->stack_buf, &job->stack);
+    return true;
 }
 
-bool in_thread_entry(struct basic_info *binfo, struct map *map, uint32_t pc)
+//
+// Unwinding jobs
+//
+
+// Writes the STACK and ends the job's THREAD_SAMPLE.
+void run_unwind_job(struct basic_info *binfo, struct unwind_job *job)
 {
-    struct tagbstring libc_so = bsStatic("libc.so");
-    if (!map || binstr(map->name, 0, &libc_so) == BSTR_ERR)
-        return false;
-    uint32_t rel_pc = pc - map->start + map->offset;
-    return rel_pc >= binfo->thread_entry_offset &&
-        rel_pc < binfo->thread_entry_offset + THREAD_ENTRY_LENGTH;
+    job->ok = unwind_stack(binfo, &job->writer, &job->regs, &job->stack);
+    ebml_end_tag(&job->writer);
 }
 
-// Grabs a word from the stack.
-bool peek(struct basic_info *binfo, uint32_t addr, uint32_t *out)
+void *run_unwind_worker(void *arg)
 {
-    static int fast_paths = 0, slow_paths = 0;
+    struct unwind_pool *pool = arg;
+
+    // The unwinder only reads binfo, apart from the current process, which
+    // a worker has to have its own of.
+    struct basic_info binfo = *pool->binfo;
+    while (true) {
+        if (sem_wait(&pool->ready))
+            continue;   // EINTR
+        if (pool->stopping)
+            return NULL;
+
+        uint32_t index = __sync_fetch_and_add(&pool->claimed, 1);
+        struct unwind_job *job = &pool->jobs[index % pool->job_count];
+        binfo.process = job->process;
+        run_unwind_job(&binfo, job);
+
+        __sync_synchronize();
+        job->done = true;
+        sem_post(&pool->finished);
+    }
+}
 
-    /*if (addr == binfo->mem_offset) {
-        fast_paths++;
-    } else {*/
-        // Slow path: reposition
-        slow_paths++;
-        if (lseek64(binfo->mem, addr, SEEK_SET) == -1) {
-            binfo->mem_offset = 0;
-            perror("failed seek");
-            return false;
+// Writes out finished jobs in the order they were submitted, waiting for
+// the oldest ones, or without -j running them, until at most max_pending are
+// left.
+bool write_unwind_jobs(struct basic_info *binfo, struct ebml_writer *writer,
+                       uint32_t max_pending)
+{
+    struct unwind_pool *pool = &binfo->unwinders;
+    while (pool->written != pool->submitted) {
+        struct unwind_job *job = &pool->jobs[pool->written % pool->job_count];
+        if (!job->done) {
+            if (pool->submitted - pool->written <= max_pending)
+                return true;
+            if (!pool->worker_count) {
+                struct process *process = binfo->process;
+                binfo->process = job->process;
+                run_unwind_job(binfo, job);
+                binfo->process = process;
+                job->done = true;
+                continue;
+            }
+            stats.unwind_waits++;
+            sem_wait(&pool->finished);
+            continue;
         }
-        assert(lseek64(binfo->mem, 0, SEEK_CUR) == addr);
-    //}
-
-    /*if ((fast_paths + slow_paths) % 10000 == 0)
-        printf("fast: %d slow: %d\n", fast_paths, slow_paths);*/
 
-    bool ok = read(binfo->mem, out, 4) == 4;
-
-    /*static int zeroes = 0, nonzeroes = 0;
-    if (!*out == 0)
-        zeroes++;
-    else
-        nonzeroes++;
-    if (!((zeroes + nonzeroes) % 10000))
-        printf("zeroes: %d, nonzeroes=%d\n", zeroes, nonzeroes);*/
+        __sync_synchronize();
+        pool->written++;
+        if (!job->ok || !ebml_write(writer, job->writer.buf->data,
+                                    job->writer.buf->slen))
+            return false;
+    }
+    return true;
+}
 
-    binfo->mem_offset = addr + 4;
-    return ok;
+// Writes out the oldest jobs if need be so that there's one free. The
+// sampler does this before it stops a thread, so that the thread doesn't
+// wait on unwinding.
+bool make_room_for_unwind_job(struct basic_info *binfo,
+                              struct ebml_writer *writer)
+{
+    return write_unwind_jobs(binfo, writer, binfo->unwinders.job_count - 1);
 }
 
-bool unwind(struct basic_info *binfo, struct ebml_writer *writer, pid_t pid)
+// Returns the job to fill in for the next thread of the current process,
+// once there's one free. Nothing happens to it until it's submitted, so a
+// sample can be abandoned by not submitting it.
+struct unwind_job *next_unwind_job(struct basic_info *binfo,
+                                   struct ebml_writer *writer)
 {
-    struct pt_regs regs;
-    memset(&regs, '\0', sizeof(regs));
+    struct unwind_pool *pool = &binfo->unwinders;
+    if (!make_room_for_unwind_job(binfo, writer))
+        return NULL;
+
+    struct unwind_job *job = &pool->jobs[pool->submitted % pool->job_count];
+    job->process = binfo->process;
+    job->done = false;
+    btrunc(job->writer.buf, 0);
+    job->writer.tag_stack_size = 0;
+    return job;
+}
 
-    int err = ptrace(PTRACE_GETREGS, pid, NULL, &regs);
-    if (err) {
-        perror("Couldn't read registers");
-        return false;
-    }
+void submit_unwind_job(struct basic_info *binfo, struct unwind_job *job)
+{
+    struct unwind_pool *pool = &binfo->unwinders;
+    pool->submitted++;
+    if (!pool->worker_count)
+        return;     // run by write_unwind_jobs()
 
-    ebml_start_tag(writer, EBML_STACK_TAG);
+    __sync_synchronize();
+    sem_post(&pool->ready);
+}
 
-    struct map *map = get_map_for_addr(binfo->maps, regs.ARM_pc - 8);
-    uint32_t val = htonl(regs.ARM_pc - 4);
-    if (!fwrite(&val, 4, 1, writer->f))
+// Sets up the unwind jobs, and with -j the workers that run them. Workers
+// block every signal, so that signals still reach the sampler.
+bool start_unwinders(struct basic_info *binfo)
+{
+    struct unwind_pool *pool = &binfo->unwinders;
+    pool->binfo = binfo;
+    pool->job_count = pool->worker_count ?
+        pool->worker_count * UNWIND_JOBS_PER_WORKER : UNWIND_JOBS_INLINE;
+    if (!(pool->jobs = counted_malloc(pool->job_count *
+                                      sizeof(struct unwind_job))))
         return false;
+    memset(pool->jobs, '\0', pool->job_count * sizeof(struct unwind_job));
 
-    uint32_t lr = regs.ARM_lr & 0xfffffffe, sp = regs.ARM_sp;
-
-    assert(!(sp % 4));
-
-#ifdef DEBUG_STACK_WALKING
-    printf(" /* sp: %08x */", sp);
-#endif
+    for (int i = 0; i < pool->job_count; i++) {
+        struct unwind_job *job = &pool->jobs[i];
+        if (!(job->stack_buf = counted_malloc(binfo->stack_copy_cap)) ||
+                !(job->writer.buf = bfromcstralloc(UNWIND_JOB_BUF_SIZE, "")))
+            return false;
+    }
 
-    static int loop_count = 0;
+    int worker_count = pool->worker_count;
+    pool->worker_count = 0;
+    if (!worker_count)
+        return true;
+    if (!(pool->workers = counted_malloc(worker_count * sizeof(pthread_t))) ||
+            sem_init(&pool->ready, 0, 0) || sem_init(&pool->finished, 0, 0)) {
+        perror("Failed to set up the unwinders");
+        return false;
+    }
 
-    bool ok = true;
-    while (lr && !in_thread_entry(binfo, map, lr)) {
-        val = htonl(lr);
-        if (!fwrite(&val, 4, 1, writer->f)) {
-            ok = false;
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (int i = 0; i < worker_count; i++) {
+        errno = pthread_create(&pool->workers[i], NULL, run_unwind_worker,
+                               pool);
+        if (errno) {
+            perror("Failed to start an unwinder");
             break;
         }
+        pool->worker_count++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return pool->worker_count == worker_count;
+}
 
-        uint32_t maybe_lr;
-        do {
-            errno = 0;
-            if (!peek(binfo, sp, &maybe_lr)) {
-                // Reached the end of the stack.
-                lr = 0;
-                break;
-            }
-
-            sp += 4;
-        } while (!guess_lr_legitimacy(pid, maybe_lr, &lr));
-
-        map = get_map_for_addr(binfo->maps, lr);
+void stop_unwinders(struct basic_info *binfo)
+{
+    struct unwind_pool *pool = &binfo->unwinders;
+    pool->stopping = true;
+    for (int i = 0; i < pool->worker_count; i++)
+        sem_post(&pool->ready);
+    for (int i = 0; i < pool->worker_count; i++)
+        pthread_join(pool->workers[i], NULL);
+    if (pool->workers) {
+        sem_destroy(&pool->ready);
+        sem_destroy(&pool->finished);
+        free(pool->workers);
     }
 
-    ebml_end_tag(writer);
+    for (int i = 0; pool->jobs && i < pool->job_count; i++) {
+        free(pool->jobs[i].stack_buf);
+        bdestroy(pool->jobs[i].writer.buf);
+    }
+    free(pool->jobs);
+    memset(pool, '\0', sizeof(*pool));
+}
 
-    return ok;
+// waitpid() for a thread of a target, which holds on to the exit status of
+// the command we launched if this is what reaps it.
+pid_t wait_for_thread(struct basic_info *binfo, pid_t pid, int *status,
+                      int options)
+{
+    pid_t waited = waitpid(pid, status, options);
+    if (waited > 0 && waited == binfo->launched_pid && !WIFSTOPPED(*status)) {
+        binfo->launched_reaped = true;
+        binfo->launched_status = *status;
+    }
+    return waited;
 }
 
-bool wait_for_process_to_stop(pid_t pid)
+bool wait_for_process_to_stop(struct basic_info *binfo, pid_t pid)
 {
     int status;
     do {
-        if (waitpid(pid, &status, WUNTRACED) == -1)
+        if (wait_for_thread(binfo, pid, &status, WUNTRACED) == -1)
             return false;
     } while (!WIFSTOPPED(status));
 
     return true;
 }
 
-bool read_maps(pid_t pid, bstring *maps)
+bool read_maps(pid_t pid, bstring *maps, bstring *regions)
 {
     struct tagbstring dev_ashmem_lib = bsStatic("/dev/ashmem/lib");
     bool ok = true;
@@ -425,22 +1121,32 @@ bool read_maps(pid_t pid, bstring *maps)
     bool reading_ashmem_map = false;
 
     *maps = bfromcstr("");
+    *regions = bfromcstr("");
     while (!feof(f)) {
         bstring line = bgets((bNgetc)fgetc, f, '\n');
         if (!line)
             break;
 
         struct map map;
-        char name[256];
+        char perms[5], name[256];
         int field_count = sscanf((char *)line->data,
-            "%x-%x %*s %x %*s %*u %255s", &map.start, &map.end, &map.offset,
-            name);
+            "%x-%x %4s %x %*s %*u %255s", &map.start, &map.end, perms,
+            &map.offset, name);
         bdestroy(line);
 
-        if (field_count < 4)
+        if (field_count >= 2) {
+            struct region region = { map.start, map.end };
+            if (bcatblk(*regions, &region, sizeof(region)) != BSTR_OK)
+                break;
+        }
+
+        if (field_count < 5)
             continue;
 
         map.name = bfromcstr(name);
+        map.executable = perms[2] == 'x';
+        map.frame_pointers = false;
+        map.tables = NULL;
 
         // If we're reading an ashmem library, check for the end now.
         if (reading_ashmem_map && bstrcmp(ashmem_map.name, map.name)) {
@@ -467,6 +1173,7 @@ bool read_maps(pid_t pid, bstring *maps)
         // If we got here and we're still reading the ashmem map, then discard
         // the current map; it's part of the ashmem map we're still reading.
         if (reading_ashmem_map) {
+            ashmem_map.executable |= map.executable;
             bdestroy(map.name);
             continue;
         }
@@ -481,8 +1188,21 @@ bool read_maps(pid_t pid, bstring *maps)
     return ok;
 }
 
-bool print_maps(struct ebml_writer *writer, bstring maps)
+void free_maps(bstring maps)
+{
+    if (!maps)
+        return;
+    release_unwind_tables(maps);
+    for (int i = 0; i < maps->slen / sizeof(struct map); i++)
+        bdestroy(((struct map *)maps->data)[i].name);
+    bdestroy(maps);
+}
+
+// Writes the memory map of a process. The PID comes after the regions so
+// that readers that expect only regions can stop at the first other element.
+bool print_maps(struct ebml_writer *writer, struct process *proc)
 {
+    bstring maps = proc->maps;
     if (!ebml_start_tag(writer, EBML_MEMORY_MAP_TAG))
         return false;
 
@@ -493,27 +1213,34 @@ bool print_maps(struct ebml_writer *writer, bstring maps)
             return false;
 
         uint32_t val = htonl(map->start);
-        if (!fwrite(&val, 4, 1, writer->f))
+        if (!ebml_write(writer, &val, 4))
             return false;
         val = htonl(map->end);
-        if (!fwrite(&val, 4, 1, writer->f))
+        if (!ebml_write(writer, &val, 4))
             return false;
         val = htonl(map->offset);
-        if (!fwrite(&val, 4, 1, writer->f))
+        if (!ebml_write(writer, &val, 4))
             return false;
-        if (!fwrite(map->name->data, map->name->slen + 1, 1, writer->f))
+        if (!ebml_write(writer, map->name->data, map->name->slen + 1))
             return false;
 
         ebml_end_tag(writer);
     }
 
+    if (!ebml_start_tag(writer, EBML_PROCESS_PID_TAG) ||
+            !ebml_write_uint32(writer, proc->pid))
+        return false;
+    ebml_end_tag(writer);
+
     ebml_end_tag(writer);
 
+    proc->maps_written = true;
     return true;
 }
 
 void detach_from_thread(pid_t thread_pid)
 {
+    stats.attach_calls++;
     if (ptrace(PTRACE_DETACH, thread_pid, NULL, NULL))
         perror("Failed to detach from thread");
 }
@@ -521,305 +1248,3606 @@ void detach_from_thread(pid_t thread_pid)
 bool wait_for_thread_attachment(pid_t thread_pid)
 {
     int status;
+    stats.attach_calls++;
     return waitpid(thread_pid, &status, __WCLONE) >= 0;
 }
 
-bool get_thread_state(pid_t thread_pid, bstring *result)
+// Seizes a thread for the length of one sample and waits for it to stop.
+// Unlike PTRACE_ATTACH, this sends no SIGSTOP, so the rest of the thread
+// group keeps running. Signals that arrive first are passed through.
+bool seize_thread(struct basic_info *binfo, pid_t thread_pid)
 {
-    bstring path = bformat("/proc/%d/status", thread_pid);
-    if (!path)
+    stats.attach_calls++;
+    if (ptrace(PTRACE_SEIZE, thread_pid, NULL, NULL)) {
+        if (errno == EIO)
+            binfo->group_attach = true;
         return false;
+    }
 
-    FILE *f = fopen((char *)path->data, "r");
-    bdestroy(path);
-    if (!f) {
-        perror("Failed to open /proc/x/status");
-        return false;
+    stats.interrupt_calls++;
+    if (ptrace(PTRACE_INTERRUPT, thread_pid, NULL, NULL))
+        goto fail;
+    while (true) {
+        int status;
+        stats.interrupt_calls++;
+        if (wait_for_thread(binfo, thread_pid, &status, __WALL) == -1)
+            goto fail;
+        if (!WIFSTOPPED(status))
+            return false;
+        if ((status >> 16) == PTRACE_EVENT_STOP)
+            return true;
+
+        stats.interrupt_calls++;
+        if (ptrace(PTRACE_CONT, thread_pid, NULL,
+                   (void *)WSTOPSIG(status)))
+            goto fail;
     }
 
-    bool ok = false;
+fail:
+    detach_from_thread(thread_pid);
+    return false;
+}
 
-    while (!feof(f)) {
-        bstring line = bgets((bNgetc)fgetc, f, '\n');
-        if (!line)
+// Reads the numeric names in an open /proc directory into ids, up to max of
+// them, and returns how many there are, or -1 on error. The directory is
+// read with getdents64() into a stack buffer, so this doesn't allocate.
+int list_pid_dir(int dir, pid_t *ids, int max)
+{
+    if (lseek(dir, 0, SEEK_SET) == -1)
+        return -1;
+
+    uint64_t buf[DIRENT_BUF_SIZE / sizeof(uint64_t)];
+    int count = 0;
+    while (true) {
+        int len = syscall(__NR_getdents64, dir, buf, sizeof(buf));
+        if (len < 0)
+            return -1;
+        if (!len)
             break;
 
-        char name[8];
-        if (!sscanf((char *)line->data, "State:\t%7s", name))
-            continue;
+        for (int pos = 0; pos < len; ) {
+            struct linux_dirent64 *ent =
+                (struct linux_dirent64 *)((uint8_t *)buf + pos);
+            pos += ent->d_reclen;
 
-        *result = bfromcstr(name);
-        ok = true;
+            if (ent->d_name[0] < '0' || ent->d_name[0] > '9')
+                continue;
+            if (count == max)
+                return count;
+            ids[count++] = atoi(ent->d_name);
+        }
     }
 
-    fclose(f);
-    return ok;
+    return count;
 }
 
-bool sample(struct basic_info *binfo, struct ebml_writer *writer)
+// Reads the thread IDs of the current process into binfo->task_ids.
+int list_tasks(struct basic_info *binfo)
 {
-    if (!ebml_start_tag(writer, EBML_SAMPLE_TAG))
-        return false;
+    return list_pid_dir(binfo->process->task_dir, binfo->task_ids, MAX_TASKS);
+}
 
-    bstring tasks_path = bformat("/proc/%d/task", (int)binfo->pid);
-    if (!tasks_path)
-        return false;
+int open_thread_file(pid_t thread_pid, const char *name)
+{
+    char path[40];
+    snprintf(path, sizeof(path), "/proc/%d/%s", (int)thread_pid, name);
+    return open(path, O_RDONLY);
+}
 
-    if (ptrace(PTRACE_ATTACH, binfo->pid, NULL, NULL))
+// Pulls the state letter out of the contents of /proc/TID/stat. The command
+// name in the second field may itself contain spaces and parentheses, so we
+// look for the last ')'.
+bool parse_thread_stat(const char *buf, int len, char *state)
+{
+    int i = len - 1;
+    while (i >= 0 && buf[i] != ')')
+        i--;
+    if (i < 0 || i + 2 >= len)
         return false;
-    if (!wait_for_process_to_stop(binfo->pid))
-        goto out;
-
-    DIR *tasks_dir = opendir((char *)tasks_path->data);
-    bdestroy(tasks_path);
-    if (!tasks_dir) {
-        perror("Failed to open /proc/x/task");
-        goto out;
-    }
 
-    struct dirent *ent;
+    *state = buf[i + 2];
+    return true;
+}
+
+// Reads a thread's scheduler state with a single pread() of its already open
+// /proc/TID/stat.
+bool get_thread_state(int stat_fd, char *state)
+{
+    uint64_t start = now_ns();
+
+    char buf[STAT_BUF_SIZE];
+    int len = pread(stat_fd, buf, sizeof(buf), 0);
+    bool ok = len > 0 && parse_thread_stat(buf, len, state);
+
+    stats.state_reads++;
+    stats.state_read_calls++;
+    stats.state_read_ns += now_ns() - start;
+    return ok;
+}
+
+void close_thread_reads(struct thread_reads *reads)
+{
+    if (reads->sqes)
+        munmap(reads->sqes, reads->sqes_size);
+    if (reads->cq_ring)
+        munmap(reads->cq_ring, reads->cq_ring_size);
+    if (reads->sq_ring)
+        munmap(reads->sq_ring, reads->sq_ring_size);
+    if (reads->ring_fd >= 0)
+        close(reads->ring_fd);
+    reads->sq_ring = reads->cq_ring = NULL;
+    reads->sqes = NULL;
+    reads->ring_fd = -1;
+}
+
+void *map_io_uring(int fd, size_t size, off_t offset)
+{
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                     offset);
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+// Sets up the batches of reads of threads' /proc files, through an io_uring
+// unless use_io_uring is false (-I, to compare the two) or there's none to
+// be had, which is normal for older kernels and in seccomp sandboxes.
+// Without one, the reads are made one at a time.
+bool open_thread_reads(struct thread_reads *reads, bool use_io_uring)
+{
+    reads->size = THREAD_READ_BATCH_SIZE;
+
+    struct io_uring_params params;
+    memset(&params, '\0', sizeof(params));
+    reads->ring_fd = !use_io_uring ? -1 :
+        syscall(__NR_io_uring_setup, THREAD_READ_BATCH_SIZE, &params);
+    if (reads->ring_fd >= 0) {
+        reads->sq_ring_size = params.sq_off.array +
+            params.sq_entries * sizeof(uint32_t);
+        reads->cq_ring_size = params.cq_off.cqes +
+            params.cq_entries * sizeof(struct io_uring_cqe);
+        reads->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        reads->sq_ring = map_io_uring(reads->ring_fd, reads->sq_ring_size,
+                                      IORING_OFF_SQ_RING);
+        reads->cq_ring = map_io_uring(reads->ring_fd, reads->cq_ring_size,
+                                      IORING_OFF_CQ_RING);
+        reads->sqes = map_io_uring(reads->ring_fd, reads->sqes_size,
+                                   IORING_OFF_SQES);
+        if (!reads->sq_ring || !reads->cq_ring || !reads->sqes) {
+            perror("Couldn't map the io_uring; reading /proc with pread()");
+            close_thread_reads(reads);
+        }
+    }
+
+    if (reads->ring_fd >= 0) {
+        if (reads->size > params.sq_entries)
+            reads->size = params.sq_entries;
+        reads->sq_off = params.sq_off;
+        reads->cq_off = params.cq_off;
+
+        // Every submission queue entry stays at its own index.
+        uint32_t *array = (uint32_t *)((uint8_t *)reads->sq_ring +
+                                       params.sq_off.array);
+        for (uint32_t i = 0; i < params.sq_entries; i++)
+            array[i] = i;
+    }
+
+    reads->fds = counted_malloc(reads->size * sizeof(int));
+    reads->iovecs = counted_malloc(reads->size * sizeof(struct iovec));
+    reads->results = counted_malloc(reads->size * sizeof(int));
+    reads->bufs = counted_malloc(reads->size * STAT_BUF_SIZE);
+    if (!reads->fds || !reads->iovecs || !reads->results || !reads->bufs)
+        return false;
+    for (uint32_t i = 0; i < reads->size; i++) {
+        reads->iovecs[i].iov_base = reads->bufs + i * STAT_BUF_SIZE;
+        reads->iovecs[i].iov_len = STAT_BUF_SIZE - 1;
+    }
+    return true;
+}
+
+void free_thread_reads(struct thread_reads *reads)
+{
+    close_thread_reads(reads);
+    free(reads->fds);
+    free(reads->iovecs);
+    free(reads->results);
+    free(reads->bufs);
+}
+
+// Adds a read of the whole of an open file to the batch, returning where its
+// result will be, or -1 if the batch is full.
+int queue_thread_read(struct thread_reads *reads, int fd)
+{
+    if (fd < 0 || reads->count == reads->size)
+        return -1;
+    reads->fds[reads->count] = fd;
+    return reads->count++;
+}
+
+// Submits the whole batch to the io_uring at once and waits for all of it.
+bool run_io_uring_reads(struct thread_reads *reads)
+{
+    uint8_t *sq = reads->sq_ring, *cq = reads->cq_ring;
+    volatile uint32_t *sq_tail = (uint32_t *)(sq + reads->sq_off.tail);
+    uint32_t sq_mask = *(uint32_t *)(sq + reads->sq_off.ring_mask);
+    uint32_t tail = *sq_tail;
+    for (uint32_t i = 0; i < reads->count; i++) {
+        struct io_uring_sqe *sqe = &reads->sqes[(tail + i) & sq_mask];
+        memset(sqe, '\0', sizeof(*sqe));
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = reads->fds[i];
+        sqe->addr = (uintptr_t)&reads->iovecs[i];
+        sqe->len = 1;
+        sqe->off = 0;
+        sqe->user_data = i;
+    }
+    __sync_synchronize();
+    *sq_tail = tail + reads->count;
+
+    volatile uint32_t *cq_head = (uint32_t *)(cq + reads->cq_off.head);
+    volatile uint32_t *cq_tail = (uint32_t *)(cq + reads->cq_off.tail);
+    uint32_t cq_mask = *(uint32_t *)(cq + reads->cq_off.ring_mask);
+    struct io_uring_cqe *cqes = (struct io_uring_cqe *)(cq +
+                                                        reads->cq_off.cqes);
+    uint32_t to_submit = reads->count, reaped = 0;
+    while (reaped < reads->count) {
+        stats.state_read_calls++;
+        int n = syscall(__NR_io_uring_enter, reads->ring_fd, to_submit,
+                        reads->count - reaped, IORING_ENTER_GETEVENTS, NULL,
+                        0);
+        if (n < 0 && errno != EINTR)
+            return false;
+        if (n > 0)
+            to_submit -= n;
+
+        uint32_t head = *cq_head;
+        __sync_synchronize();
+        for (; head != *cq_tail; head++) {
+            struct io_uring_cqe *cqe = &cqes[head & cq_mask];
+            if (cqe->user_data < reads->count)
+                reads->results[cqe->user_data] = cqe->res;
+            reaped++;
+        }
+        __sync_synchronize();
+        *cq_head = head;
+    }
+    return true;
+}
+
+// Reads everything in the batch, and starts a new one.
+void run_thread_reads(struct thread_reads *reads)
+{
+    if (!reads->count)
+        return;
+
+    uint64_t start = now_ns();
+    if (reads->ring_fd >= 0 && !run_io_uring_reads(reads)) {
+        // Give up on the io_uring for good. Any reads it did are done again.
+        perror("io_uring_enter() failed; reading /proc with pread()");
+        close_thread_reads(reads);
+    }
+    if (reads->ring_fd < 0) {
+        for (uint32_t i = 0; i < reads->count; i++) {
+            reads->results[i] = pread(reads->fds[i], reads->iovecs[i].iov_base,
+                                      reads->iovecs[i].iov_len, 0);
+        }
+        stats.state_read_calls += reads->count;
+    }
+
+    stats.state_reads += reads->count;
+    stats.state_read_ns += now_ns() - start;
+    reads->count = 0;
+}
+
+// Returns the contents of a file read in the last batch, NUL-terminated, or
+// NULL if it couldn't be read.
+const char *get_thread_read(struct thread_reads *reads, int index, int *len)
+{
+    if (index < 0 || reads->results[index] <= 0)
+        return NULL;
+    char *buf = reads->iovecs[index].iov_base;
+    *len = reads->results[index];
+    buf[*len] = '\0';
+    return buf;
+}
+
+// Matches a thread name against a pattern in which '*' stands for any string
+// and '?' for any character.
+bool match_pattern(const char *pattern, const char *str)
+{
+    for (; *pattern; pattern++, str++) {
+        if (*pattern == '*') {
+            do {
+                if (match_pattern(pattern + 1, str))
+                    return true;
+            } while (*str++);
+            return false;
+        }
+        if (!*str || (*pattern != '?' && *pattern != *str))
+            return false;
+    }
+    return !*str;
+}
+
+// A spec that is all digits is a TID; anything else is a name pattern.
+bool filter_matches(const struct thread_filter *filter, pid_t pid,
+                    const char *comm)
+{
+    for (int i = 0; i < filter->count; i++) {
+        const char *spec = filter->specs[i];
+        char *end;
+        long tid = strtol(spec, &end, 10);
+        if (*spec && !*end ? tid == pid : match_pattern(spec, comm))
+            return true;
+    }
+    return false;
+}
+
+// Reads a thread's name from /proc/TID/comm, leaving it empty if it can't be
+// read. comm must hold COMM_SIZE bytes.
+void get_thread_comm(pid_t thread_pid, char *comm)
+{
+    int len = -1;
+    int fd = open_thread_file(thread_pid, "comm");
+    if (fd >= 0) {
+        len = read(fd, comm, COMM_SIZE - 1);
+        close(fd);
+    }
+    if (len > 0 && comm[len - 1] == '\n')
+        len--;
+    comm[len > 0 ? len : 0] = '\0';
+}
+
+// Decides whether a thread is sampled at all, and if so whether it's sampled
+// on every tick. This is done once, when the thread is first seen, so a
+// thread that renames itself later keeps the name it had then.
+void classify_thread(struct basic_info *binfo, pid_t thread_pid,
+                     bool *selected, bool *fast)
+{
+    char comm[COMM_SIZE] = "";
+    if (binfo->include.count || binfo->exclude.count || binfo->fast.count)
+        get_thread_comm(thread_pid, comm);
+
+    *selected = (!binfo->include.count ||
+                 filter_matches(&binfo->include, thread_pid, comm)) &&
+        !filter_matches(&binfo->exclude, thread_pid, comm);
+    *fast = binfo->slow_ticks <= 1 ||
+        filter_matches(&binfo->fast, thread_pid, comm);
+}
+
+// Pulls the CPU time a thread has used out of the contents of
+// /proc/TID/schedstat, where it's the first field.
+bool parse_thread_schedstat(const char *buf, uint64_t *run_ns)
+{
+    char *end;
+    *run_ns = strtoull(buf, &end, 10);
+    return end != buf;
+}
+
+// Reads /proc/TID/syscall into buf, which must hold SYSCALL_BUF_SIZE bytes,
+// and pulls out the syscall number and the user SP and PC. The kernel only
+// reports these for blocked threads; the syscall number is -1 for a thread
+// that is blocked outside of a syscall, such as in a page fault.
+bool get_thread_syscall(int syscall_fd, char *buf, int *len, int32_t *nr,
+                        uint32_t *sp, uint32_t *pc)
+{
+    *len = pread(syscall_fd, buf, SYSCALL_BUF_SIZE - 1, 0);
+    if (*len <= 0)
+        return false;
+    buf[*len] = '\0';
+
+    // Either "NR ARG1 ... ARG6 SP PC", "-1 SP PC" or "running".
+    unsigned long long fields[9];
+    int count = 0;
+    char *pos = buf, *end;
+    while (count < 9) {
+        fields[count] = strtoull(pos, &end, 0);
+        if (end == pos)
+            break;
+        count++;
+        pos = end;
+    }
+    if (count != 9 && count != 3)
+        return false;
+
+    *nr = (int32_t)fields[0];
+    *sp = fields[count - 2];
+    *pc = fields[count - 1];
+    return true;
+}
+
+// Starts a THREAD_SAMPLE element and writes the thread's PID, its status and
+// the PID of the current process into it. The caller writes the stack and ends
+// the element.
+bool start_thread_sample(struct basic_info *binfo, struct ebml_writer *writer,
+                         pid_t thread_pid, char state)
+{
+    if (!ebml_start_tag(writer, EBML_THREAD_SAMPLE_TAG))
+        return false;
+
+    if (!ebml_start_tag(writer, EBML_THREAD_PID_TAG))
+        return false;
+    uint32_t pid_buf = htonl(thread_pid);
+    if (!ebml_write(writer, &pid_buf, sizeof(pid_buf)))
+        return false;
+    ebml_end_tag(writer);
+
+    if (!ebml_start_tag(writer, EBML_THREAD_STATUS_TAG))
+        return false;
+    char state_buf[2] = { state, '\0' };
+    if (!ebml_write(writer, state_buf, sizeof(state_buf)))
+        return false;
+    ebml_end_tag(writer);
+
+    if (!ebml_start_tag(writer, EBML_PROCESS_PID_TAG) ||
+            !ebml_write_uint32(writer, binfo->process->pid))
+        return false;
+    ebml_end_tag(writer);
+
+    return true;
+}
+
+// Starts a THREAD_SAMPLE element for a thread in the thread table. Threads
+// that are only sampled every slow_ticks carry their own weight, which
+// overrides that of the SAMPLE.
+bool begin_thread_sample(struct basic_info *binfo, struct ebml_writer *writer,
+                         struct thread *thread)
+{
+    if (!start_thread_sample(binfo, writer, thread->pid, thread->state))
+        return false;
+    if (thread->fast)
+        return true;
+    return ebml_write_sample_weight(writer, binfo->interval_ns *
+                                    binfo->slow_ticks);
+}
+
+// Writes a THREAD_SAMPLE element for a thread that is in a ptrace stop, or
+// rather captures the thread so that the element can be written once it's
+// unwound.
+bool write_thread_sample(struct basic_info *binfo, struct ebml_writer *writer,
+                         struct thread *thread)
+{
+    struct unwind_job *job = next_unwind_job(binfo, writer);
+    if (!job || !begin_thread_sample(binfo, &job->writer, thread))
+        return false;
+
+    bool ok = capture_thread(binfo, job, thread->pid);
+    thread->reusable = ok;
+    if (ok) {
+        submit_unwind_job(binfo, job);
+        stats.thread_samples++;
+    }
+    return ok;
+}
+
+// Writes a THREAD_SAMPLE element for a blocked thread without stopping it,
+// from the SP and PC in /proc/TID/syscall. The link register isn't available
+// this way, so the caller of a leaf function such as a syscall stub is lost.
+// Returns false if the thread isn't blocked, or woke up while we copied its
+// stack; such a thread has to be stopped instead.
+bool write_blocked_thread_sample(struct basic_info *binfo,
+                                 struct ebml_writer *writer,
+                                 struct thread *thread, bool *ok)
+{
+    if (thread->syscall_fd < 0 ||
+            (thread->state != 'S' && thread->state != 'D'))
+        return false;
+
+    char buf[SYSCALL_BUF_SIZE], check_buf[SYSCALL_BUF_SIZE];
+    int len, check_len;
+    int32_t nr;
+    uint32_t sp, pc;
+    if (!get_thread_syscall(thread->syscall_fd, buf, &len, &nr, &sp, &pc))
+        return false;
+
+    struct unwind_job *job = next_unwind_job(binfo, writer);
+    if (!job) {
+        *ok = false;
+        return true;
+    }
+    snapshot_stack(binfo, sp & ~0x3, job->stack_buf, &job->stack);
+
+    // If the thread is still blocked at the same spot, the stack we copied
+    // belongs to it.
+    if (!get_thread_syscall(thread->syscall_fd, check_buf, &check_len, &nr,
+                            &sp, &pc) ||
+            check_len != len || memcmp(buf, check_buf, len))
+        return false;
+
+    *ok = begin_thread_sample(binfo, &job->writer, thread) &&
+        ebml_start_tag(&job->writer, EBML_THREAD_SYSCALL_TAG) &&
+        ebml_write_uint32(&job->writer, nr);
+    if (!*ok)
+        return true;
+    ebml_end_tag(&job->writer);
+
+    job->regs.r[UNWIND_REG_PC] = pc;
+    job->regs.r[UNWIND_REG_SP] = job->stack.sp;
+    job->regs.valid = (1 << UNWIND_REG_PC) | (1 << UNWIND_REG_SP);
+    submit_unwind_job(binfo, job);
+    thread->reusable = true;
+    stats.thread_samples++;
+    stats.blocked_samples++;
+    return true;
+}
+
+// Writes a THREAD_SAMPLE element that says the thread's stack is the same as
+// in its previous sample, for a thread that hasn't run since.
+bool write_idle_thread_sample(struct basic_info *binfo,
+                              struct ebml_writer *writer,
+                              struct thread *thread)
+{
+    if (!begin_thread_sample(binfo, writer, thread))
+        return false;
+    if (!ebml_start_tag(writer, EBML_SAME_STACK_TAG))
+        return false;
+    ebml_end_tag(writer);
+    ebml_end_tag(writer);
+
+    stats.thread_samples++;
+    stats.idle_samples++;
+    return true;
+}
+
+// Samples a thread if that can be done without stopping it, and otherwise
+// marks it as needing to be stopped.
+bool write_unstopped_thread_sample(struct basic_info *binfo,
+                                   struct ebml_writer *writer,
+                                   struct thread *thread)
+{
+    thread->stop = false;
+    if (!thread->state)
+        return true;
+
+    // The flight recorder drops old ticks, and with them the stack that a
+    // SAME_STACK would refer back to, so it gets the whole stack every time.
+    // An idle thread is usually blocked, so it still isn't stopped for it.
+    if (thread->idle && !binfo->recorder.data)
+        return write_idle_thread_sample(binfo, writer, thread);
+
+    bool ok = true;
+    if (!write_blocked_thread_sample(binfo, writer, thread, &ok))
+        thread->stop = true;
+    return ok;
+}
+
+// Adds to the time that threads spent stopped during the current tick.
+void account_stop_time(struct basic_info *binfo, uint64_t stop_ns)
+{
+    binfo->last_stop_ns += stop_ns;
+    stats.stop_ns += stop_ns;
+}
+
+int get_process_count(struct basic_info *binfo)
+{
+    return binfo->processes->slen / sizeof(struct process);
+}
+
+struct process *get_process_at(struct basic_info *binfo, int index)
+{
+    return &((struct process *)binfo->processes->data)[index];
+}
+
+// There are only ever a handful of processes, so a linear search will do.
+struct process *get_process(struct basic_info *binfo, pid_t pid)
+{
+    for (int i = 0; i < get_process_count(binfo); i++) {
+        if (get_process_at(binfo, i)->pid == pid)
+            return get_process_at(binfo, i);
+    }
+    return NULL;
+}
+
+bool any_live_process(struct basic_info *binfo)
+{
+    for (int i = 0; i < get_process_count(binfo); i++) {
+        if (get_process_at(binfo, i)->live)
+            return true;
+    }
+    return false;
+}
+
+// Whether the event loop should stop after this tick: the targets are gone,
+// or we've taken as many ticks as -n asked for.
+bool profiling_done(struct basic_info *binfo)
+{
+    return !any_live_process(binfo) ||
+        (binfo->tick_limit && stats.ticks >= binfo->tick_limit);
+}
+
+//
+// The thread table
+//
+// Both ptrace modes keep a table of the target's threads with their /proc
+// files open. In the default mode it is brought up to date from
+// /proc/PID/task on every tick. In persistent mode, threads are seized once
+// with clone and exit tracing turned on, so the table follows the target's
+// threads as they come and go; a rescan every RESCAN_INTERVAL_TICKS catches
+// anything we missed.
+//
+
+int compare_pid_and_thread(const void *pid_p, const void *thread_p)
+{
+    pid_t pid = *(const pid_t *)pid_p;
+    const struct thread *thread = thread_p;
+    if (pid < thread->pid)
+        return -1;
+    if (pid > thread->pid)
+        return 1;
+    return 0;
+}
+
+int get_thread_count(struct basic_info *binfo)
+{
+    return binfo->process->threads->slen / sizeof(struct thread);
+}
+
+struct thread *get_thread_at(struct basic_info *binfo, int index)
+{
+    return &((struct thread *)binfo->process->threads->data)[index];
+}
+
+struct thread *get_thread(struct basic_info *binfo, pid_t pid)
+{
+    return (struct thread *)bsearch(&pid, binfo->process->threads->data,
+        get_thread_count(binfo), sizeof(struct thread),
+        compare_pid_and_thread);
+}
+
+// Returns the thread with the lowest PID greater than the given one. Iterating
+// this way stays correct while event handling adds and removes threads.
+struct thread *get_next_thread(struct basic_info *binfo, pid_t pid)
+{
+    for (int i = 0; i < get_thread_count(binfo); i++) {
+        struct thread *thread = get_thread_at(binfo, i);
+        if (thread->pid > pid)
+            return thread;
+    }
+    return NULL;
+}
+
+void close_thread(struct thread *thread)
+{
+    if (thread->stat_fd < 0)
+        return;
+    close(thread->stat_fd);
+    if (thread->schedstat_fd >= 0)
+        close(thread->schedstat_fd);
+    if (thread->syscall_fd >= 0)
+        close(thread->syscall_fd);
+}
+
+struct thread *add_thread(struct basic_info *binfo, pid_t pid)
+{
+    int index = 0;
+    while (index < get_thread_count(binfo) &&
+            get_thread_at(binfo, index)->pid < pid)
+        index++;
+
+    struct thread thread;
+    memset(&thread, '\0', sizeof(thread));
+    thread.pid = pid;
+    thread.stat_fd = thread.schedstat_fd = thread.syscall_fd = -1;
+    classify_thread(binfo, pid, &thread.selected, &thread.fast);
+    if (thread.selected) {
+        if ((thread.stat_fd = open_thread_file(pid, "stat")) < 0)
+            return NULL;
+        thread.schedstat_fd = open_thread_file(pid, "schedstat");
+        thread.syscall_fd = open_thread_file(pid, "syscall");
+    }
+
+    struct tagbstring thread_blk;
+    btfromblk(thread_blk, &thread, sizeof(thread));
+    if (binsert(binfo->process->threads, index * sizeof(thread), &thread_blk,
+                '\0') != BSTR_OK) {
+        close_thread(&thread);
+        return NULL;
+    }
+    return get_thread_at(binfo, index);
+}
+
+void remove_thread(struct basic_info *binfo, pid_t pid)
+{
+    struct thread *thread = get_thread(binfo, pid);
+    if (!thread)
+        return;
+    close_thread(thread);
+    bstring threads = binfo->process->threads;
+    bdelete(threads, (uint8_t *)thread - threads->data, sizeof(struct thread));
+}
+
+// Adds a thread to the table and to the lifetime log. A creation time of zero
+// means that the thread was already running when profiling started.
+struct thread *track_thread(struct basic_info *binfo, pid_t pid,
+                            uint64_t created_ns)
+{
+    struct thread_lifetime lifetime;
+    memset(&lifetime, '\0', sizeof(lifetime));
+    lifetime.pid = pid;
+    lifetime.created_ns = created_ns;
+    if (bcatblk(binfo->process->thread_log, &lifetime, sizeof(lifetime)) !=
+            BSTR_OK)
+        return NULL;
+
+    return add_thread(binfo, pid);
+}
+
+void forget_thread(struct basic_info *binfo, pid_t pid)
+{
+    if (!get_thread(binfo, pid))
+        return;
+    remove_thread(binfo, pid);
+
+    // PIDs can be reused, so search for the most recent entry.
+    bstring thread_log = binfo->process->thread_log;
+    struct thread_lifetime *log = (struct thread_lifetime *)thread_log->data;
+    for (int i = thread_log->slen / sizeof(*log) - 1; i >= 0; i--) {
+        if (log[i].pid == pid) {
+            log[i].exited_ns = now_ns();
+            break;
+        }
+    }
+}
+
+// Handles a wait status for a seized thread other than the interrupt stop that
+// we asked for, resuming the thread if it's still around.
+void handle_thread_event(struct basic_info *binfo, pid_t thread_pid,
+                         int status)
+{
+    stats.thread_events++;
+
+    if (!WIFSTOPPED(status)) {
+        forget_thread(binfo, thread_pid);
+        return;
+    }
+
+    int sig = 0;
+    unsigned long new_pid;
+    switch (status >> 16) {
+    case PTRACE_EVENT_CLONE:
+        if (!ptrace(PTRACE_GETEVENTMSG, thread_pid, NULL, &new_pid) &&
+                !get_thread(binfo, new_pid))
+            track_thread(binfo, new_pid, now_ns());
+        break;
+    case PTRACE_EVENT_EXIT:
+        // The thread is on its way out; stop sampling it now.
+        forget_thread(binfo, thread_pid);
+        break;
+    case PTRACE_EVENT_STOP:
+        // New threads start out in this stop, and it may reach us before
+        // the creating thread's clone event does.
+        if (!get_thread(binfo, thread_pid))
+            track_thread(binfo, thread_pid, now_ns());
+        break;
+    case 0:
+        // Signal-delivery stop; pass the signal through.
+        sig = WSTOPSIG(status);
+        break;
+    }
+
+    // New threads are traced automatically; let go of those we don't sample.
+    struct thread *thread = get_thread(binfo, thread_pid);
+    if (thread && !thread->selected)
+        ptrace(PTRACE_DETACH, thread_pid, NULL, (void *)sig);
+    else
+        ptrace(PTRACE_CONT, thread_pid, NULL, (void *)sig);
+}
+
+// Makes the live process that a thread belongs to the current one. A new
+// thread may not be in the thread table yet, so /proc/PID/task is checked too.
+bool find_thread_process(struct basic_info *binfo, pid_t thread_pid)
+{
+    char name[16];
+    snprintf(name, sizeof(name), "%d", (int)thread_pid);
+    for (int i = 0; i < get_process_count(binfo); i++) {
+        struct stat st;
+        binfo->process = get_process_at(binfo, i);
+        if (!binfo->process->live || !binfo->process->threads)
+            continue;
+        if (get_thread(binfo, thread_pid) ||
+                !fstatat(binfo->process->task_dir, name, &st, 0))
+            return true;
+    }
+    return false;
+}
+
+// Handles every thread event that is pending, without blocking. The events
+// can be for threads of any of the target processes.
+void handle_thread_events(struct basic_info *binfo)
+{
+    struct process *current = binfo->process;
+    pid_t thread_pid;
+    int status;
+    while ((thread_pid = wait_for_thread(binfo, -1, &status,
+                                         __WALL | WNOHANG)) > 0) {
+        if (find_thread_process(binfo, thread_pid)) {
+            handle_thread_event(binfo, thread_pid, status);
+        } else if (WIFSTOPPED(status)) {
+            // Left over from a process that we've stopped profiling.
+            stats.thread_events++;
+            ptrace(PTRACE_DETACH, thread_pid, NULL,
+                   (void *)((status >> 16) ? 0 : WSTOPSIG(status)));
+        }
+    }
+    binfo->process = current;
+}
+
+// Stops a seized thread and waits until it reaches the interrupt stop,
+// handling any other events for the thread that arrive in the meantime.
+// Returns false if the thread exited instead.
+bool interrupt_thread(struct basic_info *binfo, pid_t thread_pid)
+{
+    stats.interrupt_calls++;
+    if (ptrace(PTRACE_INTERRUPT, thread_pid, NULL, NULL))
+        return false;
+
+    while (true) {
+        int status;
+        stats.interrupt_calls++;
+        if (wait_for_thread(binfo, thread_pid, &status, __WALL) == -1)
+            return false;
+        if (WIFSTOPPED(status) && (status >> 16) == PTRACE_EVENT_STOP)
+            return true;
+
+        handle_thread_event(binfo, thread_pid, status);
+        if (!get_thread(binfo, thread_pid))
+            return false;
+    }
+}
+
+void resume_thread(pid_t thread_pid)
+{
+    stats.interrupt_calls++;
+    if (ptrace(PTRACE_CONT, thread_pid, NULL, NULL))
+        perror("Failed to resume thread");
+}
+
+// Adds any threads we don't know about yet, seizing them in persistent mode,
+// and forgets threads that are gone. In persistent mode this is only a safety
+// net; normally clone and exit events keep the table up to date.
+bool scan_threads(struct basic_info *binfo, bool initial)
+{
+    int task_count = list_tasks(binfo);
+    if (task_count < 0) {
+        perror("Failed to read /proc/x/task");
+        return false;
+    }
+
+    stats.rescans++;
+    for (int i = 0; i < get_thread_count(binfo); i++)
+        get_thread_at(binfo, i)->seen = false;
+
+    for (int i = 0; i < task_count; i++) {
+        pid_t thread_pid = binfo->task_ids[i];
+        struct thread *thread = get_thread(binfo, thread_pid);
+        if (!thread) {
+            if (!(thread = track_thread(binfo, thread_pid,
+                                        initial ? 0 : now_ns())))
+                continue;
+
+            // A thread we can't seize simply isn't sampled.
+            if (binfo->persistent && thread->selected) {
+                stats.attach_calls++;
+                if (ptrace(PTRACE_SEIZE, thread_pid, NULL,
+                           (void *)PTRACE_SEIZE_OPTIONS)) {
+                    close_thread(thread);
+                    thread->stat_fd = -1;
+                    thread->selected = false;
+                }
+            }
+        }
+        thread->seen = true;
+    }
+
+    pid_t thread_pid = 0;
+    struct thread *thread;
+    while ((thread = get_next_thread(binfo, thread_pid))) {
+        thread_pid = thread->pid;
+        if (!thread->seen)
+            forget_thread(binfo, thread_pid);
+    }
+
+    return true;
+}
+
+// Decides which threads need a full sample this tick, having read the state
+// of each thread that is due. A thread that isn't running and hasn't used
+// any CPU time since its last full sample is still exactly where it was, so
+// its last stack holds. Running threads are always sampled, since their CPU
+// time is only brought up to date at scheduler events.
+//
+// The reads for every thread go in as few batches as possible.
+void check_threads(struct basic_info *binfo)
+{
+    struct thread_reads *reads = &binfo->thread_reads;
+    int first = 0, count = get_thread_count(binfo);
+    while (first < count) {
+        int end = first;
+        for (; end < count && reads->count + 2 <= reads->size; end++) {
+            struct thread *thread = get_thread_at(binfo, end);
+            thread->idle = false;
+            thread->state = '\0';
+            thread->stat_read = thread->schedstat_read = -1;
+            if (!thread->selected ||
+                    (!thread->fast && stats.ticks % binfo->slow_ticks != 0))
+                continue;
+
+            // The CPU time is only needed if the thread turns out not to be
+            // running, but reading it anyway is free.
+            thread->stat_read = queue_thread_read(reads, thread->stat_fd);
+            if (thread->reusable) {
+                thread->schedstat_read =
+                    queue_thread_read(reads, thread->schedstat_fd);
+            }
+        }
+        run_thread_reads(reads);
+
+        for (; first < end; first++) {
+            struct thread *thread = get_thread_at(binfo, first);
+            int len;
+            const char *buf = get_thread_read(reads, thread->stat_read, &len);
+            if (!buf || !parse_thread_stat(buf, len, &thread->state)) {
+                thread->state = '\0';
+                continue;
+            }
+            if (thread->state == 'R' || !thread->reusable)
+                continue;
+
+            uint64_t run_ns;
+            buf = get_thread_read(reads, thread->schedstat_read, &len);
+            thread->idle = buf && parse_thread_schedstat(buf, &run_ns) &&
+                run_ns == thread->run_ns;
+        }
+    }
+}
+
+// Takes the CPU time baseline for every thread that had a full sample this
+// tick. Stopping and resuming a blocked thread makes it run briefly, so this
+// has to wait until we've let the threads go and they have blocked again; a
+// thread that hasn't simply gets another full sample next time.
+void settle_threads(struct basic_info *binfo)
+{
+    struct thread_reads *reads = &binfo->thread_reads;
+    int first = 0, count = get_thread_count(binfo);
+    while (first < count) {
+        int end = first;
+        for (; end < count && reads->count + 2 <= reads->size; end++) {
+            struct thread *thread = get_thread_at(binfo, end);
+            thread->stat_read = thread->schedstat_read = -1;
+            if (!thread->state || thread->idle)
+                continue;
+            thread->reusable = thread->reusable && thread->schedstat_fd >= 0;
+            if (thread->reusable) {
+                thread->stat_read = queue_thread_read(reads,
+                                                      thread->stat_fd);
+                thread->schedstat_read =
+                    queue_thread_read(reads, thread->schedstat_fd);
+            }
+        }
+        run_thread_reads(reads);
+
+        for (; first < end; first++) {
+            struct thread *thread = get_thread_at(binfo, first);
+            if (thread->stat_read < 0)
+                continue;
+
+            char state;
+            int len;
+            const char *buf = get_thread_read(reads, thread->stat_read, &len);
+            thread->reusable = buf && parse_thread_stat(buf, len, &state) &&
+                (state == 'S' || state == 'D') &&
+                (buf = get_thread_read(reads, thread->schedstat_read,
+                                       &len)) &&
+                parse_thread_schedstat(buf, &thread->run_ns);
+        }
+    }
+}
+
+// Writes a THREAD_SAMPLE for each thread of the current process that is due
+// on this tick.
+bool sample(struct basic_info *binfo, struct ebml_writer *writer)
+{
+    if (!scan_threads(binfo, false))
+        return false;
+
+    // We do this before we trace. If we don't, the status unhelpfully
+    // returns "T" for "traced". Idle and blocked threads are sampled right
+    // away, and if that covers every thread, there's no need to stop the
+    // process at all.
+    check_threads(binfo);
+    bool ok = true, any_stopped = false;
+    for (int i = 0; ok && i < get_thread_count(binfo); i++) {
+        struct thread *thread = get_thread_at(binfo, i);
+        ok = write_unstopped_thread_sample(binfo, writer, thread);
+        if (thread->stop)
+            any_stopped = true;
+    }
+
+    if (!ok || !any_stopped) {
+        settle_threads(binfo);
+        return write_unwind_jobs(binfo, writer, 0) && ok;
+    }
+
+    // Each thread that has to be stopped is seized on its own, so that the
+    // blocked ones sampled above go on undisturbed.
+    uint64_t stop_ns = 0;
+    for (int i = 0; ok && !binfo->group_attach &&
+            i < get_thread_count(binfo); i++) {
+        struct thread *thread = get_thread_at(binfo, i);
+        if (!thread->stop)
+            continue;
+        if (!(ok = make_room_for_unwind_job(binfo, writer)))
+            break;
+
+        uint64_t stop_start = now_ns();
+        if (!seize_thread(binfo, thread->pid))
+            continue;
+        ok = write_thread_sample(binfo, writer, thread);
+        detach_from_thread(thread->pid);
+        stop_ns += now_ns() - stop_start;
+    }
+    if (!binfo->group_attach) {
+        account_stop_time(binfo, stop_ns);
+        settle_threads(binfo);
+        return write_unwind_jobs(binfo, writer, 0) && ok;
+    }
+
+    // Without PTRACE_SEIZE, attaching sends SIGSTOP, which stops the whole
+    // thread group, so attach to the process and then to each thread.
+    uint64_t stop_start = now_ns();
+    stats.attach_calls += 2;
+    if (ptrace(PTRACE_ATTACH, binfo->process->pid, NULL, NULL)) {
+        write_unwind_jobs(binfo, writer, 0);
+        return false;
+    }
+    if (!wait_for_process_to_stop(binfo, binfo->process->pid))
+        goto out;
+
+    for (int i = 0; ok && i < get_thread_count(binfo); i++) {
+        struct thread *thread = get_thread_at(binfo, i);
+        pid_t thread_pid = thread->pid;
+        if (!thread->stop)
+            continue;
+
+        // Attach to the thread if we need to.
+        if (binfo->process->pid != thread_pid) {
+            stats.attach_calls++;
+            if (ptrace(PTRACE_ATTACH, thread_pid, NULL, NULL))
+                continue;
+            if (!wait_for_thread_attachment(thread_pid))
+                continue;
+        }
+
+        if (!write_thread_sample(binfo, writer, thread))
+            ok = false;
+
+        if (binfo->process->pid != thread_pid)
+            detach_from_thread((pid_t)thread_pid);
+    }
+
+out:
+    stats.attach_calls++;
+    if (ptrace(PTRACE_DETACH, binfo->process->pid, NULL, NULL))
+        perror("Failed to detach from process");
+    account_stop_time(binfo, now_ns() - stop_start);
+    settle_threads(binfo);
+
+    // Whatever is still being unwound, the process is running again.
+    return write_unwind_jobs(binfo, writer, 0) && ok;
+}
+
+// Like sample(), for threads that we have seized.
+bool sample_persistent(struct basic_info *binfo, struct ebml_writer *writer)
+{
+    if (stats.ticks % RESCAN_INTERVAL_TICKS == 0 &&
+            !scan_threads(binfo, false))
+        return false;
+
+    // As in sample(), read the states while the threads are still running.
+    // Threads that turn up during the tick are left for the next one.
+    check_threads(binfo);
+
+    uint64_t stop_ns = 0;
+    bool ok = true;
+    pid_t thread_pid = 0;
+    struct thread *thread;
+    while (ok && (thread = get_next_thread(binfo, thread_pid))) {
+        thread_pid = thread->pid;
+        ok = write_unstopped_thread_sample(binfo, writer, thread);
+        if (!ok || !thread->stop ||
+                !(ok = make_room_for_unwind_job(binfo, writer)))
+            continue;
+
+        uint64_t stop_start = now_ns();
+        if (!interrupt_thread(binfo, thread_pid))
+            continue;
+
+        // Handling events may have moved the thread within the table.
+        if (!(thread = get_thread(binfo, thread_pid)))
+            continue;
+        ok = write_thread_sample(binfo, writer, thread);
+
+        resume_thread(thread_pid);
+        stop_ns += now_ns() - stop_start;
+    }
+
+    account_stop_time(binfo, stop_ns);
+    settle_threads(binfo);
+    return write_unwind_jobs(binfo, writer, 0) && ok;
+}
+
+// Sets up the thread table of the current process with the threads that are
+// already running, seizing them in persistent mode. If initial is true, the
+// process was there when profiling started.
+bool init_threads(struct basic_info *binfo, bool initial)
+{
+    // Leave room for a typical number of threads up front so that the tables
+    // don't need to grow while sampling.
+    struct process *proc = binfo->process;
+    if (!(proc->threads = bfromcstralloc(INITIAL_THREAD_CAPACITY *
+                                         sizeof(struct thread), "")))
+        return false;
+    if (!(proc->thread_log = bfromcstralloc(INITIAL_THREAD_CAPACITY *
+                                            sizeof(struct thread_lifetime),
+                                            "")))
+        return false;
+    return scan_threads(binfo, initial);
+}
+
+// Whether the current process has any threads that we can sample.
+bool has_selected_threads(struct basic_info *binfo)
+{
+    for (int i = 0; i < get_thread_count(binfo); i++) {
+        if (get_thread_at(binfo, i)->selected)
+            return true;
+    }
+    return false;
+}
+
+void release_threads(struct basic_info *binfo)
+{
+    if (!binfo->process->threads)
+        return;
+
+    pid_t thread_pid = 0;
+    struct thread *thread;
+    if (binfo->persistent) {
+        handle_thread_events(binfo);
+        while ((thread = get_next_thread(binfo, thread_pid))) {
+            thread_pid = thread->pid;
+            if (!thread->selected || !interrupt_thread(binfo, thread_pid))
+                continue;
+            stats.attach_calls++;
+            if (ptrace(PTRACE_DETACH, thread_pid, NULL, NULL))
+                perror("Failed to detach from thread");
+        }
+    }
+
+    for (int i = 0; i < get_thread_count(binfo); i++)
+        close_thread(get_thread_at(binfo, i));
+    bdestroy(binfo->process->threads);
+    binfo->process->threads = NULL;
+}
+
+bool print_thread_log(struct ebml_writer *writer, struct process *proc)
+{
+    bstring thread_log = proc->thread_log;
+    struct thread_lifetime *log = (struct thread_lifetime *)thread_log->data;
+    for (int i = 0; i < thread_log->slen / sizeof(*log); i++) {
+        if (!ebml_start_tag(writer, EBML_THREAD_TAG))
+            return false;
+
+        if (!ebml_start_tag(writer, EBML_THREAD_PID_TAG) ||
+                !ebml_write_uint32(writer, log[i].pid))
+            return false;
+        ebml_end_tag(writer);
+
+        if (!ebml_start_tag(writer, EBML_THREAD_CREATED_TAG) ||
+                !ebml_write_uint64(writer, log[i].created_ns))
+            return false;
+        ebml_end_tag(writer);
+
+        if (!ebml_start_tag(writer, EBML_THREAD_EXITED_TAG) ||
+                !ebml_write_uint64(writer, log[i].exited_ns))
+            return false;
+        ebml_end_tag(writer);
+
+        if (!ebml_start_tag(writer, EBML_PROCESS_PID_TAG) ||
+                !ebml_write_uint32(writer, proc->pid))
+            return false;
+        ebml_end_tag(writer);
+
+        ebml_end_tag(writer);
+    }
+
+    return true;
+}
+
+// Writes the lifetimes of all threads seen while profiling, in all processes.
+bool print_threads(struct ebml_writer *writer, struct basic_info *binfo)
+{
+    if (!ebml_start_tag(writer, EBML_THREADS_TAG))
+        return false;
+
+    for (int i = 0; i < get_process_count(binfo); i++) {
+        struct process *proc = get_process_at(binfo, i);
+        if (proc->thread_log && !print_thread_log(writer, proc))
+            return false;
+    }
+
+    ebml_end_tag(writer);
+    return true;
+}
+
+//
+// perf_event sampling
+//
+// Instead of stopping the target, the kernel samples each thread on a
+// task-clock timer and records its user registers and the top of its user
+// stack into a ring buffer that we drain on every tick. Each perf sample
+// becomes its own SAMPLE element with a single THREAD_SAMPLE in it.
+//
+// The kernel won't let us mmap inherited per-task events, so new threads
+// don't get picked up automatically; instead we look for them every
+// PERF_RESCAN_INTERVAL_TICKS.
+//
+
+bool open_perf_ring(struct basic_info *binfo, pid_t thread_pid)
+{
+    struct perf_event_attr attr;
+    memset(&attr, '\0', sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_TASK_CLOCK;
+    attr.sample_period = 1000000000 / binfo->perf_frequency;
+    attr.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_TIME |
+        PERF_SAMPLE_CALLCHAIN | PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER;
+    attr.sample_regs_user = PERF_UNWIND_REGS;
+    attr.sample_stack_user = binfo->stack_copy_cap & ~0x7;
+    if (attr.sample_stack_user > PERF_MAX_STACK_COPY)
+        attr.sample_stack_user = PERF_MAX_STACK_COPY;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.exclude_callchain_kernel = 1;
+    attr.use_clockid = 1;   // timestamps comparable with ptrace samples
+    attr.clockid = CLOCK_MONOTONIC;
+
+    struct perf_ring ring;
+    memset(&ring, '\0', sizeof(ring));
+    ring.pid = thread_pid;
+    ring.seen = true;
+    ring.fd = -1;
+
+    // Threads that aren't sampled keep an empty entry, so that they're only
+    // classified once.
+    bool selected, fast;
+    classify_thread(binfo, thread_pid, &selected, &fast);
+    if (!selected)
+        return bcatblk(binfo->process->perf_rings, &ring, sizeof(ring)) ==
+            BSTR_OK;
+
+    ring.period_ns = attr.sample_period * (fast ? 1 : binfo->slow_ticks);
+    attr.sample_period = ring.period_ns;
+    ring.fd = syscall(__NR_perf_event_open, &attr, thread_pid, -1, -1, 0);
+    if (ring.fd < 0 && errno == EINVAL) {
+        // Kernels before 4.1 can't pick the clock; perf's own clock is close
+        // enough to CLOCK_MONOTONIC on most systems.
+        attr.use_clockid = 0;
+        ring.fd = syscall(__NR_perf_event_open, &attr, thread_pid, -1, -1, 0);
+    }
+    if (ring.fd < 0) {
+        perror("perf_event_open() failed");
+        return false;
+    }
+
+    ring.data_size = PERF_RING_PAGES * PAGE_SIZE_BYTES;
+    void *ptr = mmap(NULL, PAGE_SIZE_BYTES + ring.data_size,
+                     PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd, 0);
+    if (ptr == MAP_FAILED) {
+        perror("Failed to map the perf ring buffer");
+        close(ring.fd);
+        return false;
+    }
+    ring.header = ptr;
+    ring.data = (uint8_t *)ptr + PAGE_SIZE_BYTES;
+
+    if (bcatblk(binfo->process->perf_rings, &ring, sizeof(ring)) != BSTR_OK) {
+        munmap(ptr, PAGE_SIZE_BYTES + ring.data_size);
+        close(ring.fd);
+        return false;
+    }
+    return true;
+}
+
+int get_perf_ring_count(struct basic_info *binfo)
+{
+    return binfo->process->perf_rings->slen / sizeof(struct perf_ring);
+}
+
+struct perf_ring *get_perf_ring_at(struct basic_info *binfo, int index)
+{
+    return &((struct perf_ring *)binfo->process->perf_rings->data)[index];
+}
+
+void close_perf_ring(struct perf_ring *ring)
+{
+    if (ring->fd < 0)
+        return;
+    munmap(ring->header, PAGE_SIZE_BYTES + ring->data_size);
+    close(ring->fd);
+}
+
+bool drain_perf_ring(struct basic_info *binfo, struct ebml_writer *writer,
+                     struct perf_ring *ring);
+
+// Opens rings for threads that don't have one yet, and drains and closes the
+// rings of threads that have exited.
+bool scan_perf_rings(struct basic_info *binfo, struct ebml_writer *writer)
+{
+    int task_count = list_tasks(binfo);
+    if (task_count < 0) {
+        perror("Failed to read /proc/x/task");
+        return false;
+    }
+
+    stats.rescans++;
+    for (int i = 0; i < get_perf_ring_count(binfo); i++)
+        get_perf_ring_at(binfo, i)->seen = false;
+
+    for (int i = 0; i < task_count; i++) {
+        int j = 0;
+        while (j < get_perf_ring_count(binfo) &&
+                get_perf_ring_at(binfo, j)->pid != binfo->task_ids[i])
+            j++;
+
+        if (j < get_perf_ring_count(binfo))
+            get_perf_ring_at(binfo, j)->seen = true;
+        else if (!open_perf_ring(binfo, binfo->task_ids[i]) && !writer)
+            return false;   // Only fatal at startup.
+    }
+
+    for (int i = 0; i < get_perf_ring_count(binfo); i++) {
+        struct perf_ring *ring = get_perf_ring_at(binfo, i);
+        if (ring->seen)
+            continue;
+
+        bool ok = !writer || drain_perf_ring(binfo, writer, ring);
+        close_perf_ring(ring);
+        bdelete(binfo->process->perf_rings, i * sizeof(struct perf_ring),
+                sizeof(struct perf_ring));
+        i--;
+        if (!ok)
+            return false;
+    }
+
+    return true;
+}
+
+bool open_perf_rings(struct basic_info *binfo)
+{
+    if (!(binfo->process->perf_rings =
+            bfromcstralloc(INITIAL_THREAD_CAPACITY * sizeof(struct perf_ring),
+                           "")))
+        return false;
+
+    return scan_perf_rings(binfo, NULL);
+}
+
+void close_perf_rings(struct basic_info *binfo)
+{
+    if (!binfo->process->perf_rings)
+        return;
+
+    for (int i = 0; i < get_perf_ring_count(binfo); i++)
+        close_perf_ring(get_perf_ring_at(binfo, i));
+
+    bdestroy(binfo->process->perf_rings);
+    binfo->process->perf_rings = NULL;
+}
+
+// Writes a STACK element straight from the kernel's callchain. Used only if
+// the kernel couldn't copy the user stack, since the kernel's walk relies on
+// frame pointers.
+bool write_perf_callchain(struct ebml_writer *writer, const uint64_t *ips,
+                          uint64_t nr)
+{
+    if (!ebml_start_tag(writer, EBML_STACK_TAG))
+        return false;
+
+    for (uint64_t i = 0; i < nr; i++) {
+        if (ips[i] >= PERF_CONTEXT_MAX)
+            continue;
+        uint32_t val = htonl((uint32_t)ips[i]);
+        if (!ebml_write(writer, &val, 4))
+            return false;
+    }
+
+    ebml_end_tag(writer);
+    return true;
+}
+
+bool write_perf_sample(struct basic_info *binfo, struct ebml_writer *writer,
+                       struct perf_ring *ring,
+                       const struct perf_event_header *record)
+{
+    // The record layout follows from the sample_type in open_perf_ring().
+    const uint8_t *p = (const uint8_t *)(record + 1);
+    pid_t thread_pid = ((const uint32_t *)p)[1];
+    p += 8;
+
+    struct sample_timing timing;
+    memset(&timing, '\0', sizeof(timing));
+    timing.time_ns = *(const uint64_t *)p;
+    timing.missed_ticks = binfo->process->perf_lost_pending;
+    binfo->process->perf_lost_pending = 0;
+    p += 8;
+
+    uint64_t nr = *(const uint64_t *)p;
+    const uint64_t *ips = (const uint64_t *)(p + 8);
+    p += 8 + nr * 8;
+
+    const uint64_t *regs = NULL;
+    if (*(const uint64_t *)p != PERF_SAMPLE_REGS_ABI_NONE)
+        regs = (const uint64_t *)(p + 8);
+    p += 8 + (regs ? 3 * 8 : 0);
+
+    struct stack_snapshot stack;
+    memset(&stack, '\0', sizeof(stack));
+    uint64_t stack_size = *(const uint64_t *)p;
+    if (stack_size && regs) {
+        stack.words = (uint32_t *)(p + 8);
+        stack.size = *(const uint64_t *)(p + 8 + stack_size) & ~0x3;
+        stack.sp = (uint32_t)regs[0];
+    }
+
+    stats.perf_samples++;
+
+    if (!ebml_start_tag(writer, EBML_SAMPLE_TAG))
+        return false;
+    if (!ebml_write_sample_timing(writer, &timing))
+        return false;
+    if (!ebml_write_sample_weight(writer, ring->period_ns *
+                                  (1 + timing.missed_ticks)))
+        return false;
+    if (!start_thread_sample(binfo, writer, thread_pid, 'R'))
+        return false;
+
+    bool ok;
+    if (stack.size) {
+        // We only ask perf for the SP, LR and PC.
+        struct unwind_regs uregs;
+        uregs.r[UNWIND_REG_SP] = (uint32_t)regs[0];
+        uregs.r[UNWIND_REG_LR] = (uint32_t)regs[1];
+        uregs.r[UNWIND_REG_PC] = (uint32_t)regs[2];
+        uregs.valid = (1 << UNWIND_REG_SP) | (1 << UNWIND_REG_LR) |
+            (1 << UNWIND_REG_PC);
+        ok = unwind_stack(binfo, writer, &uregs, &stack);
+    } else {
+        ok = write_perf_callchain(writer, ips, nr);
+    }
+
+    ebml_end_tag(writer);
+    ebml_end_tag(writer);
+    return ok;
+}
+
+bool drain_perf_ring(struct basic_info *binfo, struct ebml_writer *writer,
+                     struct perf_ring *ring)
+{
+    if (ring->fd < 0)
+        return true;
+
+    uint64_t head = ring->header->data_head;
+    __sync_synchronize();
+
+    bool ok = true;
+    uint64_t tail = ring->header->data_tail;
+    while (ok && tail < head) {
+        uint32_t offset = tail & (ring->data_size - 1);
+        const struct perf_event_header *record =
+            (const struct perf_event_header *)(ring->data + offset);
+
+        // Records are 8-byte aligned, so only the body can wrap around.
+        if (offset + record->size > ring->data_size) {
+            uint32_t first = ring->data_size - offset;
+            memcpy(binfo->perf_record_buf, record, first);
+            memcpy(binfo->perf_record_buf + first, ring->data,
+                   record->size - first);
+            record = (const struct perf_event_header *)binfo->perf_record_buf;
+        }
+
+        switch (record->type) {
+        case PERF_RECORD_SAMPLE:
+            ok = write_perf_sample(binfo, writer, ring, record);
+            break;
+        case PERF_RECORD_LOST: {
+            uint64_t lost = ((const uint64_t *)(record + 1))[1];
+            stats.perf_lost += lost;
+            binfo->process->perf_lost_pending += lost;
+            break;
+        }
+        }
+
+        tail += record->size;
+    }
+
+    __sync_synchronize();
+    ring->header->data_tail = tail;
+    return ok;
+}
+
+bool drain_perf_rings(struct basic_info *binfo, struct ebml_writer *writer)
+{
+    if (stats.ticks % PERF_RESCAN_INTERVAL_TICKS == 0 &&
+            !scan_perf_rings(binfo, writer))
+        return false;
+
+    for (int i = 0; i < get_perf_ring_count(binfo); i++) {
+        if (!drain_perf_ring(binfo, writer, get_perf_ring_at(binfo, i)))
+            return false;
+    }
+    return true;
+}
+
+//
+// In-process agent
+//
+// With -b agent, the target samples itself: agent.c, loaded with LD_PRELOAD,
+// records the registers and the top of the stack of its threads on a
+// CPU-time timer into per-thread rings in a file that we map (see agent.h).
+// All that's left for us is to drain the rings on every tick and unwind
+// each record, as with perf. The agent may only turn up once the target's
+// libraries are loaded, so we keep looking for its ring every
+// AGENT_RETRY_INTERVAL_TICKS.
+//
+
+bool open_agent_ring(struct process *proc)
+{
+    const char *dir = getenv(AGENT_DIR_ENV);
+    char path[256];
+    snprintf(path, sizeof(path), AGENT_RING_PATH_FORMAT,
+             dir ? dir : AGENT_DEFAULT_DIR, (int)proc->pid);
+
+    // The ring has to be the target's own, and private to it: anyone else
+    // who could write to it could feed us whatever they liked.
+    char proc_path[32];
+    struct stat proc_st;
+    snprintf(proc_path, sizeof(proc_path), "/proc/%d", (int)proc->pid);
+    if (stat(proc_path, &proc_st))
+        return false;
+
+    int fd = open(path, O_RDWR | O_NOFOLLOW);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    void *mem = MAP_FAILED;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) &&
+            st.st_uid == proc_st.st_uid && !(st.st_mode & 077) &&
+            st.st_size >= sizeof(struct agent_ring))
+        mem = mmap(NULL, sizeof(struct agent_ring), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        return false;
+
+    struct agent_ring *ring = mem;
+    if (ring->magic != AGENT_MAGIC || ring->version != AGENT_VERSION ||
+            ring->pid != proc->pid) {
+        munmap(mem, sizeof(struct agent_ring));
+        return false;
+    }
+
+    proc->agent = ring;
+    return true;
+}
+
+void close_agent_ring(struct process *proc)
+{
+    if (!proc->agent)
+        return;
+    munmap(proc->agent, sizeof(struct agent_ring));
+    proc->agent = NULL;
+}
+
+// Writes a SAMPLE for a record from the agent's ring. The target can write
+// to the ring, so nothing in the record is taken on trust: a record that
+// claims more stack than it has room for is thrown away.
+bool write_agent_sample(struct basic_info *binfo, struct ebml_writer *writer,
+                        const struct agent_record *record,
+                        uint32_t missed_samples)
+{
+    uint32_t stack_words = record->stack_words;
+    if (stack_words > AGENT_STACK_WORDS) {
+        stats.agent_lost++;
+        return true;
+    }
+
+    struct sample_timing timing;
+    memset(&timing, '\0', sizeof(timing));
+    timing.time_ns = record->time_ns;
+    timing.missed_ticks = missed_samples;
+
+    struct stack_snapshot stack;
+    stack.sp = record->sp;
+    stack.size = stack_words * 4;
+    stack.words = (uint32_t *)record->stack;
+
+    stats.agent_samples++;
+
+    if (!ebml_start_tag(writer, EBML_SAMPLE_TAG))
+        return false;
+    if (!ebml_write_sample_timing(writer, &timing))
+        return false;
+    if (!ebml_write_sample_weight(writer, binfo->process->agent->period_ns *
+                                  (uint64_t)(1 + missed_samples)))
+        return false;
+    if (!start_thread_sample(binfo, writer, record->tid, 'R'))
+        return false;
+
+    struct unwind_regs regs;
+    regs.r[UNWIND_REG_SP] = record->sp;
+    regs.r[UNWIND_REG_LR] = record->lr;
+    regs.r[UNWIND_REG_PC] = record->pc;
+    regs.valid = (1 << UNWIND_REG_SP) | (1 << UNWIND_REG_LR) |
+        (1 << UNWIND_REG_PC);
+    bool ok = unwind_stack(binfo, writer, &regs, &stack);
+
+    ebml_end_tag(writer);
+    ebml_end_tag(writer);
+    return ok;
+}
+
+// Writes out the samples that the agent of the current process has taken
+// since the last tick. Samples that the agent dropped are accounted to the
+// next one from the same thread, as with perf.
+bool drain_agent_ring(struct basic_info *binfo, struct ebml_writer *writer)
+{
+    struct process *proc = binfo->process;
+    if (!proc->agent && (stats.ticks % AGENT_RETRY_INTERVAL_TICKS ||
+                         !open_agent_ring(proc)))
+        return true;
+
+    // Threads beyond the agent's AGENT_MAX_THREADS slots go unsampled.
+    uint32_t unsampled = proc->agent->unsampled_threads;
+    stats.agent_unsampled += unsampled - proc->agent_unsampled;
+    proc->agent_unsampled = unsampled;
+
+    for (int i = 0; i < AGENT_MAX_THREADS; i++) {
+        struct agent_slot *slot = &proc->agent->slots[i];
+        uint32_t state = slot->state;
+        if (state == AGENT_SLOT_FREE)
+            continue;
+
+        uint32_t head = slot->head;
+        __sync_synchronize();
+
+        uint32_t lost = slot->lost - slot->lost_seen;
+        slot->lost_seen += lost;
+        stats.agent_lost += lost;
+
+        // The agent never gets more than a ring ahead of us, so a head that
+        // is further on than that is garbage. Skip what's in the ring.
+        uint32_t tail = slot->tail;
+        if (head - tail > AGENT_RING_RECORDS) {
+            stats.agent_lost += AGENT_RING_RECORDS;
+            slot->tail = head;
+            continue;
+        }
+
+        while (tail != head) {
+            const struct agent_record *record =
+                &slot->records[tail % AGENT_RING_RECORDS];
+            if (!write_agent_sample(binfo, writer, record, lost))
+                return false;
+            lost = 0;
+
+            // Hand the record back only once we're done with it.
+            __sync_synchronize();
+            slot->tail = ++tail;
+        }
+
+        if (state == AGENT_SLOT_DRAINING)
+            slot->state = AGENT_SLOT_FREE;
+    }
+    return true;
+}
+
+//
+// BPF sampling
+//
+// With -b bpf, nothing at all happens in piranha per sample. A BPF program
+// runs on a cpu-clock event on every CPU and, whenever it lands in a thread
+// of one of the targets, has the kernel put the user stack (and with -K the
+// kernel stack) in a stack map and counts the sample under the thread and
+// the stacks. Every BPF_DRAIN_INTERVAL_TICKS, we read and clear the counts
+// and write a SAMPLE for each, weighted by the count. The kernel walks user
+// stacks by frame pointers, so this has the same limits as perf's
+// callchains.
+//
+// The program is assembled by hand so that neither a compiler for BPF nor
+// libbpf is needed.
+//
+
+int bpf_call(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+int create_bpf_map(uint32_t type, uint32_t key_size, uint32_t value_size,
+                   uint32_t max_entries)
+{
+    union bpf_attr attr;
+    memset(&attr, '\0', sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = key_size;
+    attr.value_size = value_size;
+    attr.max_entries = max_entries;
+
+    int fd = bpf_call(BPF_MAP_CREATE, &attr);
+    if (fd < 0)
+        perror("Failed to create a BPF map");
+    return fd;
+}
+
+bool bpf_map_op(int cmd, int map_fd, const void *key, void *value)
+{
+    union bpf_attr attr;
+    memset(&attr, '\0', sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uintptr_t)key;
+    if (cmd == BPF_MAP_GET_NEXT_KEY)
+        attr.next_key = (uintptr_t)value;
+    else
+        attr.value = (uintptr_t)value;
+    return !bpf_call(cmd, &attr);
+}
+
+// A map's file descriptor, as a 64-bit immediate, which takes two
+// instructions. The kernel swaps in the map itself.
+int emit_load_map(struct bpf_insn *prog, int n, int reg, int map_fd)
+{
+    prog[n++] = BPF_RAW_INSN(BPF_LD | BPF_IMM | BPF_DW, reg,
+                             BPF_PSEUDO_MAP_FD, 0, map_fd);
+    prog[n++] = BPF_RAW_INSN(0, 0, 0, 0, 0);
+    return n;
+}
+
+// Stores the ID of the current user or kernel stack at the given offset
+// from the frame pointer. r6 holds the program's context.
+int emit_get_stack(struct bpf_insn *prog, int n, struct bpf_sampler *bpf,
+                   uint32_t flags, int16_t offset)
+{
+    prog[n++] = BPF_MOV_REG(BPF_REG_1, BPF_REG_6);
+    n = emit_load_map(prog, n, BPF_REG_2, bpf->stacks_fd);
+    prog[n++] = BPF_MOV_IMM(BPF_REG_3, flags | BPF_F_REUSE_STACKID);
+    prog[n++] = BPF_CALL_FUNC(BPF_FUNC_get_stackid);
+    prog[n++] = BPF_STORE_REG(BPF_W, BPF_REG_10, offset, BPF_REG_0);
+    return n;
+}
+
+int load_bpf_program(struct bpf_sampler *bpf)
+{
+    struct bpf_insn prog[BPF_MAX_INSNS];
+    int n = 0;
+
+    // r6 = context, r7 = TGID << 32 | TID.
+    prog[n++] = BPF_MOV_REG(BPF_REG_6, BPF_REG_1);
+    prog[n++] = BPF_CALL_FUNC(BPF_FUNC_get_current_pid_tgid);
+    prog[n++] = BPF_MOV_REG(BPF_REG_7, BPF_REG_0);
+
+    // Leave everything but the targets alone.
+    prog[n++] = BPF_RSH_IMM(BPF_REG_0, 32);
+    prog[n++] = BPF_STORE_REG(BPF_W, BPF_REG_10, -4, BPF_REG_0);
+    n = emit_load_map(prog, n, BPF_REG_1, bpf->pids_fd);
+    prog[n++] = BPF_MOV_REG(BPF_REG_2, BPF_REG_10);
+    prog[n++] = BPF_ADD_IMM(BPF_REG_2, -4);
+    prog[n++] = BPF_CALL_FUNC(BPF_FUNC_map_lookup_elem);
+    int not_target = n;
+    prog[n++] = BPF_JUMP_IMM(BPF_JEQ, BPF_REG_0, 0);
+
+    // The struct bpf_count_key goes at fp - 16.
+    prog[n++] = BPF_MOV_REG(BPF_REG_1, BPF_REG_7);
+    prog[n++] = BPF_RSH_IMM(BPF_REG_1, 32);
+    prog[n++] = BPF_STORE_REG(BPF_W, BPF_REG_10, -16, BPF_REG_1);
+    prog[n++] = BPF_STORE_REG(BPF_W, BPF_REG_10, -12, BPF_REG_7);
+    n = emit_get_stack(prog, n, bpf, BPF_F_USER_STACK, -8);
+    if (bpf->kernel_stacks)
+        n = emit_get_stack(prog, n, bpf, 0, -4);
+    else
+        prog[n++] = BPF_STORE_IMM(BPF_W, BPF_REG_10, -4, -1);
+
+    // Bump the count, or add it if this is the first sample with this key.
+    // Racing another CPU to add it loses one sample.
+    n = emit_load_map(prog, n, BPF_REG_1, bpf->counts_fd);
+    prog[n++] = BPF_MOV_REG(BPF_REG_2, BPF_REG_10);
+    prog[n++] = BPF_ADD_IMM(BPF_REG_2, -16);
+    prog[n++] = BPF_CALL_FUNC(BPF_FUNC_map_lookup_elem);
+    int found = n;
+    prog[n++] = BPF_JUMP_IMM(BPF_JNE, BPF_REG_0, 0);
+    prog[n++] = BPF_STORE_IMM(BPF_DW, BPF_REG_10, -24, 1);
+    n = emit_load_map(prog, n, BPF_REG_1, bpf->counts_fd);
+    prog[n++] = BPF_MOV_REG(BPF_REG_2, BPF_REG_10);
+    prog[n++] = BPF_ADD_IMM(BPF_REG_2, -16);
+    prog[n++] = BPF_MOV_REG(BPF_REG_3, BPF_REG_10);
+    prog[n++] = BPF_ADD_IMM(BPF_REG_3, -24);
+    prog[n++] = BPF_MOV_IMM(BPF_REG_4, BPF_NOEXIST);
+    prog[n++] = BPF_CALL_FUNC(BPF_FUNC_map_update_elem);
+    int added = n;
+    prog[n++] = BPF_RAW_INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0);
+    prog[found].off = n - found - 1;
+    prog[n++] = BPF_MOV_IMM(BPF_REG_1, 1);
+    prog[n++] = BPF_RAW_INSN(BPF_STX | BPF_XADD | BPF_DW, BPF_REG_0,
+                             BPF_REG_1, 0, 0);
+
+    prog[not_target].off = n - not_target - 1;
+    prog[added].off = n - added - 1;
+    prog[n++] = BPF_MOV_IMM(BPF_REG_0, 0);
+    prog[n++] = BPF_RETURN();
+    assert(n <= BPF_MAX_INSNS);
+
+    union bpf_attr attr;
+    memset(&attr, '\0', sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_PERF_EVENT;
+    attr.insns = (uintptr_t)prog;
+    attr.insn_cnt = n;
+    attr.license = (uintptr_t)"GPL";    // bpf_get_stackid() insists
+    int fd = bpf_call(BPF_PROG_LOAD, &attr);
+    if (fd >= 0)
+        return fd;
+
+    // Try again with the verifier's log, to find out what it didn't like.
+    perror("Failed to load the BPF program");
+    char *log = counted_malloc(BPF_LOG_SIZE);
+    if (log) {
+        log[0] = '\0';
+        attr.log_buf = (uintptr_t)log;
+        attr.log_size = BPF_LOG_SIZE;
+        attr.log_level = 1;
+        bpf_call(BPF_PROG_LOAD, &attr);
+        fprintf(stderr, "%s", log);
+        free(log);
+    }
+    return -1;
+}
+
+int get_bpf_event_count(struct bpf_sampler *bpf)
+{
+    return bpf->event_fds->slen / sizeof(int);
+}
+
+// Sets up the maps and the program and attaches the program to a cpu-clock
+// event on every CPU that's online.
+bool open_bpf_sampler(struct basic_info *binfo)
+{
+    struct bpf_sampler *bpf = &binfo->bpf;
+    bpf->prog_fd = bpf->pids_fd = bpf->stacks_fd = bpf->counts_fd = -1;
+    bpf->period_ns = 1000000000 / binfo->perf_frequency;
+
+    int cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (!(bpf->event_fds = bfromcstralloc(cpus * sizeof(int), "")))
+        return false;
+
+    if ((bpf->pids_fd = create_bpf_map(BPF_MAP_TYPE_HASH, sizeof(uint32_t),
+                                       sizeof(uint32_t), MAX_PROCESSES)) < 0 ||
+            (bpf->stacks_fd = create_bpf_map(BPF_MAP_TYPE_STACK_TRACE,
+                                             sizeof(uint32_t),
+                                             BPF_STACK_DEPTH * 8,
+                                             BPF_MAX_STACKS)) < 0 ||
+            (bpf->counts_fd = create_bpf_map(BPF_MAP_TYPE_HASH,
+                                             sizeof(struct bpf_count_key),
+                                             sizeof(uint64_t),
+                                             BPF_MAX_COUNTS)) < 0 ||
+            (bpf->prog_fd = load_bpf_program(bpf)) < 0)
+        return false;
+
+    struct perf_event_attr attr;
+    memset(&attr, '\0', sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_CPU_CLOCK;
+    attr.sample_period = bpf->period_ns;
+    attr.disabled = 1;
+
+    for (int cpu = 0; cpu < cpus; cpu++) {
+        int fd = syscall(__NR_perf_event_open, &attr, -1, cpu, -1, 0);
+        if (fd < 0 && errno == ENODEV)
+            continue;   // offline
+        if (fd < 0) {
+            perror("perf_event_open() failed");
+            return false;
+        }
+        if (bcatblk(bpf->event_fds, &fd, sizeof(fd)) != BSTR_OK) {
+            close(fd);
+            return false;
+        }
+        if (ioctl(fd, PERF_EVENT_IOC_SET_BPF, bpf->prog_fd) ||
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0)) {
+            perror("Failed to attach the BPF program");
+            return false;
+        }
+    }
+    return true;
+}
+
+void close_bpf_sampler(struct basic_info *binfo)
+{
+    struct bpf_sampler *bpf = &binfo->bpf;
+    for (int i = 0; bpf->event_fds && i < get_bpf_event_count(bpf); i++)
+        close(((int *)bpf->event_fds->data)[i]);
+    bdestroy(bpf->event_fds);
+    bpf->event_fds = NULL;
+
+    int fds[] = { bpf->prog_fd, bpf->counts_fd, bpf->stacks_fd, bpf->pids_fd };
+    for (int i = 0; i < length_of(fds); i++) {
+        if (fds[i] >= 0)
+            close(fds[i]);
+    }
+    bpf->prog_fd = bpf->pids_fd = bpf->stacks_fd = bpf->counts_fd = -1;
+}
+
+// Adds a process to, or removes it from, those the program samples.
+bool watch_bpf_process(struct bpf_sampler *bpf, pid_t pid, bool watch)
+{
+    uint32_t key = pid, value = 1;
+    if (!watch)
+        return bpf_map_op(BPF_MAP_DELETE_ELEM, bpf->pids_fd, &key, NULL);
+    if (bpf_map_op(BPF_MAP_UPDATE_ELEM, bpf->pids_fd, &key, &value))
+        return true;
+    perror("Failed to add the process to the BPF sampler");
+    return false;
+}
+
+// Appends the addresses of a stack in the stack map to ips and returns how
+// many there were. A stack can be gone by now if another one with the same
+// hash replaced it.
+uint32_t read_bpf_stack(struct bpf_sampler *bpf, int32_t stack_id,
+                        uint64_t *ips)
+{
+    if (stack_id < 0)
+        return 0;
+    if (!bpf_map_op(BPF_MAP_LOOKUP_ELEM, bpf->stacks_fd, &stack_id, ips)) {
+        stats.bpf_lost_stacks++;
+        return 0;
+    }
+
+    uint32_t nr = 0;
+    while (nr < BPF_STACK_DEPTH && ips[nr])
+        nr++;
+    return nr;
+}
+
+bool write_bpf_sample(struct basic_info *binfo, struct ebml_writer *writer,
+                      const struct bpf_count_key *key, uint64_t count)
+{
+    // Counts may outlive their process by a drain, but not its entry.
+    if (!(binfo->process = get_process(binfo, key->pid)))
+        return true;
+
+    // The kernel stack goes first, since it's the innermost.
+    uint64_t ips[2 * BPF_STACK_DEPTH];
+    uint32_t nr = read_bpf_stack(&binfo->bpf, key->kernel_stack, ips);
+    uint32_t user_nr = read_bpf_stack(&binfo->bpf, key->user_stack, ips + nr);
+    if (user_nr && !get_region_for_addr(binfo->process->regions, ips[nr]))
+        binfo->process->maps_stale = true;
+    nr += user_nr;
+
+    stats.bpf_keys++;
+    stats.bpf_samples += count;
+
+    if (!ebml_start_tag(writer, EBML_SAMPLE_TAG))
+        return false;
+    if (!ebml_write_sample_timing(writer, &binfo->timing))
+        return false;
+    if (!ebml_write_sample_weight(writer, binfo->bpf.period_ns * count))
+        return false;
+    if (!start_thread_sample(binfo, writer, key->tid, 'R'))
+        return false;
+    if (!write_perf_callchain(writer, ips, nr))
+        return false;
+
+    ebml_end_tag(writer);
+    ebml_end_tag(writer);
+    return true;
+}
+
+// Writes out the counts gathered since the last drain and clears them. Each
+// key is deleted right after it's read, so we can always start from the
+// first one left; samples that the program counts in between are lost.
+bool drain_bpf_counts(struct basic_info *binfo, struct ebml_writer *writer)
+{
+    struct bpf_sampler *bpf = &binfo->bpf;
+    struct bpf_count_key none, key;
+    memset(&none, '\0', sizeof(none));  // never in the map, as PID 0 isn't
+
+    for (int i = 0; i < BPF_MAX_COUNTS; i++) {
+        uint64_t count;
+        if (!bpf_map_op(BPF_MAP_GET_NEXT_KEY, bpf->counts_fd, &none, &key))
+            break;
+        if (!bpf_map_op(BPF_MAP_LOOKUP_ELEM, bpf->counts_fd, &key, &count))
+            count = 0;
+        bpf_map_op(BPF_MAP_DELETE_ELEM, bpf->counts_fd, &key, NULL);
+
+        if (count && !write_bpf_sample(binfo, writer, &key, count))
+            return false;
+    }
+    return true;
+}
+
+bool compute_thread_entry(struct basic_info *info)
+{
+    bool ok = true;
+
+    void *lib = dlopen("libc.so", RTLD_LAZY);
+    if (!lib) {
+        fprintf(stderr, "failed to dlopen libc.so: %s\n", dlerror());
+        return false;
+    }
+
+    void *thread_entry = dlsym(lib, "__thread_entry");
+    if (!thread_entry) {
+        ok = false;
+        fprintf(stderr, "failed to dlsym __thread_entry: %s\n", dlerror());
+        goto out;
+    }
+
+    Dl_info dl_info;
+    if (!dladdr(thread_entry, &dl_info)) {
+        ok = false;
+        fprintf(stderr, "failed to dladdr __thread_entry: %s\n", dlerror());
+        goto out;
+    }
+
+    info->thread_entry_offset = (uint32_t)dl_info.dli_saddr -
+        (uint32_t)dl_info.dli_fbase;
+
+out:
+    dlclose(lib);
+    return ok;
+}
+
+//
+// Target processes
+//
+// Each target process has its own memory map, /proc files and thread table
+// or perf rings, and binfo->process says which one the code above is working
+// on. One timer drives them all, and each tick writes a single SAMPLE with
+// the threads of every process in it. With -T, the children of the targets
+// are looked for every PROCESS_RESCAN_INTERVAL_TICKS. A process that exits is
+// no longer sampled, but its memory map and thread log stay for the output.
+//
+
+bool open_memory(struct process *proc)
+{
+    bstring mem_path = bformat("/proc/%d/mem", (int)proc->pid);
+    if (!mem_path)
+        return false;
+
+    bool ok = (proc->mem = open((char *)mem_path->data, O_RDONLY)) >= 0;
+
+    bdestroy(mem_path);
+    return ok;
+}
+
+bool open_tasks(struct process *proc)
+{
+    bstring tasks_path = bformat("/proc/%d/task", (int)proc->pid);
+    if (!tasks_path)
+        return false;
+
+    proc->task_dir = open((char *)tasks_path->data, O_RDONLY | O_DIRECTORY);
+    bdestroy(tasks_path);
+    if (proc->task_dir < 0) {
+        perror("Failed to open /proc/x/task");
+        return false;
+    }
+    return true;
+}
+
+// Stops profiling the current process, first draining whatever the kernel
+// sampled for it if there's a writer. If the process exited, its remaining
+// threads are logged as having exited now.
+bool end_process(struct basic_info *binfo, struct ebml_writer *writer,
+                 bool exited)
+{
+    struct process *proc = binfo->process;
+    if (!proc->live)
+        return true;
+    proc->live = false;
+
     bool ok = true;
-    while (ok && (ent = readdir(tasks_dir))) {
-        int thread_pid;
-        if (!sscanf(ent->d_name, "%d", &thread_pid))
+    if (proc->perf_rings) {
+        for (int i = 0; ok && writer && i < get_perf_ring_count(binfo); i++)
+            ok = drain_perf_ring(binfo, writer, get_perf_ring_at(binfo, i));
+        close_perf_rings(binfo);
+    }
+    if (proc->agent) {
+        if (writer)
+            ok = drain_agent_ring(binfo, writer);
+        close_agent_ring(proc);
+    }
+    if (binfo->backend == BACKEND_BPF && binfo->bpf.pids_fd >= 0)
+        watch_bpf_process(&binfo->bpf, proc->pid, false);
+
+    if (proc->threads) {
+        pid_t thread_pid = 0;
+        struct thread *thread;
+        while (exited && (thread = get_next_thread(binfo, thread_pid))) {
+            thread_pid = thread->pid;
+            forget_thread(binfo, thread_pid);
+        }
+        release_threads(binfo);
+    }
+
+    if (proc->mem >= 0)
+        close(proc->mem);
+    if (proc->task_dir >= 0)
+        close(proc->task_dir);
+    proc->mem = proc->task_dir = -1;
+    return ok;
+}
+
+// Starts profiling a process and makes it the current one. If initial is
+// true, the process was there when profiling started.
+bool add_process(struct basic_info *binfo, pid_t pid, bool initial)
+{
+    struct process proc;
+    memset(&proc, '\0', sizeof(proc));
+    proc.pid = pid;
+    proc.live = true;
+    proc.pid_fd = proc.mem = proc.task_dir = -1;
+    if (bcatblk(binfo->processes, &proc, sizeof(proc)) != BSTR_OK)
+        return false;
+    binfo->process = get_process_at(binfo, get_process_count(binfo) - 1);
+
+    bool ok = open_memory(binfo->process) && open_tasks(binfo->process) &&
+        read_maps(pid, &binfo->process->maps, &binfo->process->regions);
+    if (ok)
+        prepare_maps_for_unwinding(binfo, binfo->process, NULL);
+    if (ok && binfo->backend == BACKEND_PERF)
+        ok = open_perf_rings(binfo);
+    else if (ok && binfo->backend == BACKEND_AGENT)
+        open_agent_ring(binfo->process);    // it may not be there yet
+    else if (ok && binfo->backend == BACKEND_BPF)
+        ok = watch_bpf_process(&binfo->bpf, pid, true);
+    else if (ok)
+        ok = init_threads(binfo, initial);
+
+    if (!ok)
+        end_process(binfo, NULL, false);
+    return ok;
+}
+
+// Re-reads the memory map of the current process, which changes as
+// libraries are loaded, most of all during startup. The new map is written
+// at the end and replaces the old one for the readers, except with -U (see
+// write_new_maps()).
+bool reread_maps(struct basic_info *binfo)
+{
+    struct process *proc = binfo->process;
+    proc->maps_stale = false;
+    proc->maps_read_tick = stats.ticks;
+
+    bstring maps, regions;
+    stats.maps_reads++;
+    if (!read_maps(proc->pid, &maps, &regions))
+        return false;
+
+    bstring old_maps = proc->maps;
+    proc->maps = maps;
+    prepare_maps_for_unwinding(binfo, proc, old_maps);
+    free_maps(old_maps);
+    bdestroy(proc->regions);
+    proc->regions = regions;
+    proc->maps_written = false;
+    return true;
+}
+
+// Whether the process's maps are stale and it's been long enough since they
+// were last read. Each read costs a syscall per line of the maps.
+bool maps_due(struct process *proc)
+{
+    return proc->maps_stale &&
+        stats.ticks - proc->maps_read_tick >= MAPS_REREAD_INTERVAL_TICKS;
+}
+
+// With -U, the stacks are unwound later against the maps in the profile, so
+// a process's map is written as soon as it's read, between SAMPLES elements.
+// piranha-unwind then unwinds each sample against the map that was current
+// when it was taken. Stale maps are re-read here, before the tick's samples,
+// rather than in sample_process(). If that fails, the process is most
+// likely gone, which sampling it finds out.
+bool write_new_maps(struct basic_info *binfo, struct ebml_writer *writer)
+{
+    for (int i = 0; i < get_process_count(binfo); i++) {
+        struct process *proc = get_process_at(binfo, i);
+        if (!proc->live)
+            continue;
+        binfo->process = proc;
+        if (maps_due(proc))
+            reread_maps(binfo);
+        if (!proc->maps || proc->maps_written)
             continue;
 
-        // We do this before we trace. If we don't, the status unhelpfully
-        // returns "T" for "traced".
-        bstring state;
-        if (!get_thread_state(thread_pid, &state)) {
-            ok = false;
-            break;
-        }
+        ebml_end_tag(writer);
+        if (!print_maps(writer, proc) ||
+                !ebml_start_tag(writer, EBML_SAMPLES_TAG))
+            return false;
+    }
+    return true;
+}
+
+// Runs a command under ptrace and leaves it stopped right after the exec,
+// before even the dynamic linker has run, so that profiling can start at
+// its first instruction. If preload is set, the command gets that library
+// in LD_PRELOAD. Returns the PID, or -1 on failure.
+pid_t launch(struct basic_info *binfo, char **args, const char *preload)
+{
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork() failed");
+        return -1;
+    }
+    if (!pid) {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        if (preload)
+            setenv("LD_PRELOAD", preload, 1);
+        execvp(args[0], args);
+        perror("Failed to run the command");
+        _exit(127);
+    }
+
+    // The exec stops the child with a SIGTRAP. Trade that for an ordinary
+    // stop so that we can let go of it and then attach the usual way.
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status)) {
+        fprintf(stderr, "Failed to run the command\n");
+        return -1;
+    }
+    if (ptrace(PTRACE_DETACH, pid, NULL, (void *)SIGSTOP) ||
+            !wait_for_process_to_stop(binfo, pid)) {
+        perror("Failed to stop the command");
+        kill(pid, SIGKILL);
+        return -1;
+    }
+    binfo->launched_pid = pid;
+    return pid;
+}
+
+// Whether a process has exited. Zombies count as exited.
+bool process_exited(pid_t pid)
+{
+    char state = 'X';
+    int stat_fd = open_thread_file(pid, "stat");
+    if (stat_fd >= 0) {
+        get_thread_state(stat_fd, &state);
+        close(stat_fd);
+    }
+    return state == 'Z' || state == 'X';
+}
+
+// Reads the parent of a process from /proc/PID/stat, or returns -1.
+pid_t get_parent_pid(pid_t pid)
+{
+    char buf[STAT_BUF_SIZE];
+    int stat_fd = open_thread_file(pid, "stat");
+    if (stat_fd < 0)
+        return -1;
+    int len = pread(stat_fd, buf, sizeof(buf) - 1, 0);
+    close(stat_fd);
+    if (len <= 0)
+        return -1;
+
+    buf[len] = '\0';
+    char *paren = strrchr(buf, ')');
+    int ppid;
+    if (!paren || sscanf(paren + 1, " %*c %d", &ppid) != 1)
+        return -1;
+    return ppid;
+}
+
+// Stops profiling processes that have exited and, with -T, starts profiling
+// the descendants of the live ones that we don't know about yet.
+bool scan_processes(struct basic_info *binfo, struct ebml_writer *writer,
+                    bool initial)
+{
+    for (int i = 0; i < get_process_count(binfo); i++) {
+        binfo->process = get_process_at(binfo, i);
+        if (binfo->process->live && process_exited(binfo->process->pid) &&
+                !end_process(binfo, writer, true))
+            return false;
+    }
+
+    if (!binfo->follow_children)
+        return true;
+
+    int count = list_pid_dir(binfo->proc_dir, binfo->proc_ids,
+                             MAX_PROCESSES);
+    if (count < 0) {
+        perror("Failed to read /proc");
+        return false;
+    }
+
+    pid_t *parent_ids = binfo->proc_ids + MAX_PROCESSES;
+    for (int i = 0; i < count; i++)
+        parent_ids[i] = get_parent_pid(binfo->proc_ids[i]);
+
+    // Each pass picks up one more generation of descendants.
+    bool found = true;
+    while (found) {
+        found = false;
+        for (int i = 0; i < count; i++) {
+            struct process *parent = get_process(binfo, parent_ids[i]);
+            if (!parent || !parent->live ||
+                    get_process(binfo, binfo->proc_ids[i]))
+                continue;
+
+            // A child that's already gone again isn't an error.
+            found = true;
+            if (add_process(binfo, binfo->proc_ids[i], initial))
+                stats.processes_followed++;
+        }
+    }
+    return true;
+}
+
+// Samples the current process with whichever backend is in use. A process
+// that has gone away is dropped instead of failing the whole profile.
+bool sample_process(struct basic_info *binfo, struct ebml_writer *writer)
+{
+    bool ok = true;
+    if (maps_due(binfo->process))
+        ok = reread_maps(binfo);
+
+    if (ok && binfo->backend == BACKEND_PERF)
+        ok = drain_perf_rings(binfo, writer);
+    else if (ok && binfo->backend == BACKEND_AGENT)
+        ok = drain_agent_ring(binfo, writer);
+    else if (ok && binfo->backend == BACKEND_PTRACE && binfo->persistent)
+        ok = sample_persistent(binfo, writer);
+    else if (ok && binfo->backend == BACKEND_PTRACE)
+        ok = sample(binfo, writer);
+
+    if (!ok && process_exited(binfo->process->pid)) {
+        fprintf(stderr, "Process %d exited\n", (int)binfo->process->pid);
+        ok = end_process(binfo, writer, true);
+    }
+    return ok;
+}
+
+bool sample_processes(struct basic_info *binfo, struct ebml_writer *writer)
+{
+    for (int i = 0; i < get_process_count(binfo); i++) {
+        binfo->process = get_process_at(binfo, i);
+        if (binfo->process->live && !sample_process(binfo, writer))
+            return false;
+    }
+    return true;
+}
+
+//
+// Flight recorder
+//
+// With -R, nothing is written while sampling. The SAMPLE elements of each
+// tick are built in memory and added to a fixed-size ring that keeps the
+// last so many seconds or megabytes of them, dropping the oldest ticks to
+// make room. A complete profile of what's in the ring is written out only
+// on request: on SIGUSR1, on a "dump" command to the control socket (-C),
+// and when the targets exit. That leaves piranha cheap to keep running for
+// hours, waiting for something interesting to happen.
+//
+
+void recorder_copy_in(struct recorder *rec, uint32_t offset, const void *data,
+                      uint32_t size)
+{
+    offset %= rec->capacity;
+    uint32_t first = rec->capacity - offset < size ?
+        rec->capacity - offset : size;
+    memcpy(rec->data + offset, data, first);
+    memcpy(rec->data, (const uint8_t *)data + first, size - first);
+}
+
+void recorder_copy_out(struct recorder *rec, uint32_t offset, void *data,
+                       uint32_t size)
+{
+    offset %= rec->capacity;
+    uint32_t first = rec->capacity - offset < size ?
+        rec->capacity - offset : size;
+    memcpy(data, rec->data + offset, first);
+    memcpy((uint8_t *)data + first, rec->data, size - first);
+}
+
+// Moves the samples that the writer collected since the last tick into the
+// ring, first dropping the ticks that are too old or in the way.
+void record_tick(struct basic_info *binfo, struct ebml_writer *writer)
+{
+    struct recorder *rec = &binfo->recorder;
+    struct recording_header header;
+    header.time_ns = binfo->timing.time_ns;
+    header.size = writer->buf->slen;
+    uint32_t size = sizeof(header) + header.size;
+    if (!header.size)
+        return;
+    if (size > rec->capacity) {
+        stats.recorder_dropped++;
+        btrunc(writer->buf, 0);
+        return;
+    }
+
+    while (rec->count) {
+        struct recording_header oldest;
+        recorder_copy_out(rec, rec->head, &oldest, sizeof(oldest));
+        if (rec->used + size <= rec->capacity && (!rec->window_ns ||
+                oldest.time_ns + rec->window_ns >= header.time_ns))
+            break;
+
+        rec->head = (rec->head + sizeof(oldest) + oldest.size) %
+            rec->capacity;
+        rec->used -= sizeof(oldest) + oldest.size;
+        rec->count--;
+        stats.recorder_dropped++;
+    }
+
+    recorder_copy_in(rec, rec->head + rec->used, &header, sizeof(header));
+    recorder_copy_in(rec, rec->head + rec->used + sizeof(header),
+                     writer->buf->data, header.size);
+    rec->used += size;
+    rec->count++;
+    btrunc(writer->buf, 0);
+}
+
+// Writes part of the ring as is; it's already EBML.
+bool write_recorded_bytes(struct ebml_writer *writer, struct recorder *rec,
+                          uint32_t offset, uint32_t size)
+{
+    offset %= rec->capacity;
+    uint32_t first = rec->capacity - offset < size ?
+        rec->capacity - offset : size;
+    return ebml_write(writer, rec->data + offset, first) &&
+        (first == size || ebml_write(writer, rec->data, size - first));
+}
+
+// Names each dump after the output path: profile.ebml becomes
+// profile-1.ebml, profile-2.ebml and so on.
+bstring get_dump_path(const char *out_path, uint32_t number)
+{
+    const char *dot = strrchr(out_path, '.');
+    if (!dot || strchr(dot, '/'))
+        return bformat("%s-%u", out_path, number);
+    return bformat("%.*s-%u%s", (int)(dot - out_path), out_path, number,
+                   dot);
+}
+
+// With -U, piranha-unwind needs to know where threads start, which only
+// the device's libc can tell.
+bool write_thread_entry(struct basic_info *binfo, struct ebml_writer *writer)
+{
+    if (!binfo->raw_stacks)
+        return true;
+    if (!ebml_start_tag(writer, EBML_THREAD_ENTRY_TAG) ||
+            !ebml_write_uint32(writer, binfo->thread_entry_offset))
+        return false;
+    ebml_end_tag(writer);
+    return true;
+}
+
+// Writes the ring out as a complete profile, in a file of its own. The
+// memory maps and thread lifetimes are the ones known at the time of the
+// dump. A failed dump is reported but doesn't stop the recording.
+void dump_recording(struct basic_info *binfo)
+{
+    struct recorder *rec = &binfo->recorder;
+    bstring path = get_dump_path(binfo->out_path, ++rec->dumps);
+    if (!path)
+        return;
+
+    struct ebml_writer writer;
+    memset(&writer, '\0', sizeof(writer));
+    if (!(writer.f = fopen((char *)path->data, "wb"))) {
+        perror("Couldn't open the dump file");
+        bdestroy(path);
+        return;
+    }
+
+    struct tagbstring format_name = bsStatic("piranha-samples");
+    bool ok = ebml_write_header(&writer, &format_name) &&
+        write_thread_entry(binfo, &writer);
+    for (int i = 0; ok && i < get_process_count(binfo); i++) {
+        struct process *proc = get_process_at(binfo, i);
+        ok = !proc->maps || print_maps(&writer, proc);
+    }
+
+    ok = ok && ebml_start_tag(&writer, EBML_SAMPLES_TAG);
+    for (uint32_t pos = 0; ok && pos < rec->used; ) {
+        struct recording_header header;
+        recorder_copy_out(rec, rec->head + pos, &header, sizeof(header));
+        ok = write_recorded_bytes(&writer, rec,
+                                  rec->head + pos + sizeof(header),
+                                  header.size);
+        pos += sizeof(header) + header.size;
+    }
+    if (ok)
+        ebml_end_tag(&writer);
+
+    if (ok && binfo->backend == BACKEND_PTRACE)
+        ok = print_threads(&writer, binfo);
+
+    ebml_finish(&writer);
+    if (ok) {
+        fprintf(stderr, "Wrote the last %u ticks to %s\n", rec->count,
+                (char *)path->data);
+    } else {
+        fprintf(stderr, "Failed to write %s\n", (char *)path->data);
+    }
+    bdestroy(path);
+}
+
+// Opens the control socket, a Unix datagram socket that takes a command
+// per datagram. A path that starts with '@' is in the abstract namespace,
+// as is usual on Android.
+int open_control_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, '\0', sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    size_t len = strlen(path);
+    if (len >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Control socket path is too long\n");
+        return -1;
+    }
+    memcpy(addr.sun_path, path, len);
+    if (path[0] == '@')
+        addr.sun_path[0] = '\0';
+    else
+        unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr,
+                       offsetof(struct sockaddr_un, sun_path) + len)) {
+        perror("Failed to open the control socket");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Carries out whatever commands are waiting on the control socket, without
+// blocking: "dump" writes out the flight recorder, and "stop" ends
+// profiling, in which case *running is cleared.
+void handle_control_commands(struct basic_info *binfo, bool *running)
+{
+    char command[CONTROL_COMMAND_SIZE];
+    ssize_t len;
+    while ((len = recv(binfo->control_fd, command, sizeof(command) - 1,
+                       MSG_DONTWAIT)) >= 0) {
+        while (len && (command[len - 1] == '\n' || command[len - 1] == ' '))
+            len--;
+        command[len] = '\0';
+
+        if (!strcmp(command, "dump") && binfo->recorder.data)
+            dump_recording(binfo);
+        else if (!strcmp(command, "dump"))
+            fprintf(stderr, "Nothing to dump without -R\n");
+        else if (!strcmp(command, "stop"))
+            *running = false;
+        else
+            fprintf(stderr, "Unknown control command: %s\n", command);
+    }
+}
+
+// (Re)arms the tick timer and restarts the tick schedule; the next tick is
+// due one interval from now.
+bool set_tick_interval(struct basic_info *binfo, uint64_t interval_ns)
+{
+    struct itimerspec itspec;
+    itspec.it_interval.tv_sec = interval_ns / 1000000000;
+    itspec.it_interval.tv_nsec = interval_ns % 1000000000;
+    itspec.it_value = itspec.it_interval;
+
+    binfo->interval_ns = interval_ns;
+    binfo->schedule_start_ns = now_ns();
+    binfo->scheduled_ticks = 0;
+
+    if (binfo->timer_fd >= 0)
+        return !syscall(__NR_timerfd_settime, binfo->timer_fd, 0, &itspec,
+                        NULL);
+    return !timer_settime(binfo->posix_timer, 0, &itspec, NULL);
+}
+
+// Moves the tick interval towards the one at which the target's stop time
+// stays within the budget. The stop time is smoothed so that one slow tick
+// doesn't swing the rate, and small corrections are ignored so that we don't
+// rearm the timer on every tick.
+void adapt_tick_interval(struct basic_info *binfo)
+{
+    binfo->avg_stop_ns = binfo->avg_stop_ns ?
+        (binfo->avg_stop_ns * 7 + binfo->last_stop_ns) / 8 :
+        binfo->last_stop_ns;
+
+    uint64_t interval_ns = binfo->avg_stop_ns / binfo->stop_budget;
+    if (interval_ns < MIN_ADAPTED_INTERVAL_NS)
+        interval_ns = MIN_ADAPTED_INTERVAL_NS;
+    if (interval_ns > MAX_TICK_INTERVAL_NS)
+        interval_ns = MAX_TICK_INTERVAL_NS;
+
+    if (interval_ns * 10 > binfo->interval_ns * 9 &&
+            interval_ns * 10 < binfo->interval_ns * 11)
+        return;
+
+    stats.interval_changes++;
+    if (!set_tick_interval(binfo, interval_ns))
+        perror("Failed to change the sampling interval");
+}
+
+// Takes one sample with whichever backend is in use. The timer reports how
+// many intervals elapsed since the last tick; more than one means that
+// sampling fell behind and ticks were dropped.
+bool tick(struct basic_info *binfo, struct ebml_writer *writer,
+          uint64_t expirations)
+{
+    stats.ticks++;
+    unsigned long allocations_before = allocation_count;
+
+    binfo->scheduled_ticks += expirations;
+    uint64_t due_ns = binfo->schedule_start_ns +
+        binfo->scheduled_ticks * binfo->interval_ns;
+    uint64_t start_ns = binfo->timing.time_ns = now_ns();
+    binfo->timing.lateness_ns = binfo->timing.time_ns > due_ns ?
+        binfo->timing.time_ns - due_ns : 0;
+    binfo->timing.missed_ticks = expirations - 1;
+
+    stats.missed_ticks += binfo->timing.missed_ticks;
+    if (binfo->timing.lateness_ns > stats.max_lateness_ns)
+        stats.max_lateness_ns = binfo->timing.lateness_ns;
+
+    if (stats.ticks % PROCESS_RESCAN_INTERVAL_TICKS == 0 &&
+            !scan_processes(binfo, writer, false))
+        return false;
+    if (binfo->raw_stacks && !binfo->recorder.data &&
+            !write_new_maps(binfo, writer))
+        return false;
+
+    // With perf and the agent, every sample is a SAMPLE of its own, and with
+    // BPF every count.
+    bool ok;
+    binfo->last_stop_ns = 0;
+    if (binfo->backend != BACKEND_PTRACE) {
+        ok = sample_processes(binfo, writer);
+        if (ok && binfo->backend == BACKEND_BPF &&
+                stats.ticks % BPF_DRAIN_INTERVAL_TICKS == 0)
+            ok = drain_bpf_counts(binfo, writer);
+    } else {
+        if (binfo->persistent)
+            handle_thread_events(binfo);
+        if (!ebml_start_tag(writer, EBML_SAMPLE_TAG) ||
+                !ebml_write_sample_timing(writer, &binfo->timing) ||
+                !ebml_write_sample_weight(writer, binfo->interval_ns *
+                                          (1 + binfo->timing.missed_ticks)))
+            return false;
+        ok = sample_processes(binfo, writer);
+        ebml_end_tag(writer);
+    }
+
+    if (binfo->last_stop_ns > stats.max_stop_ns)
+        stats.max_stop_ns = binfo->last_stop_ns;
+    if (ok && binfo->recorder.data)
+        record_tick(binfo, writer);
+
+    if (allocation_count != allocations_before) {
+        stats.allocations += allocation_count - allocations_before;
+        stats.allocating_ticks++;
+        if (stats.ticks > ALLOCATION_WARMUP_TICKS)
+            stats.late_allocating_ticks++;
+    }
+
+    if (ok && binfo->stop_budget && binfo->backend == BACKEND_PTRACE)
+        adapt_tick_interval(binfo);
+
+    stats.tick_ns += now_ns() - start_ns;
+    return ok;
+}
+
+//
+// Event loop
+//
+// Where the kernel supports them, ticks come from a CLOCK_MONOTONIC timerfd,
+// SIGINT and SIGUSR1 from a signalfd and the targets' exits from pidfds, all
+// multiplexed with epoll along with the control socket. Older kernels get
+// the SIGALRM and self-pipe loop instead.
+//
+
+struct event_loop;
 
-        // Attach to the thread if we need to.
-        if (binfo->pid != thread_pid) {
-            if (ptrace(PTRACE_ATTACH, thread_pid, NULL, NULL))
-                continue;
-            if (!wait_for_thread_attachment(thread_pid))
-                continue;
-        }
+typedef bool (*event_handler)(struct event_loop *loop, int fd);
 
-        if (!ebml_start_tag(writer, EBML_THREAD_SAMPLE_TAG)) {
-            ok = false;
-            break;
-        }
+struct event_source {
+    int fd;
+    event_handler handle;
+};
 
-        if (!ebml_start_tag(writer, EBML_THREAD_PID_TAG)) {
-            ok = false;
-            break;
-        }
-        uint32_t pid_buf = htonl(thread_pid);
-        if (!fwrite(&pid_buf, sizeof(pid_buf), 1, writer->f)) {
-            ok = false;
-            break;
-        }
-        ebml_end_tag(writer);
+struct event_loop {
+    int epoll_fd;
+    bool running;
+    struct basic_info *binfo;
+    struct ebml_writer *writer;
+    struct event_source sources[MAX_EVENT_SOURCES];
+    int source_count;
+};
 
-        if (!ebml_start_tag(writer, EBML_THREAD_STATUS_TAG)) {
-            ok = false;
-            break;
-        }
-        if (!fwrite(state->data, state->slen + 1, 1, writer->f)) {
-            ok = false;
-            break;
-        }
-        ebml_end_tag(writer);
+bool add_event_source(struct event_loop *loop, int fd, event_handler handle)
+{
+    if (loop->source_count == MAX_EVENT_SOURCES)
+        return false;
 
-        if (!unwind(binfo, writer, thread_pid))
-            ok = false;
+    struct event_source *source = &loop->sources[loop->source_count];
+    source->fd = fd;
+    source->handle = handle;
 
-        if (binfo->pid != thread_pid)
-            detach_from_thread((pid_t)thread_pid);
+    struct epoll_event event;
+    memset(&event, '\0', sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = source;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event))
+        return false;
 
-        ebml_end_tag(writer);
-    }
+    loop->source_count++;
+    return true;
+}
 
-    closedir(tasks_dir);
+bool handle_timer(struct event_loop *loop, int fd)
+{
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return errno == EAGAIN || errno == EINTR;
+    if (!tick(loop->binfo, loop->writer, expirations))
+        return false;
+    if (profiling_done(loop->binfo))
+        loop->running = false;
+    return true;
+}
 
-out:
-    if (ptrace(PTRACE_DETACH, binfo->pid, NULL, NULL))
-        perror("Failed to detach from process");
-    ebml_end_tag(writer);
-    return ok;
+bool handle_signal(struct event_loop *loop, int fd)
+{
+    // The signal number comes first in struct signalfd_siginfo.
+    uint8_t siginfo[SIGNALFD_SIGINFO_SIZE];
+    uint32_t signo;
+    if (read(fd, siginfo, sizeof(siginfo)) != sizeof(siginfo))
+        return true;
+    memcpy(&signo, siginfo, sizeof(signo));
+
+    if (signo == SIGUSR1)
+        dump_recording(loop->binfo);
+    else
+        loop->running = false;
+    return true;
 }
 
-bool compute_thread_entry(struct basic_info *info)
+bool handle_control(struct event_loop *loop, int fd)
 {
-    bool ok = true;
+    handle_control_commands(loop->binfo, &loop->running);
+    return true;
+}
 
-    void *lib = dlopen("libc.so", RTLD_LAZY);
-    if (!lib) {
-        fprintf(stderr, "failed to dlopen libc.so: %s\n", dlerror());
+bool handle_target_exit(struct event_loop *loop, int fd)
+{
+    // A pidfd stays readable, so stop watching it.
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+
+    struct basic_info *binfo = loop->binfo;
+    for (int i = 0; i < get_process_count(binfo); i++) {
+        binfo->process = get_process_at(binfo, i);
+        if (binfo->process->pid_fd != fd || !binfo->process->live)
+            continue;
+        fprintf(stderr, "Process %d exited\n", (int)binfo->process->pid);
+        if (!end_process(binfo, loop->writer, true))
+            return false;
+    }
+
+    if (!any_live_process(binfo))
+        loop->running = false;
+    return true;
+}
+
+void close_event_loop(struct event_loop *loop)
+{
+    for (int i = 0; i < loop->source_count; i++)
+        close(loop->sources[i].fd);
+    if (loop->epoll_fd >= 0)
+        close(loop->epoll_fd);
+}
+
+// Sets up the epoll loop. Returns false if the kernel lacks what we need, in
+// which case the caller falls back to run_signal_loop().
+bool init_event_loop(struct event_loop *loop, struct basic_info *binfo,
+                     struct ebml_writer *writer)
+{
+    memset(loop, '\0', sizeof(*loop));
+    loop->binfo = binfo;
+    loop->writer = writer;
+    if ((loop->epoll_fd = epoll_create(MAX_EVENT_SOURCES)) < 0)
         return false;
+
+    int timer_fd = syscall(__NR_timerfd_create, CLOCK_MONOTONIC, 0);
+    if (timer_fd < 0 || !add_event_source(loop, timer_fd, handle_timer)) {
+        if (timer_fd >= 0)
+            close(timer_fd);
+        goto fail;
     }
 
-    void *thread_entry = dlsym(lib, "__thread_entry");
-    if (!thread_entry) {
-        ok = false;
-        fprintf(stderr, "failed to dlsym __thread_entry: %s\n", dlerror());
-        goto out;
+    binfo->timer_fd = timer_fd;
+    if (!set_tick_interval(binfo, binfo->interval_ns))
+        goto fail;
+
+    // The signals have to be blocked for the signalfd to see them. SIGUSR1
+    // is left alone unless there's a flight recorder to dump.
+    sigset_t signal_set;
+    sigemptyset(&signal_set);
+    sigaddset(&signal_set, SIGINT);
+    uint64_t signal_mask = 1ULL << (SIGINT - 1);
+    if (binfo->recorder.data) {
+        sigaddset(&signal_set, SIGUSR1);
+        signal_mask |= 1ULL << (SIGUSR1 - 1);
+    }
+    int signal_fd = syscall(__NR_signalfd4, -1, &signal_mask,
+                            sizeof(signal_mask), 0);
+    if (signal_fd < 0 || !add_event_source(loop, signal_fd, handle_signal)) {
+        if (signal_fd >= 0)
+            close(signal_fd);
+        goto fail;
+    }
+    sigprocmask(SIG_BLOCK, &signal_set, NULL);
+
+    // The loop closes its sources, but the control socket outlives it.
+    if (binfo->control_fd >= 0) {
+        int control_fd = dup(binfo->control_fd);
+        if (control_fd < 0 ||
+                !add_event_source(loop, control_fd, handle_control)) {
+            if (control_fd >= 0)
+                close(control_fd);
+            goto fail;
+        }
     }
 
-    Dl_info dl_info;
-    if (!dladdr(thread_entry, &dl_info)) {
-        ok = false;
-        fprintf(stderr, "failed to dladdr __thread_entry: %s\n", dlerror());
-        goto out;
+    // pidfds are newer still (Linux 5.3). Without one we just don't notice
+    // that a target went away until sampling fails or the next process scan.
+    for (int i = 0; i < get_process_count(binfo); i++) {
+        struct process *proc = get_process_at(binfo, i);
+        int pid_fd = syscall(__NR_pidfd_open, proc->pid, 0);
+        if (pid_fd >= 0 && !add_event_source(loop, pid_fd, handle_target_exit))
+            close(pid_fd);
+        else
+            proc->pid_fd = pid_fd;
     }
 
-    info->thread_entry_offset = (uint32_t)dl_info.dli_saddr -
-        (uint32_t)dl_info.dli_fbase;
+    return true;
 
-out:
-    dlclose(lib);
+fail:
+    binfo->timer_fd = -1;
+    close_event_loop(loop);
+    return false;
+}
+
+bool run_event_loop(struct event_loop *loop)
+{
+    bool ok = true;
+    loop->running = true;
+    while (ok && loop->running) {
+        struct epoll_event events[MAX_EVENT_SOURCES];
+        int count = epoll_wait(loop->epoll_fd, events, MAX_EVENT_SOURCES, -1);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait() failed");
+            ok = false;
+            break;
+        }
+
+        for (int i = 0; ok && loop->running && i < count; i++) {
+            struct event_source *source = events[i].data.ptr;
+            ok = source->handle(loop, source->fd);
+        }
+    }
+
+    close_event_loop(loop);
     return ok;
 }
 
-bool profile(struct basic_info *binfo, struct ebml_writer *writer)
+// See comments in run_signal_loop(). This lame thing is the result of
+// Android's lack of any signal handling mechanisms invented in the last 20
+// years.
+int signal_pipe[2];
+volatile int dump_requested = 0;
+
+void signal_handler(int which)
 {
-    if (!ebml_start_tag(writer, EBML_SAMPLES_TAG))
-        return false;
+    static bool sigint_handled = false;
+    if (which == SIGUSR1) {
+        uint8_t b = 0;
+        dump_requested = 1;
+        write(signal_pipe[1], &b, sizeof(b));
+        return;
+    }
 
-    // We have neither signalfd() nor sigwaitinfo() on Android, so we have to
-    // do this dumb thing with socketpair() to get a performant event model.
-    if (socketpair(AF_UNIX, SOCK_STREAM, 0, signal_sockets)) {
-        perror("socketpair() failed");
-        return false;
+    if (which == SIGINT) {
+        if (sigint_handled) {
+            fprintf(stderr, "Caught two SIGINTs; aborting\n");
+            abort();
+        }
+        sigint_handled = true;
+    }
+
+    if (pending_signal == PENDING_SIGNAL_NONE) {
+        uint8_t b = 0;
+        write(signal_pipe[1], &b, sizeof(b));
     }
-    if (pipe(signal_sockets)) {
+
+    if (which == SIGINT)
+        pending_signal = PENDING_SIGNAL_STOP;
+    else if (pending_signal < PENDING_SIGNAL_STOP)
+        pending_signal = PENDING_SIGNAL_TICK;
+}
+
+bool run_signal_loop(struct basic_info *binfo, struct ebml_writer *writer)
+{
+    // Old kernels have neither signalfd() nor timerfd, so we have to do this
+    // dumb thing with a pipe to get a performant event model.
+    if (pipe(signal_pipe)) {
         perror("pipe() failed");
         return false;
     }
 
-    if (signal(SIGINT, signal_handler)) {
+    bool ok = true;
+    if (signal(SIGINT, signal_handler) == SIG_ERR) {
         perror("signal(SIGINT) failed");
-        return false;
+        ok = false;
+        goto out_pipe;
     }
-    if (signal(SIGALRM, signal_handler)) {
+    if (signal(SIGALRM, signal_handler) == SIG_ERR) {
         perror("signal(SIGALRM) failed");
-        return false;
+        ok = false;
+        goto out_pipe;
+    }
+    if (binfo->recorder.data && signal(SIGUSR1, signal_handler) == SIG_ERR) {
+        perror("signal(SIGUSR1) failed");
+        ok = false;
+        goto out_pipe;
     }
 
     // Create the timer
     struct sigevent sev;
+    memset(&sev, '\0', sizeof(sev));
     sev.sigev_notify = SIGEV_SIGNAL;
     sev.sigev_signo = SIGALRM;
-    timer_t timer;
-    if (timer_create(CLOCK_REALTIME, &sev, &timer)) {
+    if (timer_create(CLOCK_MONOTONIC, &sev, &binfo->posix_timer)) {
         perror("timer_create() failed");
-        return false;
+        ok = false;
+        goto out_pipe;
     }
 
     // Arm the timer
-    bool ok;
-    struct itimerspec itspec;
-    itspec.it_interval.tv_sec = 0;
-    itspec.it_interval.tv_nsec = 10000000;  // 10ms
-    itspec.it_value = itspec.it_interval;
-    if (timer_settime(timer, 0, &itspec, NULL)) {
+    binfo->timer_fd = -1;
+    if (!set_tick_interval(binfo, binfo->interval_ns)) {
         perror("timer_settime() failed");
         ok = false;
         goto out;
     }
 
     uint8_t b;
-    while (read(signal_sockets[0], &b, sizeof(b))) {
+    while (read(signal_pipe[0], &b, sizeof(b))) {
         int sig = pending_signal;
         pending_signal = PENDING_SIGNAL_NONE;
+        if (dump_requested) {
+            dump_requested = 0;
+            dump_recording(binfo);
+        }
 
         switch (sig) {
-        case PENDING_SIGNAL_TICK:
-            if (!(ok = sample(binfo, writer)))
+        case PENDING_SIGNAL_TICK: {
+            // Ticks that fired while one was already pending were coalesced
+            // by the signal handler, so work out from the clock how many
+            // intervals have really gone by.
+            uint64_t due_ticks = (now_ns() - binfo->schedule_start_ns) /
+                binfo->interval_ns;
+            uint64_t expirations = due_ticks > binfo->scheduled_ticks ?
+                due_ticks - binfo->scheduled_ticks : 1;
+            if (!(ok = tick(binfo, writer, expirations)) ||
+                    profiling_done(binfo))
+                goto out;
+
+            // Without epoll, the control socket is checked on every tick.
+            bool running = true;
+            if (binfo->control_fd >= 0)
+                handle_control_commands(binfo, &running);
+            if (!running)
                 goto out;
             break;
+        }
         case PENDING_SIGNAL_STOP:
             goto out;
         }
     }
 
 out:
-    timer_delete(timer);
-    ebml_end_tag(writer);
+    timer_delete(binfo->posix_timer);
+out_pipe:
+    close(signal_pipe[0]);
+    close(signal_pipe[1]);
     return ok;
 }
 
-bool open_memory(struct basic_info *binfo)
+bool profile(struct basic_info *binfo, struct ebml_writer *writer)
 {
-    bstring mem_path = bformat("/proc/%d/mem", (int)binfo->pid);
-    if (!mem_path)
+    if (!binfo->recorder.data && !write_thread_entry(binfo, writer))
         return false;
 
-    bool ok = (binfo->mem = open((char *)mem_path->data, O_RDONLY)) >= 0;
-    binfo->mem_offset = 0;
+    // The flight recorder writes its own SAMPLES element when it dumps.
+    if (!binfo->recorder.data && !ebml_start_tag(writer, EBML_SAMPLES_TAG))
+        return false;
 
-    bdestroy(mem_path);
+    bool ok;
+    struct event_loop loop;
+    if (init_event_loop(&loop, binfo, writer))
+        ok = run_event_loop(&loop);
+    else
+        ok = run_signal_loop(binfo, writer);
+
+    // Pick up whatever the kernel or the agent sampled since the last tick.
+    if (ok && binfo->backend != BACKEND_PTRACE)
+        ok = sample_processes(binfo, writer);
+    if (ok && binfo->backend == BACKEND_BPF)
+        ok = drain_bpf_counts(binfo, writer);
+
+    if (binfo->recorder.data)
+        record_tick(binfo, writer);
+    else
+        ebml_end_tag(writer);
     return ok;
 }
 
+// Allocates the buffers that are shared by all processes. Nothing that runs
+// on a tick allocates.
+bool alloc_buffers(struct basic_info *binfo)
+{
+    binfo->stack_iovecs = counted_malloc((binfo->stack_copy_cap /
+                                          PAGE_SIZE_BYTES + 2) *
+                                         sizeof(struct iovec));
+    binfo->task_ids = counted_malloc(MAX_TASKS * sizeof(pid_t));
+    if (!binfo->stack_iovecs || !binfo->task_ids)
+        return false;
+    if (binfo->backend == BACKEND_PTRACE &&
+            !open_thread_reads(&binfo->thread_reads, binfo->use_io_uring))
+        return false;
+    if (binfo->backend == BACKEND_PERF &&
+            !(binfo->perf_record_buf = counted_malloc(PERF_RING_PAGES *
+                                                      PAGE_SIZE_BYTES)))
+        return false;
+    if (binfo->follow_children &&
+            !(binfo->proc_ids = counted_malloc(2 * MAX_PROCESSES *
+                                               sizeof(pid_t))))
+        return false;
+    return !!(binfo->processes = bfromcstralloc(INITIAL_PROCESS_CAPACITY *
+                                                sizeof(struct process), ""));
+}
+
+void print_stats(struct basic_info *binfo)
+{
+    uint32_t ticks = stats.ticks ? stats.ticks : 1;
+    fprintf(stderr, "ticks: %u (%u missed)\n", stats.ticks,
+            stats.missed_ticks);
+    fprintf(stderr, "worst tick lateness: %llu us\n",
+            (unsigned long long)(stats.max_lateness_ns / 1000));
+    fprintf(stderr, "final tick interval: %llu us (%u changes)\n",
+            (unsigned long long)(binfo->interval_ns / 1000),
+            stats.interval_changes);
+    fprintf(stderr, "sampler time per tick: %llu ns\n",
+            (unsigned long long)(stats.tick_ns / ticks));
+    fprintf(stderr, "stop time per tick: %llu us avg, %llu us max\n",
+            (unsigned long long)(stats.stop_ns / ticks / 1000),
+            (unsigned long long)(stats.max_stop_ns / 1000));
+    fprintf(stderr, "attach/detach syscalls per tick: %.1f\n",
+            (double)stats.attach_calls / ticks);
+    fprintf(stderr, "interrupt/resume syscalls per tick: %.1f\n",
+            (double)stats.interrupt_calls / ticks);
+    fprintf(stderr, "stack snapshot syscalls per tick: %.1f (%llu bytes)\n",
+            (double)stats.stack_reads / ticks,
+            (unsigned long long)(stats.stack_bytes / ticks));
+    fprintf(stderr, "code reads per tick: %.1f\n",
+            (double)stats.text_reads / ticks);
+    if (!binfo->raw_stacks && binfo->backend != BACKEND_BPF) {
+        fprintf(stderr, "frames from frame pointers: %u, from CFI: %u, "
+                "from EHABI: %u, from\n    scanning: %u\n",
+                stats.unwind.fp_frames, stats.unwind.cfi_frames,
+                stats.unwind.exidx_frames, stats.unwind.scanned_frames);
+        uint32_t lookups = stats.unwind.lr_cache_hits +
+            stats.unwind.lr_cache_misses;
+        fprintf(stderr, "return address cache: %.1f%% hits, code reads "
+                "saved per tick: %.1f\n",
+                lookups ? 100.0 * stats.unwind.lr_cache_hits / lookups : 0.0,
+                (double)stats.unwind.lr_cache_saved_reads / ticks);
+        fprintf(stderr, "call site maps: %u built, %u from the cache; "
+                "return addresses checked\n    with them per tick: %.1f\n",
+                stats.unwind.call_site_maps_built,
+                stats.unwind.call_site_maps_loaded,
+                (double)stats.unwind.call_site_tests / ticks);
+    }
+    if (binfo->unwinders.worker_count) {
+        fprintf(stderr, "unwinders: %d, waits for them per tick: %.1f\n",
+                binfo->unwinders.worker_count,
+                (double)stats.unwind_waits / ticks);
+    }
+    if (binfo->raw_stacks) {
+        fprintf(stderr, "raw stacks for piranha-unwind: %u\n",
+                stats.raw_stacks);
+    }
+    fprintf(stderr, "thread events: %u, thread rescans: %u\n",
+            stats.thread_events, stats.rescans);
+    fprintf(stderr, "processes: %d (%u children followed), maps re-reads: "
+            "%u\n", get_process_count(binfo), stats.processes_followed,
+            stats.maps_reads);
+    if (binfo->recorder.data) {
+        fprintf(stderr, "flight recorder: %u ticks in %u KB, %u dropped, "
+                "%u dumps\n", binfo->recorder.count,
+                binfo->recorder.used / 1024, stats.recorder_dropped,
+                binfo->recorder.dumps);
+    }
+    fprintf(stderr, "allocations while sampling: %llu in %u ticks\n",
+            (unsigned long long)stats.allocations, stats.allocating_ticks);
+    if (stats.thread_samples) {
+        fprintf(stderr, "thread samples: %u (%u idle, stack reused; "
+                "%u blocked, not stopped)\n", stats.thread_samples,
+                stats.idle_samples, stats.blocked_samples);
+    }
+    if (stats.state_reads) {
+        fprintf(stderr, "thread state reads: %u, %llu ns each\n",
+                stats.state_reads,
+                (unsigned long long)(stats.state_read_ns / stats.state_reads));
+        fprintf(stderr, "thread state syscalls per tick: %.1f (%s)\n",
+                (double)stats.state_read_calls / ticks,
+                binfo->thread_reads.ring_fd >= 0 ? "io_uring" : "pread");
+    }
+    if (stats.perf_samples || stats.perf_lost) {
+        fprintf(stderr, "perf samples: %u (%llu lost)\n", stats.perf_samples,
+                (unsigned long long)stats.perf_lost);
+    }
+    if (stats.agent_samples || stats.agent_lost || stats.agent_unsampled) {
+        fprintf(stderr, "agent samples: %u (%u lost), threads with no slot: "
+                "%u\n", stats.agent_samples, stats.agent_lost,
+                stats.agent_unsampled);
+    }
+    if (stats.bpf_keys) {
+        fprintf(stderr, "bpf samples: %llu in %u counts (%u stacks lost)\n",
+                (unsigned long long)stats.bpf_samples, stats.bpf_keys,
+                stats.bpf_lost_stacks);
+    }
+}
+
+bool add_thread_spec(struct thread_filter *filter, const char *spec)
+{
+    if (filter->count == MAX_THREAD_SPECS)
+        return false;
+    filter->specs[filter->count++] = spec;
+    return true;
+}
+
 void usage()
 {
-    fprintf(stderr, "usage: piranha [-o FILE] PID\n");
+    fprintf(stderr,
+            "usage: piranha [-IKPsTUZ] [-B PERCENT] [-b BACKEND] [-C SOCKET] "
+            "[-c BYTES] [-D DIR]\n               [-F HZ] [-i USEC] [-j N] "
+            "[-n TICKS] [-o FILE] [-p MODULES]\n               [-R LIMIT] "
+            "[-t THREAD] [-x THREAD] [-f THREAD] [-r N] PID...\n"
+            "       piranha [OPTIONS] [-A LIBRARY] -- COMMAND [ARG...]\n");
+    fprintf(stderr, "  -A  preload the sampling agent LIBRARY into COMMAND "
+            "(with -b agent)\n");
+    fprintf(stderr, "  -B  adapt the sampling rate to keep the target stopped "
+            "at most PERCENT\n      of the time\n");
+    fprintf(stderr, "  -b  sampling backend: ptrace (default), perf, agent "
+            "or bpf\n");
+    fprintf(stderr, "  -C  take commands (dump, stop) on a Unix datagram "
+            "socket; @NAME is abstract\n");
+    fprintf(stderr, "  -c  copy at most BYTES of each stack (default %d, or "
+            "%d with perf)\n", DEFAULT_STACK_COPY_CAP,
+            DEFAULT_PERF_STACK_COPY);
+    fprintf(stderr, "  -D  keep the modules' call site maps in DIR between "
+            "runs (default\n      %s), or nowhere with -D none\n",
+            DEFAULT_CALL_SITE_CACHE_DIR);
+    fprintf(stderr, "  -F  perf, agent or bpf sampling frequency "
+            "(default %d)\n", DEFAULT_PERF_FREQUENCY);
+    fprintf(stderr, "  -I  read thread states with pread() instead of "
+            "io_uring\n");
+    fprintf(stderr, "  -i  tick interval in microseconds (default %d, at "
+            "least %d)\n", TICK_INTERVAL_NS / 1000,
+            MIN_TICK_INTERVAL_NS / 1000);
+    fprintf(stderr, "  -j  unwind stacks on N worker threads while the "
+            "sampler goes on\n");
+    fprintf(stderr, "  -K  with -b bpf, record kernel stacks too\n");
+    fprintf(stderr, "  -n  stop after TICKS ticks\n");
+    fprintf(stderr, "  -P  seize threads once instead of attaching per tick\n");
+    fprintf(stderr, "  -p  follow frame pointers through MODULES, file names "
+            "separated by commas,\n      or all\n");
+    fprintf(stderr, "  -R  keep only the last Ns or NM of samples, in memory, "
+            "and write them to\n      numbered files on SIGUSR1, a dump "
+            "command (-C) or exit\n");
+    fprintf(stderr, "  -s  print profiler overhead statistics at exit\n");
+    fprintf(stderr, "  -T  also profile the children of the given processes\n");
+    fprintf(stderr, "  -U  write registers and raw stacks, for piranha-unwind, "
+            "instead of\n      unwinding (default -c %d)\n",
+            DEFAULT_RAW_STACK_COPY);
+    fprintf(stderr, "  -t  only sample the given threads\n");
+    fprintf(stderr, "  -x  don't sample the given threads\n");
+    fprintf(stderr, "  -f  sample the given threads on every tick, and the "
+            "rest every N ticks (-r)\n");
+    fprintf(stderr, "      THREAD is a TID or a name pattern with * and ?; "
+            "these options can be\n      repeated\n");
+    fprintf(stderr, "  -Z  exit with an error if any tick after the first %d "
+            "allocated memory\n", ALLOCATION_WARMUP_TICKS);
     exit(1);
 }
 
 int main(int argc, char **argv)
 {
     char *out_path = "profile.ebml";
+    bool persistent = false, show_stats = false, follow_children = false;
+    bool kernel_stacks = false, raw_stacks = false, check_allocations = false;
+    bool use_io_uring = true;
+    int unwind_workers = 0;
+    int backend = BACKEND_PTRACE;
+    uint32_t stack_copy_cap = 0, perf_frequency = DEFAULT_PERF_FREQUENCY;
+    double stop_budget = 0.0;
+    uint64_t interval_ns = TICK_INTERVAL_NS;
+    uint32_t slow_ticks = 1, tick_limit = 0;
+    uint32_t recorder_mb = 0;
+    uint64_t recorder_window_ns = 0;
+    const char *control_path = NULL;
+    const char *agent_library = NULL;
+    const char *frame_pointer_modules = NULL;
+    const char *call_site_cache_dir = DEFAULT_CALL_SITE_CACHE_DIR;
+    char *end;
+    struct thread_filter include, exclude, fast;
+    memset(&include, '\0', sizeof(include));
+    memset(&exclude, '\0', sizeof(exclude));
+    memset(&fast, '\0', sizeof(fast));
     int ch;
-    while ((ch = getopt(argc, argv, "o:")) != -1) {
+    const char *opts = "A:B:b:C:c:D:F:f:Ii:j:Kn:o:Pp:R:r:sTt:Ux:Z";
+    while ((ch = getopt(argc, argv, opts)) != -1) {
         switch (ch) {
+        case 'A':
+            agent_library = optarg;
+            break;
+        case 'B':
+            stop_budget = strtod(optarg, NULL) / 100.0;
+            if (stop_budget <= 0.0 || stop_budget > 1.0)
+                usage();
+            break;
+        case 'b':
+            if (!strcmp(optarg, "ptrace"))
+                backend = BACKEND_PTRACE;
+            else if (!strcmp(optarg, "perf"))
+                backend = BACKEND_PERF;
+            else if (!strcmp(optarg, "agent"))
+                backend = BACKEND_AGENT;
+            else if (!strcmp(optarg, "bpf"))
+                backend = BACKEND_BPF;
+            else
+                usage();
+            break;
+        case 'C':
+            control_path = optarg;
+            break;
+        case 'c':
+            stack_copy_cap = strtoul(optarg, NULL, 0) & ~0x3;
+            if (!stack_copy_cap)
+                usage();
+            break;
+        case 'D':
+            call_site_cache_dir = strcmp(optarg, "none") ? optarg : NULL;
+            break;
+        case 'F':
+            perf_frequency = strtoul(optarg, NULL, 0);
+            if (!perf_frequency || perf_frequency > 1000000000)
+                usage();
+            break;
+        case 'f':
+            if (!add_thread_spec(&fast, optarg))
+                usage();
+            break;
+        case 'I':
+            use_io_uring = false;
+            break;
+        case 'i':
+            interval_ns = strtoull(optarg, NULL, 0) * 1000;
+            if (interval_ns < MIN_TICK_INTERVAL_NS ||
+                    interval_ns > MAX_TICK_INTERVAL_NS)
+                usage();
+            break;
+        case 'j':
+            unwind_workers = strtol(optarg, &end, 0);
+            if (*end || unwind_workers < 0 ||
+                    unwind_workers > MAX_UNWIND_WORKERS)
+                usage();
+            break;
+        case 'K':
+            kernel_stacks = true;
+            break;
+        case 'n':
+            tick_limit = strtoul(optarg, NULL, 0);
+            if (!tick_limit)
+                usage();
+            break;
         case 'o':
             out_path = optarg;
             break;
+        case 'P':
+            persistent = true;
+            break;
+        case 'p':
+            frame_pointer_modules = optarg;
+            break;
+        case 'R':
+            // Either a number of seconds or of megabytes; both can be given.
+            if (!strtoul(optarg, &end, 0))
+                usage();
+            if (!strcmp(end, "s"))
+                recorder_window_ns = strtoull(optarg, NULL, 0) * 1000000000;
+            else if (!strcmp(end, "M"))
+                recorder_mb = strtoul(optarg, NULL, 0);
+            else
+                usage();
+            break;
+        case 'r':
+            slow_ticks = strtoul(optarg, NULL, 0);
+            if (!slow_ticks)
+                usage();
+            break;
+        case 's':
+            show_stats = true;
+            break;
+        case 'T':
+            follow_children = true;
+            break;
+        case 'U':
+            raw_stacks = true;
+            break;
+        case 't':
+            if (!add_thread_spec(&include, optarg))
+                usage();
+            break;
+        case 'x':
+            if (!add_thread_spec(&exclude, optarg))
+                usage();
+            break;
+        case 'Z':
+            check_allocations = true;
+            break;
         default:
             usage();
             break;
         }
     }
 
-    if (argc - optind != 1) {
-        fprintf(stderr, "usage: piranha PID\n");
+    if (argc - optind < 1) {
+        fprintf(stderr, "usage: piranha PID...\n");
         return 1;
     }
 
+    // Anything after "--" is a command to run and profile from its start.
+    bool launching = !strcmp(argv[optind - 1], "--");
+    if (agent_library && !launching)
+        usage();
+
+    // The BPF backend's stacks are unwound in the kernel, and raw ones by
+    // piranha-unwind, which takes its own -p.
+    if ((raw_stacks || frame_pointer_modules) && backend == BACKEND_BPF)
+        usage();
+    if (raw_stacks && frame_pointer_modules)
+        usage();
+
+    // A launched command inherits the agent's sampling rate from us.
+    if (launching && backend == BACKEND_AGENT) {
+        char hz[16];
+        snprintf(hz, sizeof(hz), "%u", perf_frequency);
+        setenv(AGENT_HZ_ENV, hz, 1);
+    }
+
+    // The flight recorder only writes into memory until it dumps.
+    bool recording = recorder_mb || recorder_window_ns;
     struct ebml_writer ebml_writer;
     memset(&ebml_writer, '\0', sizeof(ebml_writer));
-    if (!(ebml_writer.f = fopen(out_path, "wb"))) {
+    if (recording) {
+        if (!(ebml_writer.buf = bfromcstralloc(RECORDER_TICK_BUF_SIZE, "")))
+            return 1;
+    } else if (!(ebml_writer.f = fopen(out_path, "wb"))) {
         perror("Couldn't open the output file");
         return 1;
     }
 
+    struct basic_info binfo;
+    memset(&binfo, '\0', sizeof(binfo));
+    binfo.proc_dir = -1;
+    binfo.control_fd = -1;
+    binfo.thread_reads.ring_fd = -1;
+    binfo.launched_pid = -1;
+    pid_t launched_pid = -1;
+    bool launched_running = false;
+
     bool ok = true;
     struct tagbstring format_name = bsStatic("piranha-samples");
-    if (!ebml_write_header(&ebml_writer, &format_name)) {
+    if (!recording && !ebml_write_header(&ebml_writer, &format_name)) {
         fprintf(stderr, "Couldn't write header\n");
+        ok = false;
         goto out;
     }
 
     // Initialize the basic info structure
-    struct basic_info binfo;
-    memset(&binfo, '\0', sizeof(binfo));
-    binfo.pid = strtol(argv[optind], NULL, 0);
-    if (!compute_thread_entry(&binfo)) {
+    binfo.persistent = persistent;
+    binfo.backend = backend;
+    binfo.perf_frequency = perf_frequency;
+    binfo.bpf.kernel_stacks = kernel_stacks;
+    binfo.unwinders.worker_count = unwind_workers;
+    binfo.stop_budget = stop_budget;
+    binfo.interval_ns = interval_ns;
+    binfo.tick_limit = tick_limit;
+    binfo.include = include;
+    binfo.exclude = exclude;
+    binfo.fast = fast;
+    binfo.slow_ticks = slow_ticks;
+    binfo.use_io_uring = use_io_uring;
+    binfo.follow_children = follow_children;
+    binfo.frame_pointer_modules = frame_pointer_modules;
+    binfo.call_site_cache_dir = call_site_cache_dir;
+    binfo.out_path = out_path;
+    binfo.recorder.window_ns = recorder_window_ns;
+    binfo.recorder.capacity = (recorder_mb ? recorder_mb :
+                               RECORDER_DEFAULT_MB) * 1024 * 1024;
+    binfo.timer_fd = -1;
+    binfo.raw_stacks = raw_stacks;
+    binfo.stack_copy_cap = stack_copy_cap;
+    if (!binfo.stack_copy_cap && raw_stacks) {
+        // Raw stacks go into the output whole, so only copy the top.
+        binfo.stack_copy_cap = DEFAULT_RAW_STACK_COPY;
+    } else if (!binfo.stack_copy_cap) {
+        binfo.stack_copy_cap = backend == BACKEND_PERF ?
+            DEFAULT_PERF_STACK_COPY : DEFAULT_STACK_COPY_CAP;
+    }
+    if (!compute_thread_entry(&binfo) || !alloc_buffers(&binfo)) {
+        ok = false;
+        goto out;
+    }
+    if (recording && !(binfo.recorder.data =
+            counted_malloc(binfo.recorder.capacity))) {
+        perror("Couldn't allocate the flight recorder");
+        ok = false;
+        goto out;
+    }
+    if (control_path &&
+            (binfo.control_fd = open_control_socket(control_path)) < 0) {
+        ok = false;
+        goto out;
+    }
+    if (backend == BACKEND_BPF && !open_bpf_sampler(&binfo)) {
+        ok = false;
+        goto out;
+    }
+    if (follow_children &&
+            (binfo.proc_dir = open("/proc", O_RDONLY | O_DIRECTORY)) < 0) {
+        perror("Failed to open /proc");
+        ok = false;
+        goto out;
+    }
+
+    if (launching) {
+        if ((launched_pid = launch(&binfo, argv + optind,
+                                   agent_library)) < 0 ||
+                !add_process(&binfo, launched_pid, true)) {
+            ok = false;
+            goto out;
+        }
+    }
+    for (int i = optind; !launching && i < argc; i++) {
+        if (!add_process(&binfo, strtol(argv[i], NULL, 0), true)) {
+            ok = false;
+            goto out;
+        }
+    }
+    if (!scan_processes(&binfo, NULL, true)) {
         ok = false;
         goto out;
     }
-    if (!open_memory(&binfo)) {
+
+    bool any_selected = binfo.backend != BACKEND_PTRACE, any_threads = false;
+    for (int i = 0; i < get_process_count(&binfo); i++) {
+        binfo.process = get_process_at(&binfo, i);
+        if (!binfo.process->threads)
+            continue;
+        any_threads = any_threads || get_thread_count(&binfo);
+        any_selected = any_selected || has_selected_threads(&binfo);
+    }
+    if (!any_selected) {
+        if (binfo.persistent && any_threads && !binfo.include.count &&
+                !binfo.exclude.count)
+            fprintf(stderr, "PTRACE_SEIZE failed (Linux 3.4 or later is "
+                    "required)\n");
+        else
+            fprintf(stderr, "No threads to sample\n");
         ok = false;
         goto out;
     }
-    if (!read_maps(binfo.pid, &binfo.maps)) {
+
+    for (int i = 0; !recording && i < get_process_count(&binfo); i++) {
+        if (!print_maps(&ebml_writer, get_process_at(&binfo, i))) {
+            ok = false;
+            goto out;
+        }
+    }
+
+    if (binfo.backend == BACKEND_PTRACE && !start_unwinders(&binfo)) {
         ok = false;
         goto out;
     }
-    print_maps(&ebml_writer, binfo.maps);
+
+    // Let the command go now that everything is in place.
+    if (launched_pid > 0)
+        launched_running = !kill(launched_pid, SIGCONT);
 
     ok = profile(&binfo, &ebml_writer);
 
+    // The targets exiting is one of the flight recorder's triggers.
+    if (ok && recording && !any_live_process(&binfo))
+        dump_recording(&binfo);
+
+    // Children that turned up while profiling get their maps written now.
+    for (int i = 0; ok && !recording && i < get_process_count(&binfo); i++) {
+        struct process *proc = get_process_at(&binfo, i);
+        if (proc->maps && !proc->maps_written)
+            ok = print_maps(&ebml_writer, proc);
+    }
+    if (ok && !recording && binfo.backend == BACKEND_PTRACE)
+        ok = print_threads(&ebml_writer, &binfo);
+
+    if (show_stats)
+        print_stats(&binfo);
+
+    // The sampling path is meant to be allocation-free once the thread
+    // tables and the unwinder's caches have filled up.
+    if (check_allocations && stats.late_allocating_ticks) {
+        fprintf(stderr, "%u ticks after the first %d allocated memory\n",
+                stats.late_allocating_ticks, ALLOCATION_WARMUP_TICKS);
+        ok = false;
+    }
+
 out:
-    bdestroy(binfo.maps);
-    close(binfo.mem);
+    for (int i = 0; binfo.processes && i < get_process_count(&binfo); i++) {
+        binfo.process = get_process_at(&binfo, i);
+        end_process(&binfo, NULL, false);
+        bdestroy(binfo.process->thread_log);
+        free_maps(binfo.process->maps);
+        bdestroy(binfo.process->regions);
+    }
+    bdestroy(binfo.processes);
+    if (binfo.backend == BACKEND_BPF)
+        close_bpf_sampler(&binfo);
+    stop_unwinders(&binfo);
+    free_thread_reads(&binfo.thread_reads);
+    free(binfo.stack_iovecs);
+    free(binfo.task_ids);
+    free(binfo.proc_ids);
+    free(binfo.perf_record_buf);
+    free(binfo.recorder.data);
+    if (binfo.proc_dir >= 0)
+        close(binfo.proc_dir);
+    if (binfo.control_fd >= 0)
+        close(binfo.control_fd);
+
+    // A command that we ran is our child, so reap it if it's done, or kill
+    // it if we failed before it could even start. One of the waits for its
+    // threads may have reaped it already.
+    int status = binfo.launched_status;
+    if (launched_pid > 0 && !launched_running)
+        kill(launched_pid, SIGKILL);
+    if (launched_pid > 0 && (binfo.launched_reaped ||
+            waitpid(launched_pid, &status, WNOHANG) > 0) &&
+            WIFEXITED(status))
+        fprintf(stderr, "Command exited with status %d\n",
+                WEXITSTATUS(status));
     ebml_finish(&ebml_writer);
     return !ok;
 }
@@ -0,0 +1,380 @@
+/*
+ * piranha/unwind-test.c
+ *
+ * Checks of the stack walker's internals, run on the host with make test.
+ * The walker is included whole so that its static functions can be called.
+ *
+ * Copyright (c) 2011 Mozilla Foundation
+ */
+
+#include "unwind.c"
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#define FUNCTION_START          0x8000
+
+static int failures = 0;
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,          \
+                    __LINE__, #cond);                                       \
+            failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+// The CFI that GCC emits for a Thumb function with an early return:
+//
+//   0x8000  push {r4, lr}
+//   0x8002  cmp r0, #0
+//   0x8004  beq 1f
+//   0x8006  pop {r4, pc}        @ the early return
+//   0x8008  1: ...              @ the body goes on with the frame in place
+//   0x8010  pop {r4, pc}
+static const uint8_t early_return_fde[] = {
+    CFA_ADVANCE_LOC | 1,                    // 0x8002
+    CFA_DEF_CFA_OFFSET, 8,
+    CFA_OFFSET | UNWIND_REG_LR, 1,          // at CFA - 4
+    CFA_OFFSET | 4, 2,                      // at CFA - 8
+    CFA_ADVANCE_LOC | 2,                    // 0x8006
+    CFA_REMEMBER_STATE,
+    CFA_DEF_CFA_OFFSET, 0,
+    CFA_RESTORE | UNWIND_REG_LR,
+    CFA_RESTORE | 4,
+    CFA_ADVANCE_LOC | 1,                    // 0x8008
+    CFA_RESTORE_STATE,
+    CFA_ADVANCE_LOC | 4,                    // 0x8010
+    CFA_DEF_CFA_OFFSET, 0,
+};
+
+// Runs the FDE's instructions up to pc, from the CIE's initial state.
+static bool run_early_return_fde(uint32_t pc, struct cfi_state *state)
+{
+    struct cfi_cie cie;
+    memset(&cie, '\0', sizeof(cie));
+    cie.code_align = 2;
+    cie.data_align = -4;
+    cie.ra_reg = UNWIND_REG_LR;
+
+    struct cfi_state initial;
+    memset(&initial, '\0', sizeof(initial));
+    initial.cfa_reg = UNWIND_REG_SP;
+
+    struct cfi_cursor c;
+    c.p = early_return_fde;
+    c.end = early_return_fde + sizeof(early_return_fde);
+    c.addr = 0;
+    c.ok = true;
+
+    *state = initial;
+    return run_cfi(&c, &cie, state, &initial, FUNCTION_START, pc);
+}
+
+static void test_mid_function_epilogue()
+{
+    struct cfi_state state;
+
+    // In the early return's epilogue, the frame is already gone.
+    CHECK(run_early_return_fde(0x8006, &state));
+    CHECK(state.cfa_reg == UNWIND_REG_SP && state.cfa_offset == 0);
+    CHECK(state.rules[UNWIND_REG_LR].type == RULE_SAME_VALUE);
+
+    // Past it, everything is as it was before, the CFA included.
+    CHECK(run_early_return_fde(0x8008, &state));
+    CHECK(state.cfa_reg == UNWIND_REG_SP && state.cfa_offset == 8);
+    CHECK(state.rules[UNWIND_REG_LR].type == RULE_OFFSET &&
+          state.rules[UNWIND_REG_LR].value == -4);
+    CHECK(state.rules[4].type == RULE_OFFSET &&
+          state.rules[4].value == -8);
+
+    CHECK(run_early_return_fde(0x800e, &state));
+    CHECK(state.cfa_offset == 8);
+    CHECK(state.rules[UNWIND_REG_LR].type == RULE_OFFSET);
+}
+
+#define STACK_START             0x10000
+#define STACK_WORDS             64
+#define STACK_WORD(i)           (0x20000 + (i) * 4)
+#define NO_REG                  -1
+
+// What run_ehabi() makes of a frame, with only the SP known to begin with
+// and STACK_WORD(i) at STACK_START + i * 4. vsp is relative to STACK_START
+// unless the SP was popped. reg, unless it's NO_REG, should come out as
+// value.
+static const struct {
+    const char *name;
+    uint8_t insns[4];
+    uint32_t count;
+    bool ok;
+    uint32_t vsp;
+    uint32_t valid;
+    int reg;
+    uint32_t value;
+} ehabi_frames[] = {
+    { "pop {r4, lr}", { 0x84, 0x01 }, 2, true, 8,
+      (1 << 4) | (1 << UNWIND_REG_LR), UNWIND_REG_LR, STACK_WORD(1) },
+    { "pop {r4-r7, pc}", { 0x88, 0x0f }, 2, true, 20,
+      (0xf << 4) | (1 << UNWIND_REG_PC), UNWIND_REG_PC, STACK_WORD(4) },
+    { "pop {r4, sp}", { 0x82, 0x01 }, 2, true, STACK_WORD(1) - STACK_START,
+      1 << 4, 4, STACK_WORD(0) },
+    { "refuse to unwind", { 0x80, 0x00 }, 2, false },
+    { "pop {r4, lr}, short", { 0xa8 }, 1, true, 8,
+      (1 << 4) | (1 << UNWIND_REG_LR), UNWIND_REG_LR, STACK_WORD(1) },
+    { "pop {r4-r7, lr}, short", { 0xab }, 1, true, 20,
+      (0xf << 4) | (1 << UNWIND_REG_LR), UNWIND_REG_LR, STACK_WORD(4) },
+    { "pop {r0, r1}", { 0xb1, 0x03 }, 2, true, 8, 0x3, 1, STACK_WORD(1) },
+    { "pop {} from 0xb1", { 0xb1, 0x00 }, 2, false },
+    { "0xb1 spare", { 0xb1, 0x10 }, 2, false },
+    { "vsp += 0x208", { 0xb2, 0x01 }, 2, true, 0x208, 0, NO_REG },
+    { "vsp += 0x408", { 0xb2, 0x81, 0x01 }, 3, true, 0x408, 0, NO_REG },
+    { "0xb2 cut short", { 0xb2, 0x81 }, 2, false },
+    { "vsp += 8, finish", { 0x01, 0xb0, 0x01 }, 3, true, 8, 0, NO_REG },
+    { "vsp -= 8", { 0x41 }, 1, true, -8, 0, NO_REG },
+    { "fldmfdx {d1-d3}", { 0xb3, 0x12 }, 2, true, 3 * 8 + 4, 0, NO_REG },
+    { "fldmfdx {d8}", { 0xb8 }, 1, true, 8 + 4, 0, NO_REG },
+    { "fldmfdx {d8-d11}", { 0xbb }, 1, true, 4 * 8 + 4, 0, NO_REG },
+    { "vpop {d16-d18}", { 0xc8, 0x02 }, 2, true, 3 * 8, 0, NO_REG },
+    { "vpop {d0-d1}", { 0xc9, 0x01 }, 2, true, 2 * 8, 0, NO_REG },
+    { "vsp = sp", { 0x9d }, 1, false },
+    { "vsp = pc", { 0x9f }, 1, false },
+    { "vsp = r7, unknown", { 0x97 }, 1, false },
+};
+
+static void test_ehabi_frames()
+{
+    uint32_t words[STACK_WORDS];
+    for (int i = 0; i < STACK_WORDS; i++)
+        words[i] = STACK_WORD(i);
+    struct stack_snapshot stack = { STACK_START, sizeof(words), words };
+
+    for (int i = 0; i < sizeof(ehabi_frames) / sizeof(ehabi_frames[0]);
+            i++) {
+        struct unwind_regs regs;
+        memset(&regs, '\0', sizeof(regs));
+        regs.r[UNWIND_REG_SP] = STACK_START;
+        regs.valid = 1 << UNWIND_REG_SP;
+
+        uint32_t vsp;
+        bool ok = run_ehabi(ehabi_frames[i].insns, ehabi_frames[i].count,
+                            &stack, &regs, &vsp);
+        uint32_t popped = regs.valid & ~(1 << UNWIND_REG_SP);
+        int reg = ehabi_frames[i].reg;
+        if (ok != ehabi_frames[i].ok || (ok &&
+                (vsp != STACK_START + ehabi_frames[i].vsp ||
+                 popped != ehabi_frames[i].valid ||
+                 (reg != NO_REG && regs.r[reg] != ehabi_frames[i].value)))) {
+            fprintf(stderr, "%s: %s, vsp %#x, popped %#x\n",
+                    ehabi_frames[i].name, ok ? "ok" : "refused", vsp,
+                    popped);
+            failures++;
+        }
+    }
+}
+
+// A module's .ARM.extab, as read_ehabi_insns() sees it.
+#define EXTAB_START             0x30000
+
+struct extab {
+    const uint32_t *words;
+    uint32_t count;
+};
+
+static bool read_extab(void *data, uint32_t addr, void *buf, uint32_t size)
+{
+    const struct extab *extab = data;
+    if (addr < EXTAB_START || (addr - EXTAB_START) / 4 + size / 4 >
+            extab->count)
+        return false;
+    memcpy(buf, &extab->words[(addr - EXTAB_START) / 4], size);
+    return true;
+}
+
+// The layouts of .ARM.exidx entries: inline, or in .ARM.extab for the
+// compact model's personality routines 1 and 2 and for the generic model.
+static const struct {
+    const char *name;
+    uint32_t insn;              // if inline
+    uint32_t extab[4];          // otherwise
+    uint32_t extab_words;
+    bool ok;
+    uint8_t insns[12];
+    uint32_t count;
+} ehabi_entries[] = {
+    { "inline, routine 0", 0x80a8b0b0, { 0 }, 0, true,
+      { 0xa8, 0xb0, 0xb0 }, 3 },
+    { "inline, routine 1", 0x8100a8b0, { 0 }, 0, false },
+    { "extab, routine 0", 0, { 0x8084b001 }, 1, true,
+      { 0x84, 0xb0, 0x01 }, 3 },
+    { "extab, routine 1", 0, { 0x8101a8b1, 0x0301b0b0 }, 2, true,
+      { 0xa8, 0xb1, 0x03, 0x01, 0xb0, 0xb0 }, 6 },
+    { "extab, routine 2", 0, { 0x8200a8b0 }, 1, true, { 0xa8, 0xb0 }, 2 },
+    { "extab, routine 3", 0, { 0x8300a8b0 }, 1, false },
+    { "extab, cut short", 0, { 0x8102a8b0, 0xb0b0b0b0 }, 2, false },
+    { "generic", 0, { 0x00001234, 0x01a8b0b0, 0x84b001b0 }, 3, true,
+      { 0xa8, 0xb0, 0xb0, 0x84, 0xb0, 0x01, 0xb0 }, 7 },
+    { "generic, too long", 0, { 0x00001234, (MAX_EHABI_WORDS + 1) << 24 },
+      2, false },
+};
+
+static void test_ehabi_entries()
+{
+    for (int i = 0; i < sizeof(ehabi_entries) / sizeof(ehabi_entries[0]);
+            i++) {
+        struct extab extab = { ehabi_entries[i].extab,
+                               ehabi_entries[i].extab_words };
+        struct unwind_source src;
+        memset(&src, '\0', sizeof(src));
+        src.read_memory = read_extab;
+        src.data = &extab;
+
+        struct exidx_entry entry;
+        entry.pc = 0x8000;
+        entry.insn = ehabi_entries[i].insn;
+        entry.extab = ehabi_entries[i].extab_words ? EXTAB_START : 0;
+
+        uint8_t insns[MAX_EHABI_INSNS];
+        uint32_t count = 0;
+        bool ok = read_ehabi_insns(&src, &entry, insns, &count);
+        if (ok != ehabi_entries[i].ok || (ok &&
+                (count != ehabi_entries[i].count ||
+                 memcmp(insns, ehabi_entries[i].insns, count)))) {
+            fprintf(stderr, "%s: %s, %u instruction bytes\n",
+                    ehabi_entries[i].name, ok ? "read" : "refused", count);
+            failures++;
+        }
+    }
+}
+
+// Whether mark_call_sites() takes the code to end in a call. ret is the
+// offset of the return address, with the Thumb bit set for Thumb code.
+static const struct {
+    const char *insn;
+    uint16_t machine;
+    uint8_t code[8];
+    uint32_t size, ret;
+    bool call;
+} call_sites[] = {
+    { "bl", EM_ARM, { 0x10, 0x00, 0x00, 0xeb }, 4, 4, true },
+    { "blx label", EM_ARM, { 0x10, 0x00, 0x00, 0xfa }, 4, 4, true },
+    { "blx label+2", EM_ARM, { 0x10, 0x00, 0x00, 0xfb }, 4, 4, true },
+    { "blx r3", EM_ARM, { 0x33, 0xff, 0x2f, 0xe1 }, 4, 4, true },
+    { "b", EM_ARM, { 0x10, 0x00, 0x00, 0xea }, 4, 4, false },
+    { "bx lr", EM_ARM, { 0x1e, 0xff, 0x2f, 0xe1 }, 4, 4, false },
+    { "thumb bl", EM_ARM, { 0x00, 0xf0, 0x00, 0xf8 }, 4, 5, true },
+    { "thumb bl, far", EM_ARM, { 0x00, 0xf4, 0x00, 0xd0 }, 4, 5, true },
+    { "thumb blx label", EM_ARM, { 0x00, 0xf0, 0x00, 0xe8 }, 4, 5, true },
+    { "thumb blx label, far", EM_ARM, { 0x00, 0xf4, 0x00, 0xc0 }, 4, 5,
+      true },
+    { "thumb nop; blx r3", EM_ARM, { 0x00, 0xbf, 0x98, 0x47 }, 4, 5, true },
+    { "thumb b.w, far", EM_ARM, { 0x00, 0xf0, 0x00, 0x90 }, 4, 5, false },
+    { "thumb blx label, odd", EM_ARM, { 0x00, 0xf4, 0x01, 0xc0 }, 4, 5,
+      false },
+    { "call rel32", EM_386, { 0xe8, 0x10, 0x00, 0x00, 0x00 }, 5, 5, true },
+    { "call *%eax", EM_386, { 0xff, 0xd0 }, 2, 2, true },
+    { "call *8(%ebx)", EM_386, { 0xff, 0x53, 0x08 }, 3, 3, true },
+    { "call *x(,%eax,4)", EM_386,
+      { 0xff, 0x14, 0x85, 0x78, 0x56, 0x34, 0x12 }, 7, 7, true },
+    { "jmp *%eax", EM_386, { 0xff, 0xe0 }, 2, 2, false },
+    { "jmp rel32", EM_386, { 0xe9, 0x10, 0x00, 0x00, 0x00 }, 5, 5, false },
+};
+
+static void test_call_site_marking()
+{
+    for (int i = 0; i < sizeof(call_sites) / sizeof(call_sites[0]); i++) {
+        uint8_t buf[CALL_SITE_LOOKBACK + sizeof(call_sites[i].code)];
+        memset(buf, '\0', sizeof(buf));
+        memcpy(buf + CALL_SITE_LOOKBACK, call_sites[i].code,
+               sizeof(call_sites[i].code));
+
+        uint32_t size = call_sites[i].size;
+        struct call_site_map *sites = calloc(1, call_site_map_size(size));
+        sites->machine = call_sites[i].machine;
+        sites->text_size = size;
+        mark_call_sites(sites, 0x10000, buf + CALL_SITE_LOOKBACK, 0, size);
+
+        uint32_t ret = call_sites[i].ret;
+        bool marked = sites->bits[ret / 8] & (1 << (ret % 8));
+        if (marked != call_sites[i].call) {
+            fprintf(stderr, "%s: %s as a call\n", call_sites[i].insn,
+                    marked ? "taken" : "not taken");
+            failures++;
+        }
+        free(sites);
+    }
+}
+
+// The call site cache is only used from a directory of our own that nobody
+// else can write to, and saving never writes through a planted link.
+static void test_call_site_cache()
+{
+    char base[] = "/tmp/unwind-test.XXXXXX";
+    if (!mkdtemp(base)) {
+        CHECK(!"mkdtemp() failed");
+        return;
+    }
+    bstring dir = bformat("%s/cache", base);
+    bstring link = bformat("%s/link", base);
+    bstring victim = bformat("%s/victim", base);
+    bstring path = bformat("%s/cache/test.callsites", base);
+
+    struct stat st;
+    CHECK(check_call_site_cache_dir((char *)dir->data));
+    CHECK(!stat((char *)dir->data, &st) && (st.st_mode & 0777) == 0700);
+
+    chmod((char *)dir->data, 0777);
+    CHECK(!check_call_site_cache_dir((char *)dir->data));
+    chmod((char *)dir->data, 0700);
+    CHECK(!symlink((char *)dir->data, (char *)link->data));
+    CHECK(!check_call_site_cache_dir((char *)link->data));
+
+    struct unwind_tables tables;
+    memset(&tables, '\0', sizeof(tables));
+    tables.machine = EM_ARM;
+    tables.text_offset = 0x1000;
+    tables.text_size = 64;
+    uint32_t size = call_site_map_size(tables.text_size);
+    struct call_site_map *sites = calloc(1, size);
+    sites->machine = tables.machine;
+    sites->text_offset = tables.text_offset;
+    sites->text_size = tables.text_size;
+    sites->bits[1] = 0x5a;
+
+    // A link where the map is to go is replaced, not written through.
+    FILE *f = fopen((char *)victim->data, "w");
+    CHECK(f && fputs("victim", f) >= 0 && !fclose(f));
+    CHECK(!symlink((char *)victim->data, (char *)path->data));
+    save_call_sites((char *)path->data, sites);
+    CHECK(!stat((char *)victim->data, &st) && st.st_size == 6);
+    CHECK(!lstat((char *)path->data, &st) && S_ISREG(st.st_mode) &&
+          (st.st_mode & 077) == 0);
+
+    struct call_site_map *loaded = load_call_sites((char *)path->data,
+                                                   &tables);
+    CHECK(loaded && !memcmp(loaded, sites, size));
+
+    free(loaded);
+    free(sites);
+    unlink((char *)path->data);
+    unlink((char *)victim->data);
+    unlink((char *)link->data);
+    rmdir((char *)dir->data);
+    rmdir(base);
+    bdestroy(dir);
+    bdestroy(link);
+    bdestroy(victim);
+    bdestroy(path);
+}
+
+int main()
+{
+    test_mid_function_epilogue();
+    test_ehabi_frames();
+    test_ehabi_entries();
+    test_call_site_marking();
+    test_call_site_cache();
+    if (failures)
+        fprintf(stderr, "unwind-test: %d checks failed\n", failures);
+    return !!failures;
+}
@@ -0,0 +1,1636 @@
+/*
+ * piranha/unwind.c
+ *
+ * Stack walking, by frame pointers or DWARF CFI or ARM EHABI tables where
+ * the modules have them and otherwise by scanning for plausible return
+ * addresses
+ *
+ * Copyright (c) 2011 Mozilla Foundation
+ */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bstrlib.h"
+#include "unwind.h"
+
+// piranha counts allocations to check that sampling doesn't make any, and
+// loading a module's tables in the middle of a tick would.
+#ifdef PIRANHA_COUNT_ALLOCS
+#include "memdbg.h"
+#define unwind_malloc(size)     counted_malloc(size)
+#define unwind_calloc(n, size)  counted_calloc((n), (size))
+#else
+#define unwind_malloc(size)     malloc(size)
+#define unwind_calloc(n, size)  calloc((n), (size))
+#endif
+
+#ifndef PT_GNU_EH_FRAME
+#define PT_GNU_EH_FRAME         0x6474e550
+#endif
+#ifndef PT_ARM_EXIDX
+#define PT_ARM_EXIDX            0x70000001
+#endif
+
+#define MAX_PROGRAM_HEADERS     64
+#define MAX_CFI_ENTRIES         (1 << 20)   // per module
+#define MAX_CFI_RECORD_SIZE     1024        // CIE or FDE, less the length
+#define CFI_STATE_STACK_SIZE    8           // for DW_CFA_remember_state
+#define MAX_EHABI_WORDS         16          // of instructions, past the first
+#define MAX_EHABI_INSNS         (3 + MAX_EHABI_WORDS * 4)
+
+#define EXIDX_CANTUNWIND        0x1
+
+#define LR_CACHE_PROBES         8
+
+#define CALL_SITE_MAGIC         0x53435050  // "PPCS"
+#define CALL_SITE_CHUNK_SIZE    65536       // of code read at a time
+#define CALL_SITE_LOOKBACK      8           // longest call, and then some
+
+// What the instruction before a possible return address is.
+#define LR_UNKNOWN              0   // in the cache: not looked at yet
+#define LR_NOT_CALL_SITE        1
+#define LR_CALL_SITE            2
+#define LR_UNREADABLE           3   // never cached
+
+// DWARF pointer encodings (DW_EH_PE_*).
+#define PE_OMIT                 0xff
+#define PE_ABSPTR               0x00
+#define PE_ULEB128              0x01
+#define PE_UDATA2               0x02
+#define PE_UDATA4               0x03
+#define PE_UDATA8               0x04
+#define PE_SLEB128              0x09
+#define PE_SDATA2               0x0a
+#define PE_SDATA4               0x0b
+#define PE_SDATA8               0x0c
+#define PE_PCREL                0x10
+#define PE_DATAREL              0x30
+#define PE_INDIRECT             0x80
+
+// Call frame instructions (DW_CFA_*). The first three keep an operand in
+// their low six bits.
+#define CFA_ADVANCE_LOC         0x40
+#define CFA_OFFSET              0x80
+#define CFA_RESTORE             0xc0
+#define CFA_NOP                 0x00
+#define CFA_SET_LOC             0x01
+#define CFA_ADVANCE_LOC1        0x02
+#define CFA_ADVANCE_LOC2        0x03
+#define CFA_ADVANCE_LOC4        0x04
+#define CFA_OFFSET_EXTENDED     0x05
+#define CFA_RESTORE_EXTENDED    0x06
+#define CFA_UNDEFINED           0x07
+#define CFA_SAME_VALUE          0x08
+#define CFA_REGISTER            0x09
+#define CFA_REMEMBER_STATE      0x0a
+#define CFA_RESTORE_STATE       0x0b
+#define CFA_DEF_CFA             0x0c
+#define CFA_DEF_CFA_REGISTER    0x0d
+#define CFA_DEF_CFA_OFFSET      0x0e
+#define CFA_DEF_CFA_EXPRESSION  0x0f
+#define CFA_EXPRESSION          0x10
+#define CFA_OFFSET_EXTENDED_SF  0x11
+#define CFA_DEF_CFA_SF          0x12
+#define CFA_DEF_CFA_OFFSET_SF   0x13
+#define CFA_VAL_OFFSET          0x14
+#define CFA_VAL_OFFSET_SF       0x15
+#define CFA_VAL_EXPRESSION      0x16
+#define CFA_GNU_ARGS_SIZE       0x2e
+#define CFA_GNU_NEGATIVE_OFFSET_EXTENDED 0x2f
+
+// How to get a register's value in the caller.
+#define RULE_SAME_VALUE         0
+#define RULE_UNDEFINED          1
+#define RULE_OFFSET             2   // saved at CFA + offset
+#define RULE_VAL_OFFSET         3   // is CFA + offset
+#define RULE_REGISTER           4   // is in another register
+#define RULE_UNSUPPORTED        5   // a DWARF expression
+
+// What a step through the unwind tables came to.
+#define STEP_NONE               0   // no entry for the frame, or it was bad
+#define STEP_DONE               1
+#define STEP_END                2   // the outermost frame
+
+struct cfi_rule {
+    uint8_t type;
+    int32_t value;
+};
+
+struct cfi_state {
+    uint32_t cfa_reg;
+    int32_t cfa_offset;
+    bool cfa_unsupported;
+    struct cfi_rule rules[UNWIND_REG_COUNT];
+};
+
+// A CIE or FDE read out of the target, and where we are in it.
+struct cfi_cursor {
+    const uint8_t *p;
+    const uint8_t *end;
+    uint32_t addr;      // target address of p
+    bool ok;
+};
+
+struct cfi_cie {
+    uint32_t code_align;
+    int32_t data_align;
+    uint32_t ra_reg;
+    uint8_t fde_encoding;
+    bool augmented;     // 'z'
+    uint8_t buf[MAX_CFI_RECORD_SIZE];
+    struct cfi_cursor insns;
+};
+
+static int compare_addr_and_map(const void *addr_p, const void *map_p)
+{
+    const uint32_t *addr = addr_p;
+    const struct map *map = map_p;
+    if (*addr < map->start)
+        return -1;
+    if (*addr >= map->end)
+        return 1;
+    return 0;
+}
+
+struct map *get_map_for_addr(bstring maps, uint32_t addr)
+{
+    return (struct map *)bsearch(&addr, maps->data, maps->slen /
+        sizeof(struct map), sizeof(struct map), compare_addr_and_map);
+}
+
+static bool read_word(const struct unwind_source *src, uint32_t addr,
+                      uint32_t *out)
+{
+    return src->read_memory(src->data, addr, out, sizeof(*out));
+}
+
+// Grabs a word from the stack snapshot.
+static bool peek(const struct stack_snapshot *stack, uint32_t addr,
+                 uint32_t *out)
+{
+    if (addr < stack->sp || addr - stack->sp >= stack->size)
+        return false;
+    *out = stack->words[(addr - stack->sp) / 4];
+    return true;
+}
+
+//
+// Call site maps
+//
+
+static uint32_t read_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t read_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+// Whether an instruction is a call, for check_call_site() and the call site
+// maps.
+static bool is_arm_call(uint32_t insn)
+{
+    return (insn & 0x0f000000) == 0x0b000000 ||         // bl, blx label (H=1)
+        (insn & 0xfe000000) == 0xfa000000 ||            // blx label
+        (insn & 0x0ffffff0) == 0x012fff30;              // blx Rm
+}
+
+// Thumb-2 puts J1 and J2 in bits 13 and 11 of the second halfword of bl and
+// blx label. They're both 1 in Thumb-1 and within 4MB.
+static bool is_thumb_call(uint16_t upper, uint16_t lower)
+{
+    return (lower & 0xff07) == 0x4700 ||                // b(l)x Rm
+        (lower & 0xf801) == 0xe800 ||                   // blx label
+        ((upper & 0xf800) == 0xf000 &&
+         ((lower & 0xd000) == 0xd000 ||                 // bl
+          (lower & 0xd001) == 0xc000));                 // blx label
+}
+
+// The length of an x86 ModRM byte and what follows it: a SIB byte and a
+// displacement.
+static uint32_t x86_modrm_length(const uint8_t *modrm)
+{
+    uint8_t mod = modrm[0] >> 6, rm = modrm[0] & 0x7;
+    uint32_t length = 1;
+    if (mod != 3 && rm == 4) {
+        length++;
+        if (mod == 0 && (modrm[1] & 0x7) == 5)
+            length += 4;
+    }
+    if (mod == 0 && rm == 5)
+        length += 4;
+    else if (mod == 1)
+        length += 1;
+    else if (mod == 2)
+        length += 4;
+    return length;
+}
+
+// Whether the code before p ends in a call: "call rel32" or "call r/m32".
+static bool is_x86_call(const uint8_t *p)
+{
+    if (p[-5] == 0xe8)
+        return true;
+    for (uint32_t length = 2; length <= 7; length++) {
+        const uint8_t *insn = p - length;
+        if (insn[0] == 0xff && ((insn[1] >> 3) & 0x7) == 2 &&
+                x86_modrm_length(insn + 1) + 1 == length)
+            return true;
+    }
+    return false;
+}
+
+// Marks the return addresses in a chunk of text. chunk[0] is the byte at
+// offset pos, and the CALL_SITE_LOOKBACK bytes before it are there too.
+static void mark_call_sites(struct call_site_map *sites, uint32_t text_start,
+                            const uint8_t *chunk, uint32_t pos, uint32_t n)
+{
+    for (uint32_t i = 1; i <= n; i++) {
+        const uint8_t *p = chunk + i;
+        uint32_t offset = pos + i, addr = text_start + offset;
+        if (sites->machine == EM_386) {
+            if (is_x86_call(p))
+                sites->bits[offset / 8] |= 1 << (offset % 8);
+            continue;
+        }
+
+        if (addr & 0x1)
+            continue;
+        if (!(addr & 0x3) && is_arm_call(read_le32(p - 4)))
+            sites->bits[offset / 8] |= 1 << (offset % 8);
+        if (is_thumb_call(read_le16(p - 4), read_le16(p - 2)))
+            sites->bits[(offset + 1) / 8] |= 1 << ((offset + 1) % 8);
+    }
+}
+
+// Reads part of the module's code from its file if fd isn't -1, and from
+// the process otherwise. What's past the end of the file reads as zeros.
+static bool read_text(const struct unwind_source *src,
+                      const struct unwind_tables *tables, int fd,
+                      uint32_t offset, uint8_t *buf, uint32_t size)
+{
+    if (fd < 0) {
+        return src->read_memory(src->data, tables->text_start + offset, buf,
+                                size);
+    }
+    ssize_t n = pread(fd, buf, size, tables->text_offset + offset);
+    if (n < 0)
+        return false;
+    memset(buf + n, '\0', size - n);
+    return true;
+}
+
+static uint32_t call_site_map_size(uint32_t text_size)
+{
+    // Room for the Thumb bit of a return address at the very end.
+    return sizeof(struct call_site_map) + (text_size + 2 + 7) / 8;
+}
+
+// Builds the call site map by going through the module's code a chunk at a
+// time.
+static struct call_site_map *scan_call_sites(
+        const struct unwind_source *src, const struct unwind_tables *tables,
+        int fd)
+{
+    struct call_site_map *sites = unwind_calloc(1,
+        call_site_map_size(tables->text_size));
+    uint8_t *buf = unwind_malloc(CALL_SITE_LOOKBACK + CALL_SITE_CHUNK_SIZE);
+    if (!sites || !buf) {
+        free(sites);
+        free(buf);
+        return NULL;
+    }
+    sites->machine = tables->machine;
+    sites->text_offset = tables->text_offset;
+    sites->text_size = tables->text_size;
+
+    uint8_t *chunk = buf + CALL_SITE_LOOKBACK;
+    memset(buf, '\0', CALL_SITE_LOOKBACK);
+    for (uint32_t pos = 0; pos < tables->text_size;
+            pos += CALL_SITE_CHUNK_SIZE) {
+        uint32_t n = tables->text_size - pos;
+        if (n > CALL_SITE_CHUNK_SIZE)
+            n = CALL_SITE_CHUNK_SIZE;
+        uint32_t back = pos ? CALL_SITE_LOOKBACK : 0;
+        if (!read_text(src, tables, fd, pos - back, chunk - back, back + n)) {
+            free(sites);
+            sites = NULL;
+            break;
+        }
+        mark_call_sites(sites, tables->text_start, chunk, pos, n);
+    }
+    free(buf);
+    return sites;
+}
+
+// Creates the cache directory if it isn't there, and says whether it's safe
+// to use: a directory of our own that nobody else can write to. piranha
+// usually runs as root, and the default directory is under /data/local/tmp,
+// where anyone could have planted it with maps or links of their making.
+static bool check_call_site_cache_dir(const char *dir)
+{
+    struct stat st;
+    mkdir(dir, 0700);
+    return !lstat(dir, &st) && S_ISDIR(st.st_mode) &&
+        st.st_uid == geteuid() && !(st.st_mode & 022);
+}
+
+// Reads a call site map that an earlier run saved, if it's for the same
+// code.
+static struct call_site_map *load_call_sites(
+        const char *path, const struct unwind_tables *tables)
+{
+    int fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0)
+        return NULL;
+
+    uint32_t magic;
+    uint32_t size = call_site_map_size(tables->text_size);
+    struct call_site_map *sites = unwind_malloc(size);
+    if (!sites || read(fd, &magic, sizeof(magic)) != sizeof(magic) ||
+            magic != CALL_SITE_MAGIC || read(fd, sites, size) != size ||
+            sites->machine != tables->machine ||
+            sites->text_offset != tables->text_offset ||
+            sites->text_size != tables->text_size) {
+        free(sites);
+        sites = NULL;
+    }
+    close(fd);
+    return sites;
+}
+
+// Saves a call site map for later runs. It's written to a new file of its
+// own first so that no run ever reads half of one.
+static void save_call_sites(const char *path,
+                            const struct call_site_map *sites)
+{
+    bstring tmp_path = bformat("%s.XXXXXX", path);
+    if (!tmp_path)
+        return;
+
+    uint32_t magic = CALL_SITE_MAGIC;
+    uint32_t size = call_site_map_size(sites->text_size);
+    int fd = mkstemp((char *)tmp_path->data);
+    if (fd < 0) {
+        bdestroy(tmp_path);
+        return;
+    }
+    bool ok = write(fd, &magic, sizeof(magic)) == sizeof(magic) &&
+        write(fd, sites, size) == size;
+    if (close(fd))
+        ok = false;
+    if (!ok || rename((char *)tmp_path->data, path))
+        unlink((char *)tmp_path->data);
+    bdestroy(tmp_path);
+}
+
+// Gets the call site map of the module that map belongs to, from the cache
+// directory or by scanning its code. Files are identified by device, inode,
+// size and modification time. Ashmem and deleted files are read from the
+// process, and never cached.
+static struct call_site_map *build_call_sites(const struct unwind_source *src,
+                                              const struct map *map)
+{
+    struct tagbstring dev_prefix = bsStatic("/dev/");
+    struct unwind_tables *tables = map->tables;
+    int fd = -1;
+    struct stat st;
+    if (src->local_files && binstr(map->name, 0, &dev_prefix) != 0) {
+        fd = open((char *)map->name->data, O_RDONLY);
+        if (fd >= 0 && (fstat(fd, &st) || !S_ISREG(st.st_mode))) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    bstring path = NULL;
+    if (fd >= 0 && src->call_site_cache_dir &&
+            check_call_site_cache_dir(src->call_site_cache_dir)) {
+        path = bformat("%s/%llx-%llx-%llx-%llx.callsites",
+                       src->call_site_cache_dir,
+                       (unsigned long long)st.st_dev,
+                       (unsigned long long)st.st_ino,
+                       (unsigned long long)st.st_size,
+                       (unsigned long long)st.st_mtime);
+    }
+
+    struct call_site_map *sites = NULL;
+    if (path && (sites = load_call_sites((char *)path->data, tables))) {
+        if (src->stats)
+            __sync_fetch_and_add(&src->stats->call_site_maps_loaded, 1);
+    } else if ((sites = scan_call_sites(src, tables, fd))) {
+        if (src->stats)
+            __sync_fetch_and_add(&src->stats->call_site_maps_built, 1);
+        if (path)
+            save_call_sites((char *)path->data, sites);
+    }
+
+    bdestroy(path);
+    if (fd >= 0)
+        close(fd);
+    return sites;
+}
+
+// Looks maybe_lr up in the call site map of the module it's in, building
+// the map the first time. Whoever claims the map builds it; other unwinders
+// carry on without it in the meantime. Returns false if there's no map or
+// the address isn't in it.
+static bool test_call_site(const struct unwind_source *src,
+                           const struct map *map, uint32_t maybe_lr,
+                           bool *is_call_site)
+{
+    struct unwind_tables *tables = map->tables;
+    if (!tables || !tables->text_size)
+        return false;
+
+    struct call_site_map *sites = tables->call_sites;
+    if (!sites) {
+        if (!__sync_bool_compare_and_swap(&tables->call_sites_claimed, 0, 1))
+            return false;
+        sites = build_call_sites(src, map);
+        __sync_synchronize();
+        tables->call_sites = sites;
+        if (!sites)
+            return false;
+    }
+
+    bool x86 = sites->machine == EM_386;
+    uint32_t offset = (x86 ? maybe_lr : maybe_lr & ~1) - tables->text_start;
+    if (!offset || offset > sites->text_size)
+        return false;
+    uint32_t bit = offset + (x86 ? 0 : maybe_lr & 0x1);
+    *is_call_site = sites->bits[bit / 8] & (1 << (bit % 8));
+    if (src->stats)
+        __sync_fetch_and_add(&src->stats->call_site_tests, 1);
+    return true;
+}
+
+//
+// Return address checks
+//
+
+// Decodes the instruction before a possible return address to see whether
+// it's a call. maybe_lr isn't misaligned.
+static int check_call_site(const struct unwind_source *src, uint32_t maybe_lr)
+{
+    bool thumb = maybe_lr & 0x1;
+    if (thumb)
+        maybe_lr--;
+
+    // Read the memory that that stack value is pointing at.
+    uint32_t maybe_bl_ptr = maybe_lr - 4;
+    uint32_t maybe_bl;
+    if (!thumb) {
+        if (!read_word(src, maybe_bl_ptr, &maybe_bl))
+            return LR_UNREADABLE;
+
+#ifdef DEBUG_STACK_WALKING
+        printf(" /* maybe_bl %08x */", maybe_bl);
+#endif
+
+        // Does it immediately follow a "bl" or "blx" instruction?
+        return is_arm_call(maybe_bl) ? LR_CALL_SITE : LR_NOT_CALL_SITE;
+    }
+
+    // We're in Thumb mode. Word alignment makes this annoying.
+    uint16_t maybe_bl_upper, maybe_bl_lower;
+    if ((maybe_bl_ptr & 0x3) == 0) {
+        if (!read_word(src, maybe_bl_ptr, &maybe_bl))
+            return LR_UNREADABLE;
+
+        maybe_bl_upper = maybe_bl & 0xffff;
+        maybe_bl_lower = maybe_bl >> 16;
+    } else {
+        assert((maybe_bl_ptr & 0x3) == 0x2);
+
+        if (!read_word(src, maybe_bl_ptr - 2, &maybe_bl))
+            return LR_UNREADABLE;
+        maybe_bl_upper = maybe_bl >> 16;
+
+        if (!read_word(src, maybe_bl_ptr + 2, &maybe_bl))
+            return LR_UNREADABLE;
+        maybe_bl_lower = maybe_bl & 0xffff;
+    }
+
+    // Does it immediately follow a "bl" or "blx" instruction?
+    return is_thumb_call(maybe_bl_upper, maybe_bl_lower) ? LR_CALL_SITE :
+        LR_NOT_CALL_SITE;
+}
+
+// Finds maybe_lr's slot in the return address cache, claiming an empty one
+// for it if need be. Returns NULL if the cache is too full around it.
+static uint8_t *find_lr_cache_slot(struct lr_cache *cache, uint32_t maybe_lr)
+{
+    uint32_t hash = (maybe_lr * 2654435761u) >> (32 - LR_CACHE_BITS);
+    for (uint32_t i = 0; i < LR_CACHE_PROBES; i++) {
+        uint32_t index = (hash + i) & (LR_CACHE_SIZE - 1);
+        uint32_t key = cache->keys[index];
+        if (!key && __sync_bool_compare_and_swap(&cache->keys[index], 0,
+                                                 maybe_lr))
+            return &cache->results[index];
+        if (cache->keys[index] == maybe_lr)
+            return &cache->results[index];
+    }
+    return NULL;
+}
+
+// Code doesn't change, so whether an address follows a call is worked out
+// once for the whole module, or remembered for as long as the module stays
+// mapped where that can't be done. Cached results are filled in after the
+// key, so a slot whose result is still LR_UNKNOWN is a miss.
+static bool guess_lr_legitimacy(const struct unwind_source *src,
+                                uint32_t maybe_lr, uint32_t *real_lr)
+{
+    bool is_call_site;
+    struct map *map = get_map_for_addr(src->maps, (maybe_lr & ~1) - 1);
+    if (map && test_call_site(src, map, maybe_lr, &is_call_site)) {
+        if (is_call_site)
+            *real_lr = map->tables->machine == EM_386 ? maybe_lr :
+                maybe_lr & ~1;
+        return is_call_site;
+    }
+
+    // A non-word-aligned pointer can't possibly be the value of the saved link
+    // register in ARM mode.
+    if ((maybe_lr & 0x3) == 0x2 || !maybe_lr)
+        return false;
+
+    map = get_map_for_addr(src->maps, (maybe_lr & ~1) - 4);
+    uint8_t *slot = NULL;
+    if (map && map->tables)
+        slot = find_lr_cache_slot(&map->tables->lr_cache, maybe_lr);
+
+    int result = slot ? *(volatile uint8_t *)slot : LR_UNKNOWN;
+    if (result != LR_UNKNOWN && src->stats) {
+        // A hit saves the one or two reads of the instruction.
+        bool straddles = (maybe_lr & 0x3) == 0x3;
+        __sync_fetch_and_add(&src->stats->lr_cache_hits, 1);
+        __sync_fetch_and_add(&src->stats->lr_cache_saved_reads,
+                             straddles ? 2 : 1);
+    } else if (result == LR_UNKNOWN) {
+        result = check_call_site(src, maybe_lr);
+        if (slot && result != LR_UNREADABLE)
+            *(volatile uint8_t *)slot = result;
+        if (src->stats)
+            __sync_fetch_and_add(&src->stats->lr_cache_misses, 1);
+    }
+
+    if (result != LR_CALL_SITE)
+        return false;
+    *real_lr = maybe_lr & ~1;
+    return true;
+}
+
+static bool in_thread_entry(const struct unwind_source *src, struct map *map,
+                            uint32_t pc)
+{
+    struct tagbstring libc_so = bsStatic("libc.so");
+    if (!map || binstr(map->name, 0, &libc_so) == BSTR_ERR)
+        return false;
+    uint32_t rel_pc = pc - map->start + map->offset;
+    return rel_pc >= src->thread_entry_offset &&
+        rel_pc < src->thread_entry_offset + THREAD_ENTRY_LENGTH;
+}
+
+// Scans the stack upwards from *sp for the next plausible return address and
+// puts it in *lr, or zero if there isn't one.
+static void scan_for_lr(const struct unwind_source *src,
+                        const struct stack_snapshot *stack, uint32_t *sp,
+                        uint32_t *lr)
+{
+    uint32_t maybe_lr;
+    do {
+        if (!peek(stack, *sp, &maybe_lr)) {
+            // Reached the end of the stack.
+            *lr = 0;
+            return;
+        }
+
+        *sp += 4;
+    } while (!guess_lr_legitimacy(src, maybe_lr, lr));
+}
+
+//
+// Unwind tables
+//
+
+// Reads .eh_frame_hdr's search table into tables.
+static bool read_cfi_index(const struct unwind_source *src, uint32_t hdr,
+                           struct unwind_tables *tables)
+{
+    // Only the usual encodings are supported: version 1, and a table of
+    // 32-bit offsets from the start of the header.
+    uint8_t header[12];
+    if (!src->read_memory(src->data, hdr, header, sizeof(header)) ||
+            header[0] != 1 ||
+            (header[1] != (PE_PCREL | PE_SDATA4) &&
+             header[1] != PE_UDATA4 && header[1] != PE_SDATA4) ||
+            header[2] != PE_UDATA4 || header[3] != (PE_DATAREL | PE_SDATA4))
+        return false;
+
+    uint32_t count = header[8] | (header[9] << 8) | (header[10] << 16) |
+        ((uint32_t)header[11] << 24);
+    if (!count || count > MAX_CFI_ENTRIES)
+        return false;
+
+    struct cfi_entry *entries =
+        unwind_malloc(count * sizeof(struct cfi_entry));
+    if (!entries)
+        return false;
+    if (!src->read_memory(src->data, hdr + sizeof(header), entries,
+                          count * sizeof(struct cfi_entry))) {
+        free(entries);
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        entries[i].pc += hdr;
+        entries[i].fde += hdr;
+    }
+    tables->cfi = entries;
+    tables->cfi_count = count;
+    return true;
+}
+
+// Resolves a 31-bit place-relative offset, as EHABI tables use.
+static uint32_t prel31(uint32_t addr, uint32_t word)
+{
+    return addr + (uint32_t)((int32_t)(word << 1) >> 1);
+}
+
+// Reads the .ARM.exidx at addr into tables.
+static bool read_exidx(const struct unwind_source *src, uint32_t addr,
+                       uint32_t size, struct unwind_tables *tables)
+{
+    uint32_t count = size / 8;
+    if (!count || count > MAX_CFI_ENTRIES)
+        return false;
+
+    uint32_t *raw = unwind_malloc(count * 8);
+    struct exidx_entry *entries = unwind_malloc(count * sizeof(*entries));
+    if (!raw || !entries ||
+            !src->read_memory(src->data, addr, raw, count * 8)) {
+        free(raw);
+        free(entries);
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t entry_addr = addr + i * 8, data = raw[i * 2 + 1];
+        entries[i].pc = prel31(entry_addr, raw[i * 2]);
+        entries[i].insn = data;
+        entries[i].extab = 0;
+        if (data != EXIDX_CANTUNWIND && !(data & 0x80000000)) {
+            entries[i].insn = 0;
+            entries[i].extab = prel31(entry_addr + 4, data);
+        }
+    }
+    free(raw);
+    tables->exidx = entries;
+    tables->exidx_count = count;
+    return true;
+}
+
+static void free_tables(struct unwind_tables *tables)
+{
+    free(tables->cfi);
+    free(tables->exidx);
+    free(tables->call_sites);
+    free(tables);
+}
+
+// Reads the ELF headers of the module mapped at map and finds its
+// .eh_frame_hdr and .ARM.exidx, if it has them, and its code.
+static struct unwind_tables *load_tables(const struct unwind_source *src,
+                                         const struct map *map)
+{
+    Elf32_Ehdr ehdr;
+    if (!src->read_memory(src->data, map->start, &ehdr, sizeof(ehdr)) ||
+            memcmp(ehdr.e_ident, ELFMAG, SELFMAG) ||
+            ehdr.e_ident[EI_CLASS] != ELFCLASS32 ||
+            ehdr.e_phentsize != sizeof(Elf32_Phdr) ||
+            ehdr.e_phnum > MAX_PROGRAM_HEADERS)
+        return NULL;
+
+    Elf32_Phdr phdrs[MAX_PROGRAM_HEADERS];
+    if (!src->read_memory(src->data, map->start + ehdr.e_phoff, phdrs,
+                          ehdr.e_phnum * sizeof(Elf32_Phdr)))
+        return NULL;
+
+    // The mapping at file offset zero tells us where the module was loaded.
+    uint32_t bias = map->start;
+    for (int i = 0; i < ehdr.e_phnum; i++) {
+        if (phdrs[i].p_type == PT_LOAD && phdrs[i].p_offset == 0)
+            bias = map->start - (phdrs[i].p_vaddr & ~0xfff);
+    }
+
+    struct unwind_tables *tables = unwind_calloc(1, sizeof(*tables));
+    if (!tables)
+        return NULL;
+    tables->machine = ehdr.e_machine;
+    for (int i = 0; i < ehdr.e_phnum; i++) {
+        if (phdrs[i].p_type == PT_LOAD && (phdrs[i].p_flags & PF_X) &&
+                !tables->text_size &&
+                (ehdr.e_machine == EM_ARM || ehdr.e_machine == EM_386)) {
+            tables->text_start = bias + phdrs[i].p_vaddr;
+            tables->text_offset = phdrs[i].p_offset;
+            tables->text_size = phdrs[i].p_filesz;
+        }
+        if (phdrs[i].p_type == PT_GNU_EH_FRAME && !tables->cfi)
+            read_cfi_index(src, bias + phdrs[i].p_vaddr, tables);
+        else if (phdrs[i].p_type == PT_ARM_EXIDX && !tables->exidx)
+            read_exidx(src, bias + phdrs[i].p_vaddr, phdrs[i].p_memsz,
+                       tables);
+    }
+    return tables;
+}
+
+static void attach_tables(bstring maps, int index,
+                          struct unwind_tables *tables)
+{
+    struct map *all = (struct map *)maps->data;
+    int count = maps->slen / sizeof(struct map);
+    for (int i = index; i < count; i++) {
+        if (i != index && biseq(all[i].name, all[index].name) != 1)
+            break;
+        if (!all[i].tables) {
+            all[i].tables = tables;
+            tables->refs++;
+        }
+    }
+}
+
+void load_unwind_tables(const struct unwind_source *src, bstring old_maps)
+{
+    struct map *maps = (struct map *)src->maps->data;
+    int count = src->maps->slen / sizeof(struct map);
+    for (int i = 0; i < count; i++) {
+        // The ELF header is at the start of the module's first mapping.
+        if (maps[i].tables || maps[i].offset || !maps[i].name->slen ||
+                maps[i].name->data[0] != '/')
+            continue;
+
+        struct unwind_tables *tables = NULL;
+        struct map *old = old_maps ? get_map_for_addr(old_maps,
+                                                      maps[i].start) : NULL;
+        if (old && old->start == maps[i].start && !old->offset &&
+                biseq(old->name, maps[i].name) == 1)
+            tables = old->tables;
+        else
+            tables = load_tables(src, &maps[i]);
+        if (tables)
+            attach_tables(src->maps, i, tables);
+    }
+}
+
+void release_unwind_tables(bstring maps)
+{
+    struct map *all = (struct map *)maps->data;
+    int count = maps->slen / sizeof(struct map);
+    for (int i = 0; i < count; i++) {
+        if (all[i].tables && !--all[i].tables->refs)
+            free_tables(all[i].tables);
+        all[i].tables = NULL;
+    }
+}
+
+void mark_frame_pointer_modules(bstring maps, const char *modules)
+{
+    struct map *all = (struct map *)maps->data;
+    int count = maps->slen / sizeof(struct map);
+    for (int i = 0; i < count; i++) {
+        all[i].frame_pointers = false;
+        if (!modules || !all[i].name->slen)
+            continue;
+        if (!strcmp(modules, "all")) {
+            all[i].frame_pointers = true;
+            continue;
+        }
+
+        const char *path = (const char *)all[i].name->data;
+        const char *name = strrchr(path, '/');
+        name = name ? name + 1 : path;
+        size_t length = strlen(name);
+        for (const char *p = modules; *p; p += strcspn(p, ",")) {
+            p += *p == ',';
+            if (!strncmp(p, name, length) &&
+                    (p[length] == ',' || !p[length]))
+                all[i].frame_pointers = true;
+        }
+    }
+}
+
+//
+// CFI
+//
+
+static uint8_t cfi_u8(struct cfi_cursor *c)
+{
+    if (c->p >= c->end) {
+        c->ok = false;
+        return 0;
+    }
+    c->addr++;
+    return *c->p++;
+}
+
+// The target is little-endian.
+static uint32_t cfi_uint(struct cfi_cursor *c, int size)
+{
+    uint32_t val = 0;
+    for (int i = 0; i < size; i++) {
+        uint32_t byte = cfi_u8(c);
+        if (i < 4)
+            val |= byte << (i * 8);
+    }
+    return val;
+}
+
+static uint32_t cfi_uleb128(struct cfi_cursor *c)
+{
+    uint32_t val = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+        byte = cfi_u8(c);
+        if (shift < 32)
+            val |= (uint32_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (c->ok && (byte & 0x80));
+    return val;
+}
+
+static int32_t cfi_sleb128(struct cfi_cursor *c)
+{
+    uint32_t val = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+        byte = cfi_u8(c);
+        if (shift < 32)
+            val |= (uint32_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (c->ok && (byte & 0x80));
+    if (shift < 32 && (byte & 0x40))
+        val |= ~0u << shift;
+    return (int32_t)val;
+}
+
+static void skip_cfi(struct cfi_cursor *c, uint32_t size)
+{
+    if (size > c->end - c->p) {
+        c->ok = false;
+        return;
+    }
+    c->p += size;
+    c->addr += size;
+}
+
+// Reads a pointer in the given DW_EH_PE_* encoding.
+static uint32_t cfi_pointer(struct cfi_cursor *c, uint8_t encoding)
+{
+    if (encoding == PE_OMIT)
+        return 0;
+
+    uint32_t base = c->addr, val;
+    switch (encoding & 0x0f) {
+    case PE_ABSPTR:
+    case PE_UDATA4:
+    case PE_SDATA4:
+        val = cfi_uint(c, 4);
+        break;
+    case PE_UDATA2:
+        val = cfi_uint(c, 2);
+        break;
+    case PE_SDATA2:
+        val = (int16_t)cfi_uint(c, 2);
+        break;
+    case PE_UDATA8:
+    case PE_SDATA8:
+        val = cfi_uint(c, 8);
+        break;
+    case PE_ULEB128:
+        val = cfi_uleb128(c);
+        break;
+    case PE_SLEB128:
+        val = cfi_sleb128(c);
+        break;
+    default:
+        c->ok = false;
+        return 0;
+    }
+
+    switch (encoding & 0x70) {
+    case 0:
+        break;
+    case PE_PCREL:
+        val += base;
+        break;
+    default:
+        c->ok = false;
+    }
+    if (encoding & PE_INDIRECT)
+        c->ok = false;
+    return val;
+}
+
+// Reads the CIE or FDE at addr into buf and points a cursor at the part
+// after the length.
+static bool read_cfi_record(const struct unwind_source *src, uint32_t addr,
+                            uint8_t *buf, struct cfi_cursor *c)
+{
+    uint32_t length;
+    if (!read_word(src, addr, &length) || !length ||
+            length > MAX_CFI_RECORD_SIZE ||
+            !src->read_memory(src->data, addr + 4, buf, length))
+        return false;
+
+    c->p = buf;
+    c->end = buf + length;
+    c->addr = addr + 4;
+    c->ok = true;
+    return true;
+}
+
+static bool read_cie(const struct unwind_source *src, uint32_t addr,
+                     struct cfi_cie *cie)
+{
+    struct cfi_cursor c;
+    if (!read_cfi_record(src, addr, cie->buf, &c) || cfi_uint(&c, 4) != 0)
+        return false;
+
+    uint8_t version = cfi_u8(&c);
+    if (version != 1 && version != 3)
+        return false;
+
+    const char *augmentation = (const char *)c.p;
+    while (c.ok && cfi_u8(&c))
+        ;
+    if (!c.ok)
+        return false;
+    cie->code_align = cfi_uleb128(&c);
+    cie->data_align = cfi_sleb128(&c);
+    cie->ra_reg = version == 1 ? cfi_u8(&c) : cfi_uleb128(&c);
+    cie->fde_encoding = PE_ABSPTR;
+    cie->augmented = augmentation[0] == 'z';
+
+    if (cie->augmented) {
+        uint32_t length = cfi_uleb128(&c);
+        const uint8_t *data = c.p;
+        for (const char *a = augmentation + 1; c.ok && *a; a++) {
+            switch (*a) {
+            case 'R':
+                cie->fde_encoding = cfi_u8(&c);
+                break;
+            case 'P':
+                cfi_pointer(&c, cfi_u8(&c) & ~PE_INDIRECT);
+                break;
+            case 'L':
+                cfi_u8(&c);
+                break;
+            case 'S':
+                break;
+            default:
+                c.ok = false;
+            }
+        }
+        if (!c.ok || c.p - data > length)
+            return false;
+        skip_cfi(&c, length - (c.p - data));
+    } else if (augmentation[0]) {
+        return false;
+    }
+
+    cie->insns = c;
+    return c.ok;
+}
+
+static void set_rule(struct cfi_state *state, uint32_t reg, uint8_t type,
+                     int32_t value)
+{
+    if (reg < UNWIND_REG_COUNT) {
+        state->rules[reg].type = type;
+        state->rules[reg].value = value;
+    }
+}
+
+// Runs call frame instructions until the location passes pc. initial holds
+// the state after the CIE's instructions, for DW_CFA_restore.
+static bool run_cfi(struct cfi_cursor *c, const struct cfi_cie *cie,
+                    struct cfi_state *state, const struct cfi_state *initial,
+                    uint32_t loc, uint32_t pc)
+{
+    struct cfi_state saved[CFI_STATE_STACK_SIZE];
+    int saved_count = 0;
+    while (c->ok && c->p < c->end) {
+        uint8_t op = cfi_u8(c);
+        uint32_t reg, delta = 0;
+        switch (op & 0xc0) {
+        case CFA_ADVANCE_LOC:
+            delta = op & 0x3f;
+            break;
+        case CFA_OFFSET:
+            set_rule(state, op & 0x3f, RULE_OFFSET,
+                     cfi_uleb128(c) * cie->data_align);
+            continue;
+        case CFA_RESTORE:
+            if (initial && (op & 0x3f) < UNWIND_REG_COUNT)
+                state->rules[op & 0x3f] = initial->rules[op & 0x3f];
+            continue;
+        }
+
+        switch (op & 0xc0 ? CFA_NOP : op) {
+        case CFA_NOP:
+            break;
+        case CFA_SET_LOC:
+            loc = cfi_pointer(c, cie->fde_encoding);
+            if (loc > pc)
+                return c->ok;
+            break;
+        case CFA_ADVANCE_LOC1:
+            delta = cfi_uint(c, 1);
+            break;
+        case CFA_ADVANCE_LOC2:
+            delta = cfi_uint(c, 2);
+            break;
+        case CFA_ADVANCE_LOC4:
+            delta = cfi_uint(c, 4);
+            break;
+        case CFA_OFFSET_EXTENDED:
+            reg = cfi_uleb128(c);
+            set_rule(state, reg, RULE_OFFSET,
+                     cfi_uleb128(c) * cie->data_align);
+            break;
+        case CFA_OFFSET_EXTENDED_SF:
+            reg = cfi_uleb128(c);
+            set_rule(state, reg, RULE_OFFSET,
+                     cfi_sleb128(c) * cie->data_align);
+            break;
+        case CFA_GNU_NEGATIVE_OFFSET_EXTENDED:
+            reg = cfi_uleb128(c);
+            set_rule(state, reg, RULE_OFFSET,
+                     -(int32_t)cfi_uleb128(c) * cie->data_align);
+            break;
+        case CFA_VAL_OFFSET:
+            reg = cfi_uleb128(c);
+            set_rule(state, reg, RULE_VAL_OFFSET,
+                     cfi_uleb128(c) * cie->data_align);
+            break;
+        case CFA_VAL_OFFSET_SF:
+            reg = cfi_uleb128(c);
+            set_rule(state, reg, RULE_VAL_OFFSET,
+                     cfi_sleb128(c) * cie->data_align);
+            break;
+        case CFA_RESTORE_EXTENDED:
+            reg = cfi_uleb128(c);
+            if (initial && reg < UNWIND_REG_COUNT)
+                state->rules[reg] = initial->rules[reg];
+            break;
+        case CFA_UNDEFINED:
+            set_rule(state, cfi_uleb128(c), RULE_UNDEFINED, 0);
+            break;
+        case CFA_SAME_VALUE:
+            set_rule(state, cfi_uleb128(c), RULE_SAME_VALUE, 0);
+            break;
+        case CFA_REGISTER:
+            reg = cfi_uleb128(c);
+            set_rule(state, reg, RULE_REGISTER, cfi_uleb128(c));
+            break;
+        case CFA_REMEMBER_STATE:
+            if (saved_count == CFI_STATE_STACK_SIZE)
+                return false;
+            saved[saved_count++] = *state;
+            break;
+        case CFA_RESTORE_STATE:
+            // The CFA rule is restored along with the registers', as GCC's
+            // and LLVM's unwinders do; compilers rely on that around the
+            // early returns in the middle of a function.
+            if (!saved_count)
+                return false;
+            *state = saved[--saved_count];
+            break;
+        case CFA_DEF_CFA:
+            state->cfa_reg = cfi_uleb128(c);
+            state->cfa_offset = cfi_uleb128(c);
+            state->cfa_unsupported = false;
+            break;
+        case CFA_DEF_CFA_SF:
+            state->cfa_reg = cfi_uleb128(c);
+            state->cfa_offset = cfi_sleb128(c) * cie->data_align;
+            state->cfa_unsupported = false;
+            break;
+        case CFA_DEF_CFA_REGISTER:
+            state->cfa_reg = cfi_uleb128(c);
+            break;
+        case CFA_DEF_CFA_OFFSET:
+            state->cfa_offset = cfi_uleb128(c);
+            break;
+        case CFA_DEF_CFA_OFFSET_SF:
+            state->cfa_offset = cfi_sleb128(c) * cie->data_align;
+            break;
+        case CFA_DEF_CFA_EXPRESSION:
+            state->cfa_unsupported = true;
+            skip_cfi(c, cfi_uleb128(c));
+            break;
+        case CFA_EXPRESSION:
+        case CFA_VAL_EXPRESSION:
+            set_rule(state, cfi_uleb128(c), RULE_UNSUPPORTED, 0);
+            skip_cfi(c, cfi_uleb128(c));
+            break;
+        case CFA_GNU_ARGS_SIZE:
+            cfi_uleb128(c);
+            break;
+        default:
+            return false;
+        }
+
+        if (delta) {
+            loc += delta * cie->code_align;
+            if (loc > pc)
+                return c->ok;
+        }
+    }
+    return c->ok && c->p <= c->end;
+}
+
+// Gets the value of a register in the caller from the rule for it.
+static bool apply_rule(const struct cfi_rule *rule, uint32_t reg,
+                       uint32_t cfa, const struct unwind_regs *regs,
+                       const struct stack_snapshot *stack, uint32_t *out)
+{
+    switch (rule->type) {
+    case RULE_SAME_VALUE:
+        *out = regs->r[reg];
+        return regs->valid & (1 << reg);
+    case RULE_OFFSET:
+        return peek(stack, cfa + rule->value, out);
+    case RULE_VAL_OFFSET:
+        *out = cfa + rule->value;
+        return true;
+    case RULE_REGISTER:
+        if (rule->value >= UNWIND_REG_COUNT)
+            return false;
+        *out = regs->r[rule->value];
+        return regs->valid & (1 << rule->value);
+    }
+    return false;
+}
+
+// Steps from the frame in regs to its caller, if the module has CFI for it.
+// The PC of any frame but the innermost is a return address, which may be
+// just past the end of the calling function, so its lookups use the
+// instruction before it.
+static int step_cfi(const struct unwind_source *src,
+                    const struct stack_snapshot *stack,
+                    struct unwind_regs *regs, bool caller)
+{
+    uint32_t pc = regs->r[UNWIND_REG_PC] & ~1;
+    uint32_t lookup_pc = caller ? pc - 1 : pc;
+    struct map *map = get_map_for_addr(src->maps, lookup_pc);
+    if (!map || !map->tables || !map->tables->cfi)
+        return STEP_NONE;
+
+    // Find the last FDE that starts at or before the PC.
+    const struct cfi_entry *entries = map->tables->cfi;
+    uint32_t lo = 0, hi = map->tables->cfi_count;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (entries[mid].pc <= lookup_pc)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if (entries[lo].pc > lookup_pc)
+        return STEP_NONE;
+
+    uint8_t fde_buf[MAX_CFI_RECORD_SIZE];
+    struct cfi_cursor fde;
+    uint32_t fde_addr = entries[lo].fde;
+    if (!read_cfi_record(src, fde_addr, fde_buf, &fde))
+        return STEP_NONE;
+    uint32_t cie_pointer_addr = fde.addr;
+    uint32_t cie_addr = cie_pointer_addr - cfi_uint(&fde, 4);
+
+    struct cfi_cie cie;
+    if (!read_cie(src, cie_addr, &cie))
+        return STEP_NONE;
+    uint32_t start = cfi_pointer(&fde, cie.fde_encoding);
+    uint32_t range = cfi_pointer(&fde, cie.fde_encoding & 0x0f);
+    if (cie.augmented)
+        skip_cfi(&fde, cfi_uleb128(&fde));
+    if (!fde.ok || lookup_pc < start || lookup_pc - start >= range)
+        return STEP_NONE;
+
+    // Registers that no rule mentions keep their values.
+    struct cfi_state initial, state;
+    memset(&initial, '\0', sizeof(initial));
+    initial.cfa_reg = UNWIND_REG_SP;
+    if (!run_cfi(&cie.insns, &cie, &initial, NULL, start, 0xffffffff))
+        return STEP_NONE;
+    state = initial;
+    if (!run_cfi(&fde, &cie, &state, &initial, start, lookup_pc))
+        return STEP_NONE;
+
+    if (state.cfa_unsupported || state.cfa_reg >= UNWIND_REG_COUNT ||
+            !(regs->valid & (1 << state.cfa_reg)) ||
+            cie.ra_reg >= UNWIND_REG_COUNT)
+        return STEP_NONE;
+    if (state.rules[cie.ra_reg].type == RULE_UNDEFINED)
+        return STEP_END;
+
+    uint32_t cfa = regs->r[state.cfa_reg] + state.cfa_offset;
+    struct unwind_regs caller_regs;
+    caller_regs.valid = 0;
+    for (uint32_t reg = 0; reg < UNWIND_REG_COUNT; reg++) {
+        if (apply_rule(&state.rules[reg], reg, cfa, regs, stack,
+                       &caller_regs.r[reg]))
+            caller_regs.valid |= 1 << reg;
+    }
+    if (!(caller_regs.valid & (1 << cie.ra_reg)))
+        return STEP_NONE;
+
+    // The stack only grows down, so a caller's frame is never below ours.
+    uint32_t sp = regs->r[UNWIND_REG_SP];
+    uint32_t ra = caller_regs.r[cie.ra_reg];
+    if (cfa < sp || (cfa == sp && (ra & ~1) == pc))
+        return STEP_NONE;
+
+    caller_regs.r[UNWIND_REG_PC] = ra;
+    caller_regs.r[UNWIND_REG_SP] = cfa;
+    caller_regs.valid |= (1 << UNWIND_REG_PC) | (1 << UNWIND_REG_SP);
+    *regs = caller_regs;
+    return STEP_DONE;
+}
+
+//
+// ARM EHABI
+//
+
+// Gathers the unwind instructions of an .ARM.exidx entry, which are either
+// inline or in .ARM.extab, into a byte string.
+static bool read_ehabi_insns(const struct unwind_source *src,
+                             const struct exidx_entry *entry, uint8_t *insns,
+                             uint32_t *count)
+{
+    uint32_t word = entry->insn, addr = entry->extab, extra_words;
+    int first_byte;
+    if (addr && !read_word(src, addr, &word))
+        return false;
+
+    if (word & 0x80000000) {
+        // The compact model. Personality routine 0 has three bytes of
+        // instructions; 1 and 2 have two and a count of further words.
+        switch ((word >> 24) & 0x7f) {
+        case 0:
+            extra_words = 0;
+            first_byte = 2;
+            break;
+        case 1:
+        case 2:
+            if (!addr)
+                return false;
+            extra_words = (word >> 16) & 0xff;
+            first_byte = 1;
+            break;
+        default:
+            return false;
+        }
+    } else {
+        // The generic model. GCC's and Clang's personality routines keep
+        // their instructions after the routine's address, laid out like
+        // the compact model's, with the count in the top byte.
+        addr += 4;
+        if (!entry->extab || !read_word(src, addr, &word))
+            return false;
+        extra_words = word >> 24;
+        first_byte = 2;
+    }
+    if (extra_words > MAX_EHABI_WORDS)
+        return false;
+
+    uint32_t n = 0;
+    for (int i = first_byte; i >= 0; i--)
+        insns[n++] = word >> (i * 8);
+    for (uint32_t i = 0; i < extra_words; i++) {
+        addr += 4;
+        if (!read_word(src, addr, &word))
+            return false;
+        for (int j = 3; j >= 0; j--)
+            insns[n++] = word >> (j * 8);
+    }
+    *count = n;
+    return true;
+}
+
+// Pops the core registers in mask off the stack at *vsp.
+static bool pop_regs(const struct stack_snapshot *stack,
+                     struct unwind_regs *regs, uint32_t *vsp, uint32_t mask)
+{
+    for (uint32_t reg = 0; reg < UNWIND_REG_COUNT; reg++) {
+        if (!(mask & (1 << reg)))
+            continue;
+        if (!peek(stack, *vsp, &regs->r[reg]))
+            return false;
+        regs->valid |= 1 << reg;
+        *vsp += 4;
+    }
+    // Popping the SP replaces the one we were popping from.
+    if (mask & (1 << UNWIND_REG_SP))
+        *vsp = regs->r[UNWIND_REG_SP];
+    return true;
+}
+
+// Runs EHABI unwind instructions, popping registers into regs and leaving
+// the virtual SP, which starts out as the SP, in *vsp.
+static bool run_ehabi(const uint8_t *insns, uint32_t count,
+                      const struct stack_snapshot *stack,
+                      struct unwind_regs *regs, uint32_t *vsp)
+{
+    uint32_t i = 0;
+    *vsp = regs->r[UNWIND_REG_SP];
+    while (i < count) {
+        uint8_t op = insns[i++], arg = i < count ? insns[i] : 0;
+        if ((op & 0xc0) == 0x00) {
+            *vsp += ((op & 0x3f) << 2) + 4;
+        } else if ((op & 0xc0) == 0x40) {
+            *vsp -= ((op & 0x3f) << 2) + 4;
+        } else if ((op & 0xf0) == 0x80) {
+            // Pop r4-r15 under a mask; an empty one means "refuse to
+            // unwind".
+            uint32_t mask = ((op & 0x0f) << 8) | arg;
+            if (i++ == count || !mask ||
+                    !pop_regs(stack, regs, vsp, mask << 4))
+                return false;
+        } else if ((op & 0xf0) == 0x90) {
+            uint32_t reg = op & 0x0f;
+            if (reg == UNWIND_REG_SP || reg == UNWIND_REG_PC ||
+                    !(regs->valid & (1 << reg)))
+                return false;
+            *vsp = regs->r[reg];
+        } else if ((op & 0xf0) == 0xa0) {
+            // Pop r4-r[4+nnn], and the LR as well if bit 3 is set.
+            uint32_t mask = ((1 << ((op & 0x07) + 1)) - 1) << 4;
+            if (op & 0x08)
+                mask |= 1 << UNWIND_REG_LR;
+            if (!pop_regs(stack, regs, vsp, mask))
+                return false;
+        } else if (op == 0xb0) {
+            break;                                  // finish
+        } else if (op == 0xb1) {
+            if (i++ == count || !arg || (arg & 0xf0) ||
+                    !pop_regs(stack, regs, vsp, arg))
+                return false;
+        } else if (op == 0xb2) {
+            uint32_t val = 0;
+            int shift = 0;
+            uint8_t byte;
+            do {
+                if (i == count)
+                    return false;
+                byte = insns[i++];
+                if (shift < 32)
+                    val |= (uint32_t)(byte & 0x7f) << shift;
+                shift += 7;
+            } while (byte & 0x80);
+            *vsp += 0x204 + (val << 2);
+        } else if (op == 0xb3 || op == 0xc6 || op == 0xc8 || op == 0xc9) {
+            // VFP or iWMMXt registers; FSTMFDX (0xb3) adds a pad word.
+            if (i++ == count)
+                return false;
+            *vsp += ((arg & 0x0f) + 1) * 8 + (op == 0xb3 ? 4 : 0);
+        } else if ((op & 0xf8) == 0xb8) {
+            *vsp += ((op & 0x07) + 1) * 8 + 4;
+        } else if (op == 0xc7) {
+            if (i++ == count || !arg || (arg & 0xf0))
+                return false;
+            *vsp += __builtin_popcount(arg) * 4;
+        } else if ((op & 0xf8) == 0xc0 || (op & 0xf8) == 0xd0) {
+            *vsp += ((op & 0x07) + 1) * 8;
+        } else {
+            return false;                           // spare
+        }
+    }
+    return true;
+}
+
+// Steps from the frame in regs to its caller through the module's
+// .ARM.exidx, like step_cfi().
+static int step_exidx(const struct unwind_source *src,
+                      const struct stack_snapshot *stack,
+                      struct unwind_regs *regs, bool caller)
+{
+    uint32_t pc = regs->r[UNWIND_REG_PC] & ~1;
+    uint32_t lookup_pc = caller ? pc - 1 : pc;
+    struct map *map = get_map_for_addr(src->maps, lookup_pc);
+    if (!map || !map->tables || !map->tables->exidx ||
+            !(regs->valid & (1 << UNWIND_REG_SP)))
+        return STEP_NONE;
+
+    // The entry for the function the PC is in is the last one at or before
+    // it.
+    const struct exidx_entry *entries = map->tables->exidx;
+    uint32_t lo = 0, hi = map->tables->exidx_count;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (entries[mid].pc <= lookup_pc)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if (entries[lo].pc > lookup_pc ||
+            (!entries[lo].extab && entries[lo].insn == EXIDX_CANTUNWIND))
+        return STEP_NONE;
+
+    uint8_t insns[MAX_EHABI_INSNS];
+    uint32_t count, vsp;
+    struct unwind_regs caller_regs = *regs;
+    caller_regs.valid &= ~(1 << UNWIND_REG_PC);
+    if (!read_ehabi_insns(src, &entries[lo], insns, &count) ||
+            !run_ehabi(insns, count, stack, &caller_regs, &vsp))
+        return STEP_NONE;
+
+    // Unless the PC was popped, the caller resumes at the LR, after which
+    // the LR's value in the caller is anyone's guess.
+    if (!(caller_regs.valid & (1 << UNWIND_REG_PC))) {
+        if (!(caller_regs.valid & (1 << UNWIND_REG_LR)))
+            return STEP_NONE;
+        caller_regs.r[UNWIND_REG_PC] = caller_regs.r[UNWIND_REG_LR];
+        caller_regs.valid &= ~(1 << UNWIND_REG_LR);
+    }
+    uint32_t ra = caller_regs.r[UNWIND_REG_PC];
+    if (!ra)
+        return STEP_END;
+
+    // As with CFI, the caller's frame is never below ours.
+    uint32_t sp = regs->r[UNWIND_REG_SP];
+    if (vsp < sp || (vsp == sp && (ra & ~1) == pc))
+        return STEP_NONE;
+
+    caller_regs.r[UNWIND_REG_SP] = vsp;
+    caller_regs.valid |= (1 << UNWIND_REG_PC) | (1 << UNWIND_REG_SP);
+    *regs = caller_regs;
+    return STEP_DONE;
+}
+
+//
+// Frame pointers
+//
+
+// Reads the frame record at fp, in either of the usual layouts. GCC's ARM
+// code points the frame pointer at the saved LR, with the caller's frame
+// pointer below it; Thumb code and Clang point it at the saved frame
+// pointer, with the LR above. The record is good if the return address is
+// in executable code and the chain goes up the stack.
+static bool read_frame_record(const struct unwind_source *src,
+                              const struct stack_snapshot *stack,
+                              uint32_t fp, bool lr_first, uint32_t *next_fp,
+                              uint32_t *ra, uint32_t *caller_sp)
+{
+    uint32_t fp_addr = lr_first ? fp - 4 : fp;
+    uint32_t ra_addr = lr_first ? fp : fp + 4;
+    if (!peek(stack, fp_addr, next_fp) || !peek(stack, ra_addr, ra))
+        return false;
+
+    struct map *map = get_map_for_addr(src->maps, *ra & ~1);
+    if (!map || !map->executable || (*next_fp && *next_fp <= fp))
+        return false;
+    *caller_sp = ra_addr + 4;
+    return true;
+}
+
+// Steps from the frame in regs to its caller through its frame pointer, if
+// its module was marked as having them, like step_cfi(). Only the frame
+// pointer is known in the caller afterwards, besides the PC and SP.
+static int step_fp(const struct unwind_source *src,
+                   const struct stack_snapshot *stack,
+                   struct unwind_regs *regs, bool caller)
+{
+    uint32_t pc = regs->r[UNWIND_REG_PC];
+    struct map *map = get_map_for_addr(src->maps,
+                                       caller ? (pc & ~1) - 1 : pc);
+    if (!map || !map->frame_pointers)
+        return STEP_NONE;
+
+    // A return address says which instruction set its code is in. The
+    // innermost PC doesn't, so try both.
+    uint32_t fp_regs[2] = { UNWIND_REG_ARM_FP, UNWIND_REG_THUMB_FP };
+    int first = caller && (pc & 1) ? 1 : 0;
+    int last = caller && !(pc & 1) ? 0 : 1;
+    for (int i = first; i <= last; i++) {
+        uint32_t reg = fp_regs[i];
+        uint32_t fp = regs->r[reg];
+        if (!(regs->valid & (1 << reg)) || (fp & 0x3) ||
+                fp < regs->r[UNWIND_REG_SP])
+            continue;
+
+        for (int lr_first = 0; lr_first <= 1; lr_first++) {
+            uint32_t next_fp, ra, sp;
+            if (!read_frame_record(src, stack, fp, lr_first, &next_fp, &ra,
+                                   &sp))
+                continue;
+            if (!ra)
+                return STEP_END;
+
+            regs->r[reg] = next_fp;
+            regs->r[UNWIND_REG_PC] = ra;
+            regs->r[UNWIND_REG_SP] = sp;
+            regs->valid = (1 << reg) | (1 << UNWIND_REG_PC) |
+                (1 << UNWIND_REG_SP);
+            return STEP_DONE;
+        }
+    }
+    return STEP_NONE;
+}
+
+//
+// Stack walking
+//
+
+uint32_t unwind_frames(const struct unwind_source *src,
+                       const struct unwind_regs *start_regs,
+                       const struct stack_snapshot *stack, uint32_t *frames,
+                       uint32_t max_frames)
+{
+    if (!max_frames)
+        return 0;
+
+    uint32_t count = 0, cfi_frames = 0, exidx_frames = 0, fp_frames = 0;
+    struct unwind_regs regs = *start_regs;
+    uint32_t pc = regs.r[UNWIND_REG_PC];
+    frames[count++] = pc - 4;
+
+    // Follow the frame pointers and the unwind tables for as long as they
+    // go. Frame pointers are the cheapest, and CFI is preferred to EHABI
+    // where a module has both.
+    int result = STEP_NONE;
+    bool caller = false;
+    while ((regs.valid & (1 << UNWIND_REG_SP)) && count < max_frames) {
+        uint32_t *counter = &fp_frames;
+        result = step_fp(src, stack, &regs, caller);
+        if (result == STEP_NONE) {
+            result = step_cfi(src, stack, &regs, caller);
+            counter = &cfi_frames;
+        }
+        if (result == STEP_NONE) {
+            result = step_exidx(src, stack, &regs, caller);
+            counter = &exidx_frames;
+        }
+        if (result != STEP_DONE)
+            break;
+
+        pc = regs.r[UNWIND_REG_PC] & ~1;
+        if (!pc || in_thread_entry(src, get_map_for_addr(src->maps, pc),
+                                   pc)) {
+            result = STEP_END;
+            break;
+        }
+        frames[count++] = pc;
+        (*counter)++;
+        caller = true;
+    }
+
+    // Then scan. In the innermost frame the link register is the first
+    // return address, if we have it; past that, the scan starts from the
+    // last frame's SP.
+    uint32_t sp = caller ? regs.r[UNWIND_REG_SP] & ~0x3 : stack->sp;
+    uint32_t lr = 0;
+    struct map *map = get_map_for_addr(src->maps, pc - 8);
+    if (!caller && (regs.valid & (1 << UNWIND_REG_LR)))
+        lr = regs.r[UNWIND_REG_LR] & 0xfffffffe;
+
+    assert(!(sp % 4));
+
+#ifdef DEBUG_STACK_WALKING
+    printf(" /* sp: %08x */", sp);
+#endif
+
+    uint32_t first_scanned = count;
+    if (result != STEP_END && !lr) {
+        scan_for_lr(src, stack, &sp, &lr);
+        map = get_map_for_addr(src->maps, lr);
+    }
+    while (result != STEP_END && lr && !in_thread_entry(src, map, lr) &&
+            count < max_frames) {
+        frames[count++] = lr;
+        scan_for_lr(src, stack, &sp, &lr);
+        map = get_map_for_addr(src->maps, lr);
+    }
+
+    if (src->stats) {
+        __sync_fetch_and_add(&src->stats->cfi_frames, cfi_frames);
+        __sync_fetch_and_add(&src->stats->exidx_frames, exidx_frames);
+        __sync_fetch_and_add(&src->stats->fp_frames, fp_frames);
+        __sync_fetch_and_add(&src->stats->scanned_frames,
+                             count - first_scanned);
+    }
+    return count;
+}
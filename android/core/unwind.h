@@ -0,0 +1,167 @@
+/*
+ * piranha/unwind.h
+ *
+ * The stack walker, shared between piranha, which unwinds as it samples,
+ * and piranha-unwind, which unwinds raw captures (piranha -U) on the host.
+ *
+ * Copyright (c) 2011 Mozilla Foundation
+ */
+
+#ifndef UNWIND_H
+#define UNWIND_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "bstrlib.h"
+
+// The length of Bionic's __thread_entry routine. This is obviously a gross
+// hack, of which I am ashamed.
+#define THREAD_ENTRY_LENGTH     0x3c
+
+#define UNWIND_MAX_FRAMES       1024
+
+// The ARM core registers, numbered as in DWARF. Thumb code keeps its frame
+// pointer in r7 and ARM code in r11.
+#define UNWIND_REG_COUNT        16
+#define UNWIND_REG_THUMB_FP     7
+#define UNWIND_REG_ARM_FP       11
+#define UNWIND_REG_SP           13
+#define UNWIND_REG_LR           14
+#define UNWIND_REG_PC           15
+#define UNWIND_ALL_REGS         0xffff
+
+// An entry of a module's .eh_frame_hdr search table, with the addresses
+// made absolute.
+struct cfi_entry {
+    uint32_t pc;        // where the FDE's range starts
+    uint32_t fde;
+};
+
+// An entry of a module's .ARM.exidx, likewise.
+struct exidx_entry {
+    uint32_t pc;        // where the function starts
+    uint32_t insn;      // the unwind instructions, if they fit inline
+    uint32_t extab;     // or where they are in .ARM.extab; zero if inline
+};
+
+// Whether addresses in a module follow a call, by address. Keys are only
+// ever claimed, never removed.
+#define LR_CACHE_BITS           11
+#define LR_CACHE_SIZE           (1 << LR_CACHE_BITS)
+
+struct lr_cache {
+    uint32_t keys[LR_CACHE_SIZE];       // zero if free
+    uint8_t results[LR_CACHE_SIZE];
+};
+
+// Every return address in a module's code, found by looking for the call
+// instructions in it. Bit N + T is set if text_start + N follows a call, T
+// being one for Thumb code (whose return addresses have bit 0 set) and zero
+// otherwise; on x86, bit N alone.
+struct call_site_map {
+    uint32_t machine;       // EM_ARM or EM_386
+    uint32_t text_offset;   // in the file
+    uint32_t text_size;
+    uint8_t bits[];
+};
+
+// A module's unwind tables, and what we've learned about its code. Every map
+// of the module shares them, for as long as the module stays mapped.
+struct unwind_tables {
+    uint32_t refs;      // maps that point at them
+    uint32_t cfi_count;     // zero if there's no .eh_frame_hdr
+    struct cfi_entry *cfi;
+    uint32_t exidx_count;   // zero if there's no .ARM.exidx
+    struct exidx_entry *exidx;
+    struct lr_cache lr_cache;
+
+    // The first executable segment, and its call sites once they're needed.
+    uint16_t machine;
+    uint32_t text_start;
+    uint32_t text_offset;
+    uint32_t text_size;     // zero if there's no executable segment
+    uint32_t call_sites_claimed;    // set by whoever builds the map
+    struct call_site_map *volatile call_sites;
+};
+
+struct map {
+    uint32_t start;
+    uint32_t end;
+    uint32_t offset;
+    bstring name;
+    bool executable;
+    bool frame_pointers;            // follow them through this module (-p)
+    struct unwind_tables *tables;   // NULL if it isn't in an ELF module
+};
+
+// A local copy of the live part of a thread's stack.
+struct stack_snapshot {
+    uint32_t sp;        // target address of words[0]
+    uint32_t size;      // number of valid bytes in words
+    uint32_t *words;
+};
+
+struct unwind_regs {
+    uint32_t r[UNWIND_REG_COUNT];
+    uint32_t valid;     // bit N is set if r[N] is known
+};
+
+// How the frames were found. Updated atomically, since several threads may
+// unwind at once.
+struct unwind_stats {
+    uint32_t cfi_frames;
+    uint32_t exidx_frames;
+    uint32_t fp_frames;
+    uint32_t lr_cache_hits;
+    uint32_t lr_cache_misses;
+    uint32_t lr_cache_saved_reads;  // code reads the hits made unnecessary
+    uint32_t call_site_tests;       // checks the call site maps answered
+    uint32_t call_site_maps_built;
+    uint32_t call_site_maps_loaded; // from the cache directory
+    uint32_t scanned_frames;
+};
+
+// Everything the unwinder knows about the process a stack came from.
+struct unwind_source {
+    bstring maps;                   // of struct map, sorted
+    uint32_t thread_entry_offset;   // of __thread_entry in libc.so
+
+    // Reads the process's memory, live or from its binaries.
+    bool (*read_memory)(void *data, uint32_t addr, void *buf, uint32_t size);
+    void *data;
+
+    // Whether the maps' file names are paths on this machine, to read the
+    // modules' code from. If so, call site maps are kept in
+    // call_site_cache_dir, unless it's NULL, between runs.
+    bool local_files;
+    const char *call_site_cache_dir;
+
+    struct unwind_stats *stats;     // may be NULL
+};
+
+struct map *get_map_for_addr(bstring maps, uint32_t addr);
+
+// Finds the unwind tables of every module in src->maps, reading them through
+// src->read_memory. Maps that are also in old_maps, which may be NULL, take
+// their tables from there instead.
+void load_unwind_tables(const struct unwind_source *src, bstring old_maps);
+
+// Drops the maps' references to their tables, before they are freed.
+void release_unwind_tables(bstring maps);
+
+// Marks the maps of the modules in modules, a comma-separated list of file
+// names or "all", as having frame pointers to follow.
+void mark_frame_pointer_modules(bstring maps, const char *modules);
+
+// Walks a stack given the thread's registers and a snapshot of its stack,
+// storing the program counter of each frame, innermost first, in frames.
+// Frames are found through the frame pointers of the modules marked as having
+// them, then the modules' DWARF CFI or ARM EHABI tables where there are any,
+// and by scanning the stack for return addresses from the first frame that
+// none of those work for. Returns the number of frames.
+uint32_t unwind_frames(const struct unwind_source *src,
+                       const struct unwind_regs *regs,
+                       const struct stack_snapshot *stack, uint32_t *frames,
+                       uint32_t max_frames);
+
+#endif
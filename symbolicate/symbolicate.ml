@@ -211,41 +211,47 @@ module EBML = struct
         seek_out writer.wr_file end_pos
 end
 
-let get_modules f =
-    (* Read until we get to the MEMORY_MAP element. *)
-    while (snd (EBML.read_vint f)) <> EBML.tag_memory_map do
-        (* Skip over size. *)
-        let size = Int32.to_int(fst(EBML.read_vint f)) in
-        let pos = pos_in f in
-        seek_in f (pos + size);
-    done;
-    ignore(EBML.read_vint f);
+let read_memory_region f =
+    let in_io = IO.input_channel f in
+    let region_start = IO.BigEndian.read_real_i32 in_io in
+    let region_end = IO.BigEndian.read_real_i32 in_io in
+    let region_offset = IO.BigEndian.read_real_i32 in_io in
+
+    let region_path = IO.read_string in_io in
+    let region_name = ExtList.List.last
+        (ExtString.String.nsplit region_path "/") in
+
+    {
+        mr_start = region_start;
+        mr_end = region_end;
+        mr_offset = region_offset;
+        mr_name = region_name;
+        mr_path = region_path
+    }
 
-    (* Now look for each MEMORY_REGION element. *)
+(* Gathers the regions of every MEMORY_MAP element; there is one for each
+ * process that was profiled. *)
+let get_modules f =
     let regions = DynArray.create() in
-    while (snd (EBML.read_vint f)) = EBML.tag_memory_region do
+    let file_size = in_channel_length f in
+    while pos_in f < file_size do
+        let tag = snd (EBML.read_vint f) in
         let size = Int32.to_int(fst(EBML.read_vint f)) in
         let pos = pos_in f in
 
-        let in_io = IO.input_channel f in
-        let region_start = IO.BigEndian.read_real_i32 in_io in
-        let region_end = IO.BigEndian.read_real_i32 in_io in
-        let region_offset = IO.BigEndian.read_real_i32 in_io in
-
-        let region_path = IO.read_string in_io in
-        let region_name = ExtList.List.last
-            (ExtString.String.nsplit region_path "/") in
-
-        seek_in f (pos + size);
+        (* Look for each MEMORY_REGION element, skipping anything else. *)
+        if tag = EBML.tag_memory_map then begin
+            while pos_in f < pos + size do
+                let child_tag = snd (EBML.read_vint f) in
+                let child_size = Int32.to_int(fst(EBML.read_vint f)) in
+                let child_pos = pos_in f in
+                if child_tag = EBML.tag_memory_region then
+                    DynArray.add regions (read_memory_region f);
+                seek_in f (child_pos + child_size)
+            done
+        end;
 
-        let region = {
-            mr_start = region_start;
-            mr_end = region_end;
-            mr_offset = region_offset;
-            mr_name = region_name;
-            mr_path = region_path
-        } in
-        DynArray.add regions region
+        seek_in f (pos + size)
     done;
     DynArray.to_array regions
 